@@ -0,0 +1,151 @@
+#ifdef __linux__
+#define _GNU_SOURCE  // for F_GETPIPE_SZ and F_SETPIPE_SZ
+#endif
+
+#include "adapt.h"
+
+// number of reads in a row that must come back with less than a quarter of
+// the block size before it's halved, so bursty streams don't flap
+#define NUM_SHORT_READS_TO_SHRINK 4
+
+/**
+ * The capacity of the pipe the fd refers to, or 0 if it isn't a pipe.
+ */
+int get_pipe_capacity(int fd) {
+#ifdef F_GETPIPE_SZ
+  int capacity = fcntl(fd, F_GETPIPE_SZ);
+  return capacity < 0 ? 0 : capacity;
+#else
+  return 0;
+#endif
+}
+
+// the largest capacity an unprivileged process can give a pipe
+static int max_pipe_capacity(void) {
+  static int max_capacity = -1;
+  if (max_capacity < 0) {
+    max_capacity = 0;
+    FILE *f = fopen("/proc/sys/fs/pipe-max-size", "r");
+    if (f != NULL) {
+      if (fscanf(f, "%d", &max_capacity) != 1) max_capacity = 0;
+      fclose(f);
+    }
+  }
+  return max_capacity;
+}
+
+/**
+ * Raise the capacity of a pipe to at least the given number of bytes, as far
+ * as pipe-max-size allows.
+ */
+static void raise_pipe_capacity(int fd, int *capacity, int min_capacity) {
+#ifdef F_SETPIPE_SZ
+  if (*capacity == 0 || *capacity >= min_capacity) return;
+  int max_capacity = max_pipe_capacity();
+  if (min_capacity > max_capacity) min_capacity = max_capacity;
+  if (*capacity >= min_capacity) return;
+  int new_capacity = fcntl(fd, F_SETPIPE_SZ, min_capacity);
+  if (new_capacity < 0) {
+    DEBUG("fcntl F_SETPIPE_SZ %d: %s", min_capacity, strerror(errno));
+    return;
+  }
+  DEBUG("raised pipe capacity of fd %d to %d bytes", fd, new_capacity);
+  *capacity = new_capacity;
+#endif
+}
+
+// inputs reading more than BLOCKSIZE at once, by how many times their block
+// size was doubled, updated atomically, to tell how large buffers are worth
+// keeping
+static int num_inputs_by_doublings[32];
+
+static inline int doublings_of(int block_size) {
+  int n = 0;
+  while ((BLOCKSIZE << n) < block_size) ++n;
+  return n;
+}
+
+/**
+ * Change the number of bytes the input reads at once, letting buffers keep as
+ * much capacity as the input reading the most needs.
+ */
+static void set_input_block_size(Input *input, int block_size) {
+  int old_doublings = doublings_of(input->block_size);
+  int new_doublings = doublings_of(block_size);
+  if (old_doublings > 0)
+    __atomic_sub_fetch(&num_inputs_by_doublings[old_doublings], 1,
+                       __ATOMIC_RELAXED);
+  if (new_doublings > 0)
+    __atomic_add_fetch(&num_inputs_by_doublings[new_doublings], 1,
+                       __ATOMIC_RELAXED);
+  input->block_size = block_size;
+  int most_doublings = 31;
+  while (most_doublings > 0 &&
+         __atomic_load_n(&num_inputs_by_doublings[most_doublings],
+                         __ATOMIC_RELAXED) == 0)
+    --most_doublings;
+  keep_buffer_capacity(BLOCKSIZE << most_doublings);
+}
+
+/**
+ * Double the number of bytes the input reads at once when a read fills it
+ * up, raising its pipe's capacity to hold as much, and halve it when reads
+ * keep coming back with much less, or none.
+ */
+void adapt_input_block_size(Input *input, int num_bytes_read) {
+  if (!ADAPTIVE_BLOCKSIZE) return;
+  if (num_bytes_read >= input->block_size) {
+    input->num_short_reads = 0;
+    if (input->block_size * 2 > ADAPTIVE_BLOCKSIZE) return;
+    set_input_block_size(input, input->block_size * 2);
+    DEBUG("%s: growing block size to %d bytes", input->name,
+          input->block_size);
+    raise_pipe_capacity(input->fd, &input->pipe_capacity, input->block_size);
+  } else if (num_bytes_read < input->block_size / 4) {
+    if (++input->num_short_reads < NUM_SHORT_READS_TO_SHRINK) return;
+    input->num_short_reads = 0;
+    if (input->block_size / 2 < BLOCKSIZE) return;
+    set_input_block_size(input, input->block_size / 2);
+    DEBUG("%s: shrinking block size to %d bytes", input->name,
+          input->block_size);
+  } else {
+    input->num_short_reads = 0;
+  }
+}
+
+/**
+ * Go back to reading BLOCKSIZE at once when a buffer couldn't be enlarged for
+ * the input's block size within MKMIMO_MAX_MEMORY, rather than trying again
+ * with every read.
+ */
+void reset_input_block_size(Input *input) {
+  if (input->block_size <= BLOCKSIZE) return;
+  DEBUG("%s: no memory for reading %d bytes at once", input->name,
+        input->block_size);
+  set_input_block_size(input, BLOCKSIZE);
+}
+
+/**
+ * Double the capacity of the output's pipe after a write found it full.
+ */
+void adapt_output_pipe_capacity(Output *output) {
+  if (!ADAPTIVE_BLOCKSIZE) return;
+  raise_pipe_capacity(output->fd, &output->pipe_capacity,
+                      output->pipe_capacity * 2);
+}
+
+/**
+ * Print the block size and pipe capacity every stream settled on.
+ */
+void report_stream_sizes(Inputs *inputs, Outputs *outputs) {
+  for (int i = 0; i < inputs->num_inputs; ++i) {
+    Input *input = &inputs->inputs[i];
+    fprintf(stderr, "mkmimo: input %s block=%d pipe=%d\n", input->name,
+            input->block_size, input->pipe_capacity);
+  }
+  for (int i = 0; i < outputs->num_outputs; ++i) {
+    Output *output = &outputs->outputs[i];
+    fprintf(stderr, "mkmimo: output %s pipe=%d\n", output->name,
+            output->pipe_capacity);
+  }
+}
@@ -0,0 +1,17 @@
+#ifndef ADAPT_H
+#define ADAPT_H
+
+#include "mkmimo.h"
+
+// largest number of bytes a stream can read at once, or 0 to keep every
+// stream at BLOCKSIZE
+#define DEFAULT_ADAPTIVE_BLOCKSIZE 0
+extern int ADAPTIVE_BLOCKSIZE;
+
+int get_pipe_capacity(int fd);
+void adapt_input_block_size(Input *input, int num_bytes_read);
+void reset_input_block_size(Input *input);
+void adapt_output_pipe_capacity(Output *output);
+void report_stream_sizes(Inputs *inputs, Outputs *outputs);
+
+#endif /* ADAPT_H */
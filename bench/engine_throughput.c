@@ -0,0 +1,427 @@
+/**
+ * Throughput benchmark for the engines, moving records from producer threads
+ * through pipes into an engine and out to consumer threads, all within one
+ * process, for a matrix of workloads:
+ *   - fast producers and consumers, or slow ones pausing after every chunk
+ *   - small records of 16-255 bytes, mixed ones of 16 bytes-32 KiB, or large
+ *     ones of 64 KiB-2 MiB, log-uniformly distributed
+ *   - 1 or 4 inputs, and 1 or 4 outputs
+ * Every run is forked off, so each engine starts afresh as it would in its own
+ * process, and its records are counted at the consumers to be all there.
+ * Every workload is run a few times, and a tab-separated row of the medians is
+ * printed for it:
+ *   engine  producers  consumers  record_sizes  inputs  outputs  bytes
+ *   num_records  seconds  GB/s  records/s  cpu_s/GB  rw_calls/MB
+ * where the CPU time is the engine's, without the producers' and consumers',
+ * and the calls are its reads and writes of the streams, however many system
+ * calls each took.  The engines take their own parameters from the
+ * environment as usual, e.g., WORKERS.
+ *
+ * Usage: bench/engine_throughput [MIB_PER_RUN [ENGINE...]]
+ */
+#include "../adapt.h"
+#include "../io.h"
+#include "../mkmimo.h"
+#include "../mkmimo_epoll.h"
+#include "../mkmimo_io_uring.h"
+#include "../mkmimo_multithreaded.h"
+#include "../mkmimo_nonblocking.h"
+#include "../mkmimo_sharded.h"
+#include "../splice.h"
+#include "../stats.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+// how long a run may take before it's counted as stuck
+#define RUN_TIMEOUT_SEC 120
+// runs of every workload, whose medians are printed, as a single one is noisy
+#define RUNS_PER_ROW 5
+// bytes of records written over and over by every producer, at least
+#define MIN_PATTERN_SIZE (1 << 20)
+#define MIN_PATTERN_RECORDS 8
+
+typedef struct engine {
+  const char *name;
+  int (*mkmimo)(Inputs *, Outputs *);
+} Engine;
+
+static const Engine engines[] = {
+    {"multithreaded", mkmimo_multithreaded},
+    {"nonblocking", mkmimo_nonblocking},
+    {"epoll", mkmimo_epoll},
+    {"io_uring", mkmimo_io_uring},
+    {"sharded", mkmimo_sharded},
+};
+
+// how producers write and consumers read, pausing after every chunk if slow
+typedef struct pace {
+  const char *name;
+  int chunk_size;
+  long pause_ns;
+} Pace;
+
+static const Pace paces[] = {
+    {"fast", 1 << 20, 0},
+    {"slow", 64 << 10, 100000},
+};
+
+// records of 2^min_bits to 2^(max_bits + 1) - 1 bytes, as many in every
+// power of two
+typedef struct record_sizes {
+  const char *name;
+  int min_bits, max_bits;
+} RecordSizes;
+
+static const RecordSizes record_sizes[] = {
+    {"small", 4, 7},
+    {"mixed", 4, 14},
+    {"large", 16, 20},
+};
+
+static const int stream_counts[][2] = {{1, 1}, {4, 1}, {1, 4}, {4, 4}};
+
+#define LENGTH(array) (sizeof(array) / sizeof(*(array)))
+
+// what a forked run sends back
+typedef struct result {
+  int status;
+  long num_bytes;
+  long num_records;
+  double num_secs;
+  double num_cpu_secs;
+  long num_calls;
+} Result;
+
+typedef struct producer {
+  int fd;
+  const char *pattern;
+  size_t pattern_size;
+  long num_patterns;
+  const Pace *pace;
+  long long cpu_ns;
+} Producer;
+
+typedef struct consumer {
+  int fd;
+  const Pace *pace;
+  long num_bytes;
+  long num_records;
+  long long cpu_ns;
+} Consumer;
+
+static inline uint64_t next_random(uint64_t *seed) {
+  *seed ^= *seed << 13;
+  *seed ^= *seed >> 7;
+  *seed ^= *seed << 17;
+  return *seed;
+}
+
+static inline long long thread_cpu_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static inline void pause_for(const Pace *pace) {
+  if (pace->pause_ns == 0) return;
+  struct timespec ts = {0, pace->pause_ns};
+  nanosleep(&ts, NULL);
+}
+
+/**
+ * Lay out newline-terminated records of the given sizes, returning how many.
+ */
+static long make_pattern(const RecordSizes *sizes, char **pattern,
+                         size_t *pattern_size) {
+  uint64_t seed = 88172645463325252ULL;
+  size_t size = 0, capacity = MIN_PATTERN_SIZE;
+  char *records = malloc(capacity);
+  long num_records = 0;
+  while (size < MIN_PATTERN_SIZE || num_records < MIN_PATTERN_RECORDS) {
+    int bits = sizes->min_bits +
+               next_random(&seed) % (sizes->max_bits - sizes->min_bits + 1);
+    size_t len = (1 << bits) + next_random(&seed) % (1 << bits);
+    while (size + len > capacity) records = realloc(records, capacity *= 2);
+    memset(records + size, 'a' + num_records % 26, len - 1);
+    records[size + len - 1] = '\n';
+    size += len;
+    ++num_records;
+  }
+  *pattern = records;
+  *pattern_size = size;
+  return num_records;
+}
+
+static void *produce(void *arg) {
+  Producer *producer = arg;
+  for (long i = 0; i < producer->num_patterns; ++i) {
+    for (size_t offset = 0; offset < producer->pattern_size;) {
+      size_t len = producer->pattern_size - offset;
+      if (len > producer->pace->chunk_size) len = producer->pace->chunk_size;
+      ssize_t num_bytes_written =
+          write(producer->fd, producer->pattern + offset, len);
+      if (num_bytes_written < 0 && errno == EINTR) continue;
+      if (num_bytes_written < 0) {
+        perror("write");
+        goto done;
+      }
+      offset += num_bytes_written;
+      pause_for(producer->pace);
+    }
+  }
+done:
+  close(producer->fd);
+  producer->cpu_ns = thread_cpu_ns();
+  return NULL;
+}
+
+static void *consume(void *arg) {
+  Consumer *consumer = arg;
+  char *buf = malloc(consumer->pace->chunk_size);
+  for (;;) {
+    ssize_t num_bytes_read =
+        read(consumer->fd, buf, consumer->pace->chunk_size);
+    if (num_bytes_read < 0 && errno == EINTR) continue;
+    if (num_bytes_read < 0) perror("read");
+    if (num_bytes_read <= 0) break;
+    consumer->num_bytes += num_bytes_read;
+    for (char *p = buf; (p = memchr(p, '\n', buf + num_bytes_read - p));
+         ++p)
+      ++consumer->num_records;
+    pause_for(consumer->pace);
+  }
+  close(consumer->fd);
+  free(buf);
+  consumer->cpu_ns = thread_cpu_ns();
+  return NULL;
+}
+
+static inline double cpu_secs(struct rusage *usage) {
+  return usage->ru_utime.tv_sec + usage->ru_utime.tv_usec / 1e6 +
+         usage->ru_stime.tv_sec + usage->ru_stime.tv_usec / 1e6;
+}
+
+static char *stream_name(const char *kind, int i) {
+  char *name = malloc(16);
+  snprintf(name, 16, "%s.%d", kind, i + 1);
+  return name;
+}
+
+/**
+ * Run an engine between producers and consumers connected with pipes, the
+ * way main does with the files it opens, and check every record came out.
+ */
+static Result run_engine(const Engine *engine, const Pace *producer_pace,
+                         const Pace *consumer_pace, const RecordSizes *sizes,
+                         int num_inputs, int num_outputs, long num_bytes) {
+  Result result = {0};
+  char *pattern;
+  size_t pattern_size;
+  long num_pattern_records = make_pattern(sizes, &pattern, &pattern_size);
+  long num_patterns =
+      (num_bytes / num_inputs + pattern_size - 1) / pattern_size;
+
+  Inputs inputs = {.num_inputs = num_inputs, .last_closed = num_inputs};
+  inputs.inputs = calloc(num_inputs, sizeof(Input));
+  Producer producers[num_inputs];
+  for (int i = 0; i < num_inputs; ++i) {
+    int fds[2];
+    if (pipe(fds) < 0) {
+      perror("pipe");
+      exit(1);
+    }
+    Input this = {
+        .fd = fds[0],
+        .name = stream_name("in", i),
+        .block_size = BLOCKSIZE,
+        .pipe_capacity = get_pipe_capacity(fds[0]),
+        .stats = calloc(1, sizeof(StreamStats)),
+    };
+    inputs.inputs[i] = this;
+    producers[i] = (Producer){fds[1], pattern, pattern_size, num_patterns,
+                              producer_pace};
+  }
+  Outputs outputs = {.num_outputs = num_outputs, .last_closed = num_outputs};
+  outputs.outputs = calloc(num_outputs, sizeof(Output));
+  Consumer consumers[num_outputs];
+  for (int i = 0; i < num_outputs; ++i) {
+    int fds[2];
+    if (pipe(fds) < 0) {
+      perror("pipe");
+      exit(1);
+    }
+    Output this = {
+        .fd = fds[1],
+        .name = stream_name("out", i),
+        .spliced = new_spliced_pipe(fds[1]),
+        .pipe_capacity = get_pipe_capacity(fds[1]),
+        .stats = calloc(1, sizeof(StreamStats)),
+    };
+    outputs.outputs[i] = this;
+    consumers[i] = (Consumer){fds[0], consumer_pace};
+  }
+
+  struct rusage usage_before, usage_after;
+  getrusage(RUSAGE_SELF, &usage_before);
+  long long start_ns = now_ns();
+  pthread_t producer_threads[num_inputs], consumer_threads[num_outputs];
+  for (int i = 0; i < num_outputs; ++i)
+    CHECK_ERRNO(pthread_create, &consumer_threads[i], NULL, consume,
+                &consumers[i]);
+  for (int i = 0; i < num_inputs; ++i)
+    CHECK_ERRNO(pthread_create, &producer_threads[i], NULL, produce,
+                &producers[i]);
+  result.status = engine->mkmimo(&inputs, &outputs);
+  // closing the streams the engine left open, as main does
+  for (int i = 0; i < num_inputs; ++i) {
+    CHECK_ERRNO(pthread_join, producer_threads[i], NULL);
+    if (!inputs.inputs[i].is_closed) close(inputs.inputs[i].fd);
+  }
+  for (int i = 0; i < num_outputs; ++i) {
+    if (!outputs.outputs[i].is_closed) close(outputs.outputs[i].fd);
+    CHECK_ERRNO(pthread_join, consumer_threads[i], NULL);
+  }
+  result.num_secs = (now_ns() - start_ns) / 1e9;
+  getrusage(RUSAGE_SELF, &usage_after);
+
+  long long num_ns_elsewhere = 0;
+  for (int i = 0; i < num_inputs; ++i) num_ns_elsewhere += producers[i].cpu_ns;
+  for (int i = 0; i < num_outputs; ++i) {
+    num_ns_elsewhere += consumers[i].cpu_ns;
+    result.num_bytes += consumers[i].num_bytes;
+    result.num_records += consumers[i].num_records;
+  }
+  result.num_cpu_secs = cpu_secs(&usage_after) - cpu_secs(&usage_before) -
+                        num_ns_elsewhere / 1e9;
+  result.num_calls = io_stats.num_reads + io_stats.num_writes;
+  if (result.num_bytes != num_inputs * num_patterns * pattern_size ||
+      result.num_records != num_inputs * num_patterns * num_pattern_records) {
+    fprintf(stderr, "%s: got %ld bytes in %ld records instead of %zu in %ld\n",
+            engine->name, result.num_bytes, result.num_records,
+            num_inputs * num_patterns * pattern_size,
+            num_inputs * num_patterns * num_pattern_records);
+    if (result.status == 0) result.status = 1;
+  }
+  return result;
+}
+
+/**
+ * Fork off a run, returning -1 if it failed.
+ */
+static int run(const Engine *engine, const Pace *producer_pace,
+               const Pace *consumer_pace, const RecordSizes *sizes,
+               int num_inputs, int num_outputs, long num_bytes,
+               Result *result) {
+  int fds[2];
+  if (pipe(fds) < 0) {
+    perror("pipe");
+    exit(1);
+  }
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    exit(1);
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    alarm(RUN_TIMEOUT_SEC);
+    // writes to a consumer gone fail like they do in main
+    signal(SIGPIPE, SIG_IGN);
+    IO_REPORT = 1;
+    Result result = run_engine(engine, producer_pace, consumer_pace, sizes,
+                               num_inputs, num_outputs, num_bytes);
+    if (write(fds[1], &result, sizeof(result)) != sizeof(result)) _exit(1);
+    _exit(0);
+  }
+  close(fds[1]);
+  ssize_t num_bytes_read = read(fds[0], result, sizeof(*result));
+  close(fds[0]);
+  int status;
+  waitpid(pid, &status, 0);
+  if (num_bytes_read != sizeof(*result) || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 0 || result->status != 0) {
+    fprintf(stderr, "%s: failed with %s producers, %s consumers, %s records, "
+                    "%d inputs, and %d outputs\n",
+            engine->name, producer_pace->name, consumer_pace->name,
+            sizes->name, num_inputs, num_outputs);
+    return -1;
+  }
+  return 0;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+static double median(double values[RUNS_PER_ROW]) {
+  qsort(values, RUNS_PER_ROW, sizeof(double), compare_doubles);
+  return values[RUNS_PER_ROW / 2];
+}
+
+/**
+ * Run a workload a few times, and print the row of the medians of its runs,
+ * returning -1 if any failed.
+ */
+static int run_row(const Engine *engine, const Pace *producer_pace,
+                   const Pace *consumer_pace, const RecordSizes *sizes,
+                   int num_inputs, int num_outputs, long num_bytes) {
+  Result result;
+  double secs[RUNS_PER_ROW], cpu_secs[RUNS_PER_ROW], calls[RUNS_PER_ROW];
+  for (int r = 0; r < RUNS_PER_ROW; ++r) {
+    if (run(engine, producer_pace, consumer_pace, sizes, num_inputs,
+            num_outputs, num_bytes, &result) < 0)
+      return -1;
+    secs[r] = result.num_secs;
+    cpu_secs[r] = result.num_cpu_secs;
+    calls[r] = result.num_calls;
+  }
+  double num_gb = result.num_bytes / 1e9;
+  double num_secs = median(secs);
+  printf("%s\t%s\t%s\t%s\t%d\t%d\t%ld\t%ld\t%.6f\t%.3f\t%.0f\t%.3f\t%.1f\n",
+         engine->name, producer_pace->name, consumer_pace->name, sizes->name,
+         num_inputs, num_outputs, result.num_bytes, result.num_records,
+         num_secs, num_gb / num_secs, result.num_records / num_secs,
+         median(cpu_secs) / num_gb, median(calls) / (num_gb * 1000));
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  long num_bytes = (argc > 1 ? atol(argv[1]) : 32) << 20;
+  // every engine, unless some are named
+  const Engine *selected[LENGTH(engines)];
+  int num_selected = 0;
+  for (int i = 0; i < LENGTH(engines); ++i) {
+    bool is_named = argc <= 2;
+    for (int j = 2; j < argc; ++j)
+      if (!strcmp(argv[j], engines[i].name)) is_named = true;
+    if (is_named) selected[num_selected++] = &engines[i];
+  }
+  for (int j = 2; j < argc; ++j) {
+    bool is_known = false;
+    for (int i = 0; i < LENGTH(engines); ++i)
+      if (!strcmp(argv[j], engines[i].name)) is_known = true;
+    if (!is_known) {
+      fprintf(stderr, "%s: Invalid engine\n", argv[j]);
+      return 1;
+    }
+  }
+
+  int status = 0;
+  printf("engine\tproducers\tconsumers\trecord_sizes\tinputs\toutputs\tbytes\t"
+         "num_records\tseconds\tGB/s\trecords/s\tcpu_s/GB\trw_calls/MB\n");
+  for (int e = 0; e < num_selected; ++e)
+    for (int c = 0; c < LENGTH(stream_counts); ++c)
+      for (int s = 0; s < LENGTH(record_sizes); ++s)
+        for (int p = 0; p < LENGTH(paces); ++p)
+          for (int q = 0; q < LENGTH(paces); ++q)
+            if (run_row(selected[e], &paces[p], &paces[q], &record_sizes[s],
+                        stream_counts[c][0], stream_counts[c][1],
+                        num_bytes) < 0)
+              status = 1;
+  return status;
+}
@@ -0,0 +1,117 @@
+/**
+ * Contention benchmark for the buffer pools of the multithreaded
+ * implementation, comparing the lock-free ring against a mutex/condition
+ * variable protected queue like the one it replaced.
+ *
+ * Every thread repeatedly takes an element from a shared pool and puts it
+ * back, like the input and output threads do with buffers, for a growing
+ * number of threads.  Prints a tab-separated row per run:
+ *   queue  threads  ops  seconds  ops/sec
+ *
+ * Usage: bench/ring_contention [TOTAL_OPS [MAX_THREADS]]
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include "../ring.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define POOL_CAPACITY 256
+
+// a bounded queue behind a single lock as the baseline
+typedef struct locked_queue {
+  void *elems[POOL_CAPACITY];
+  int first, size;
+  pthread_mutex_t lock;
+  pthread_cond_t is_non_empty;
+  pthread_cond_t is_non_full;
+} LockedQueue;
+
+static void locked_push(LockedQueue *q, void *elem) {
+  pthread_mutex_lock(&q->lock);
+  while (q->size == POOL_CAPACITY) pthread_cond_wait(&q->is_non_full, &q->lock);
+  q->elems[(q->first + q->size++) % POOL_CAPACITY] = elem;
+  pthread_cond_signal(&q->is_non_empty);
+  pthread_mutex_unlock(&q->lock);
+}
+
+static void *locked_pop(LockedQueue *q) {
+  pthread_mutex_lock(&q->lock);
+  while (q->size == 0) pthread_cond_wait(&q->is_non_empty, &q->lock);
+  void *elem = q->elems[q->first];
+  q->first = (q->first + 1) % POOL_CAPACITY;
+  --q->size;
+  pthread_cond_signal(&q->is_non_full);
+  pthread_mutex_unlock(&q->lock);
+  return elem;
+}
+
+typedef struct bench {
+  const char *name;
+  void (*push)(void *pool, void *elem);
+  void *(*pop)(void *pool);
+  void *pool;
+  long num_ops_per_thread;
+} Bench;
+
+static void ring_push_(void *pool, void *elem) { ring_push(pool, elem); }
+static void *ring_pop_(void *pool) { return ring_pop(pool); }
+static void locked_push_(void *pool, void *elem) { locked_push(pool, elem); }
+static void *locked_pop_(void *pool) { return locked_pop(pool); }
+
+static void *cycle_elements(void *arg) {
+  Bench *b = arg;
+  for (long i = 0; i < b->num_ops_per_thread; i += 2)
+    b->push(b->pool, b->pop(b->pool));
+  return NULL;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void run(Bench *b, int num_threads, long num_ops) {
+  // keep the pool half full, so threads rarely have to block
+  static int elems[POOL_CAPACITY / 2];
+  for (int i = 0; i < POOL_CAPACITY / 2; ++i) b->push(b->pool, &elems[i]);
+  b->num_ops_per_thread = num_ops / num_threads;
+  pthread_t threads[num_threads];
+  double start = now();
+  for (int i = 0; i < num_threads; ++i)
+    if (pthread_create(&threads[i], NULL, cycle_elements, b)) {
+      perror("pthread_create");
+      exit(1);
+    }
+  for (int i = 0; i < num_threads; ++i) pthread_join(threads[i], NULL);
+  double elapsed = now() - start;
+  long total = b->num_ops_per_thread * num_threads;
+  printf("%s\t%d\t%ld\t%.6f\t%.0f\n", b->name, num_threads, total, elapsed,
+         total / elapsed);
+  fflush(stdout);
+  for (int i = 0; i < POOL_CAPACITY / 2; ++i) b->pop(b->pool);
+}
+
+int main(int argc, char *argv[]) {
+  long num_ops = argc > 1 ? atol(argv[1]) : 4000000;
+  int max_threads = argc > 2 ? atoi(argv[2]) : 128;
+
+  LockedQueue locked = {
+      .lock = PTHREAD_MUTEX_INITIALIZER,
+      .is_non_empty = PTHREAD_COND_INITIALIZER,
+      .is_non_full = PTHREAD_COND_INITIALIZER,
+  };
+  Bench benches[] = {
+      {"ring", ring_push_, ring_pop_, new_ring(POOL_CAPACITY)},
+      {"mutex", locked_push_, locked_pop_, &locked},
+  };
+
+  printf("queue\tthreads\tops\tseconds\tops/sec\n");
+  for (int n = 1; n <= max_threads; n *= 2)
+    for (int i = 0; i < sizeof(benches) / sizeof(*benches); ++i)
+      run(&benches[i], n, num_ops);
+  return 0;
+}
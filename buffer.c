@@ -1,8 +1,170 @@
+#ifdef __linux__
+#define _GNU_SOURCE  // for MAP_ANONYMOUS, MAP_HUGETLB, and madvise(2)
+#endif
+
 #include "buffer.h"
 #include "mkmimo.h"
+#include "framer.h"
+#include "ring.h"
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+
+// size of the huge pages arenas are aligned to
+#define HUGE_PAGE_SIZE (2 << 20)  // 2MiB
+
+// how many ends of records are found in one go when counting them
+#define MAX_RECORDS_COUNTED_AT_ONCE 256
+
+MemoryStats memory_stats;
+
+// signaled whenever memory for buffers is released
+static Event is_memory_released;
+// memory released only at the end, e.g., the arenas, and memory held by the
+// buffers waiting for more, neither of which records can wait for, updated
+// atomically
+static long num_bytes_kept;
+static size_t num_bytes_held_waiting;
+
+// capacity buffers enlarged for reading blocks keep when cleared, as inputs
+// would enlarge them again right away
+static int capacity_kept;
+
+// size of the slabs carved from arenas, and whether any arena is backed by
+// explicit huge pages, whose slabs can't be remapped one by one
+static size_t slab_size;
+static bool has_explicit_huge_pages;
+
+static inline size_t round_up(size_t size, size_t alignment) {
+  return (size + alignment - 1) / alignment * alignment;
+}
+
+/**
+ * Account for memory about to be allocated, returning false without doing so
+ * if it should be within the budget but would exceed it.
+ */
+bool reserve_memory(size_t num_bytes, bool within_budget) {
+  size_t in_use = __atomic_add_fetch(&memory_stats.num_bytes_in_use, num_bytes,
+                                     __ATOMIC_SEQ_CST);
+  if (within_budget && MKMIMO_MAX_MEMORY > 0 && in_use > MKMIMO_MAX_MEMORY) {
+    __atomic_sub_fetch(&memory_stats.num_bytes_in_use, num_bytes,
+                       __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&memory_stats.num_growths_denied, 1, __ATOMIC_RELAXED);
+    return false;
+  }
+  size_t peak =
+      __atomic_load_n(&memory_stats.peak_num_bytes_in_use, __ATOMIC_RELAXED);
+  while (in_use > peak &&
+         !__atomic_compare_exchange_n(&memory_stats.peak_num_bytes_in_use,
+                                      &peak, in_use, true, __ATOMIC_RELAXED,
+                                      __ATOMIC_RELAXED))
+    continue;
+  return true;
+}
+
+/**
+ * Account for memory freed, letting those waiting for some try again.
+ */
+void release_memory(size_t num_bytes) {
+  __atomic_sub_fetch(&memory_stats.num_bytes_in_use, num_bytes,
+                     __ATOMIC_SEQ_CST);
+  notify_event(&is_memory_released, INT_MAX);
+}
+
+/**
+ * Account for memory reserved that's released only at the end, or released
+ * at last with a negative number of bytes.
+ */
+void keep_memory(long num_bytes) {
+  __atomic_add_fetch(&num_bytes_kept, num_bytes, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Touch every page of the arena, so no time is spent on page faults later.
+ */
+static inline void prefault(void *arena, size_t size) {
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  for (size_t offset = 0; offset < size; offset += page_size)
+    ((volatile char *)arena)[offset] = 0;
+}
+
+/**
+ * Map a region of memory to carve the data of many buffers from, backed by
+ * huge pages if requested, so accessing them takes fewer TLB entries.
+ */
+static void *new_arena(size_t size) {
+  void *arena = MAP_FAILED;
+#if defined(MAP_ANONYMOUS)
+#if defined(MAP_HUGETLB)
+  if (HUGEPAGES == 2) {
+    // explicit huge pages, which must be reserved by the system beforehand
+    arena = mmap(NULL, round_up(size, HUGE_PAGE_SIZE), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (arena == MAP_FAILED)
+      DEBUG("mmap MAP_HUGETLB: %s, falling back to transparent huge pages",
+            strerror(errno));
+    else
+      has_explicit_huge_pages = true;
+  }
+#endif
+  if (arena == MAP_FAILED && HUGEPAGES > 0) {
+    // transparent huge pages, where the arena is aligned to the huge page
+    // size by trimming an oversized mapping, so all of it can be promoted
+    size_t aligned_size = round_up(size, HUGE_PAGE_SIZE);
+    char *mapped = mmap(NULL, aligned_size + HUGE_PAGE_SIZE,
+                        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                        -1, 0);
+    if (mapped == MAP_FAILED) {
+      perror("mmap");
+      return NULL;
+    }
+    char *aligned = (char *)round_up((uintptr_t)mapped, HUGE_PAGE_SIZE);
+    if (aligned > mapped) munmap(mapped, aligned - mapped);
+    munmap(aligned + aligned_size, mapped + HUGE_PAGE_SIZE - aligned);
+    arena = aligned;
+#ifdef MADV_HUGEPAGE
+    if (madvise(arena, aligned_size, MADV_HUGEPAGE) < 0)
+      DEBUG("madvise MADV_HUGEPAGE: %s", strerror(errno));
+#endif
+  }
+  if (arena == MAP_FAILED) {
+    arena = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (arena == MAP_FAILED) {
+      perror("mmap");
+      return NULL;
+    }
+  }
+#else
+  if (posix_memalign(&arena, sysconf(_SC_PAGESIZE), size)) {
+    perror("posix_memalign");
+    return NULL;
+  }
+#endif
+  if (PREFAULT) prefault(arena, size);
+  reserve_memory(size, false);
+  keep_memory(size);
+  return arena;
+}
+
+static inline void init_buffer(Buffer *buf, void *data, void *slab) {
+  buf->data = data;
+  buf->slab = slab;
+  buf->capacity = BLOCKSIZE;
+  buf->begin = 0;
+  buf->size = 0;
+  buf->end_of_last_record = -1;
+  buf->records_begin = 0;
+  buf->read_ns = buf->taken_ns = 0;
+  buf->counted_size = -1;
+  buf->num_bytes_held_waiting = 0;
+  buf->is_gifted = false;
+  buf->owner = buf;
+  buf->num_refs = 1;
+}
 
 Buffer *new_buffer() {
   Buffer *buf = malloc(sizeof(Buffer));
@@ -10,33 +172,364 @@ Buffer *new_buffer() {
     perror("malloc");
     return NULL;
   }
-  buf->data = malloc(BLOCKSIZE);
-  if (buf->data == NULL) {
+  void *data = malloc(BLOCKSIZE);
+  if (data == NULL) {
     perror("malloc");
     return NULL;
   }
-  buf->capacity = BLOCKSIZE;
-  buf->begin = 0;
-  buf->size = 0;
-  buf->end_of_last_record = -1;
+  reserve_memory(BLOCKSIZE, false);
+  keep_memory(BLOCKSIZE);
+  init_buffer(buf, data, NULL);
   return buf;
 }
 
+/**
+ * Create buffers whose headers are laid out contiguously, so a buffer can be
+ * identified by its index in the array, and whose data are page-aligned slabs
+ * of a single arena.
+ */
+Buffer *new_buffers(int num_buffers) {
+  Buffer *bufs = calloc(num_buffers, sizeof(Buffer));
+  if (bufs == NULL) {
+    perror("calloc");
+    return NULL;
+  }
+  slab_size = round_up(BLOCKSIZE, sysconf(_SC_PAGESIZE));
+  char *arena = new_arena(slab_size * num_buffers);
+  if (arena == NULL) return NULL;
+  DEBUG("Carved %d buffers of %zu bytes from arena %p", num_buffers, slab_size,
+        arena);
+  for (int i = 0; i < num_buffers; ++i) {
+    char *slab = arena + i * slab_size;
+    init_buffer(&bufs[i], slab, slab);
+  }
+  return bufs;
+}
+
+/**
+ * Let cleared buffers keep up to the given capacity, the largest block size
+ * the inputs adapted to, unless memory is bounded and others may be waiting
+ * for it.
+ */
+void keep_buffer_capacity(int capacity) {
+  __atomic_store_n(&capacity_kept, capacity, __ATOMIC_RELAXED);
+}
+
+// memory the buffer holds beyond its slab or initial size, released once it's
+// cleared
+static inline size_t memory_beyond_base(Buffer *buf) {
+  if (buf->owner != buf || buf->data == buf->slab) return 0;
+  return buf->slab != NULL ? buf->capacity : buf->capacity - BLOCKSIZE;
+}
+
+static inline void start_waiting_for_memory(Buffer *buf) {
+  if (buf->num_bytes_held_waiting > 0) return;
+  buf->num_bytes_held_waiting = memory_beyond_base(buf);
+  __atomic_add_fetch(&num_bytes_held_waiting, buf->num_bytes_held_waiting,
+                     __ATOMIC_SEQ_CST);
+}
+
+static inline void stop_waiting_for_memory(Buffer *buf) {
+  if (buf->num_bytes_held_waiting == 0) return;
+  __atomic_sub_fetch(&num_bytes_held_waiting, buf->num_bytes_held_waiting,
+                     __ATOMIC_SEQ_CST);
+  buf->num_bytes_held_waiting = 0;
+}
+
+/**
+ * Whether any memory is held other than what's kept until the end or by
+ * buffers waiting for more, which is all that could be released for them.
+ */
+static inline bool may_memory_be_released(void) {
+  size_t in_use =
+      __atomic_load_n(&memory_stats.num_bytes_in_use, __ATOMIC_SEQ_CST);
+  return in_use > __atomic_load_n(&num_bytes_kept, __ATOMIC_SEQ_CST) +
+                      __atomic_load_n(&num_bytes_held_waiting,
+                                      __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Account for memory about to be allocated to hold records aside, waiting
+ * while it would exceed the budget for other buffers to release some, like
+ * inputs do under backpressure, but going beyond it once none could, as the
+ * given number of bytes the caller holds already can't be released meanwhile.
+ */
+void reserve_memory_waiting(size_t num_bytes, size_t num_bytes_held) {
+  if (reserve_memory(num_bytes, true)) return;
+  __atomic_add_fetch(&num_bytes_held_waiting, num_bytes_held,
+                     __ATOMIC_SEQ_CST);
+  for (;;) {
+    unsigned seq;
+    prepare_to_wait(&is_memory_released, &seq);
+    if (reserve_memory(num_bytes, true)) {
+      cancel_wait(&is_memory_released);
+      break;
+    }
+    if (!may_memory_be_released()) {
+      cancel_wait(&is_memory_released);
+      reserve_memory(num_bytes, false);
+      break;
+    }
+    wait_for_event(&is_memory_released, seq);
+  }
+  __atomic_sub_fetch(&num_bytes_held_waiting, num_bytes_held,
+                     __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Whether the buffer's data can be given away to a pipe with vmsplice(2), which
+ * is only possible for whole slabs of its own whose pages can be replaced.
+ */
+bool may_gift_buffer(Buffer *buf) {
+#if defined(MAP_ANONYMOUS)
+  return !has_explicit_huge_pages && buf->slab != NULL &&
+         buf->data == buf->slab && buf->owner == buf;
+#else
+  return false;
+#endif
+}
+
+/**
+ * Replace the pages of a slab given away to a pipe with fresh ones, as the
+ * reader on the other end may still be referring to the old ones, e.g., when
+ * it splices or tees them further, so they must never be written again.
+ */
+static void replace_gifted_pages(Buffer *buf) {
+  buf->is_gifted = false;
+#if defined(MAP_ANONYMOUS)
+  if (mmap(buf->slab, slab_size, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED)
+    return;
+  DEBUG("mmap MAP_FIXED: %s, leaving the slab %p to the pipe", strerror(errno),
+        buf->slab);
+#endif
+  // let the pipe keep the slab for good, and hold the data elsewhere
+  void *data = malloc(BLOCKSIZE);
+  if (data == NULL) {
+    perror("malloc");
+    abort();
+  }
+  reserve_memory(BLOCKSIZE, false);
+  keep_memory(BLOCKSIZE);
+  buf->data = data;
+  buf->slab = NULL;
+  buf->capacity = BLOCKSIZE;
+}
+
+/**
+ * Empty the buffer, shrinking it back to its initial size if it was enlarged
+ * beyond what inputs read at once, so the memory taken by a large record isn't
+ * held on to.
+ */
 void clear_buffer(Buffer *buf) {
-  buf->begin = buf->size = 0;
+  stop_waiting_for_memory(buf);
+  if (buf->is_gifted) replace_gifted_pages(buf);
+  buf->begin = buf->size = buf->records_begin = 0;
   buf->end_of_last_record = -1;
+  buf->read_ns = buf->taken_ns = 0;
+  buf->counted_size = -1;
+  if (buf->capacity <= BLOCKSIZE) return;
+  if (MKMIMO_MAX_MEMORY == 0 &&
+      buf->capacity <= __atomic_load_n(&capacity_kept, __ATOMIC_RELAXED))
+    return;
+  if (buf->slab != NULL) {
+    free(buf->data);
+    buf->data = buf->slab;
+    release_memory(buf->capacity);
+  } else {
+    void *buf_smaller = realloc(buf->data, BLOCKSIZE);
+    if (buf_smaller == NULL) return;
+    buf->data = buf_smaller;
+    release_memory(buf->capacity - BLOCKSIZE);
+  }
+  buf->capacity = BLOCKSIZE;
+}
+
+// memory needed for enlarging the buffer, as slabs stay in their arena
+static inline size_t cost_of_enlarging(Buffer *buf, size_t new_capacity) {
+  return buf->data == buf->slab ? new_capacity : new_capacity - buf->capacity;
 }
 
-void enlarge_buffer(Buffer *buf, size_t new_capacity) {
-  void *buf_larger = realloc(buf->data, new_capacity);
-  if (buf_larger != NULL) {
-    buf->data = buf_larger;
-    buf->capacity = new_capacity;
+static int resize_buffer(Buffer *buf, size_t new_capacity,
+                         bool within_budget) {
+  size_t cost = cost_of_enlarging(buf, new_capacity);
+  if (!reserve_memory(cost, within_budget)) {
+    DEBUG(" enlarging buffer %p to %zu bytes would exceed MKMIMO_MAX_MEMORY",
+          buf, new_capacity);
+    return -1;
+  }
+  void *buf_larger;
+  if (buf->data == buf->slab) {
+    // slabs can't be resized, so move the data out of the arena
+    buf_larger = malloc(new_capacity);
+    if (buf_larger != NULL) memcpy(buf_larger, buf->data, buf->capacity);
   } else {
+    buf_larger = realloc(buf->data, new_capacity);
+  }
+  if (buf_larger == NULL) {
     perror("realloc");
-    // TODO handle out of memory more gracefully?
+    release_memory(cost);
+    return -1;
+  }
+  buf->data = buf_larger;
+  buf->capacity = new_capacity;
+  return 0;
+}
+
+/**
+ * Enlarge the buffer within MKMIMO_MAX_MEMORY, returning -1 if it can't be.
+ */
+int enlarge_buffer(Buffer *buf, size_t new_capacity) {
+  return resize_buffer(buf, new_capacity, true);
+}
+
+/**
+ * Append bytes to the data of a buffer with its own memory, enlarging it even
+ * beyond the budget if they don't fit, as they're held elsewhere already.
+ */
+void append_to_buffer(Buffer *buf, const void *data, int len) {
+  int end = buf->begin + buf->size;
+  size_t capacity = buf->capacity;
+  while (capacity < end + len) capacity *= 2;
+  if (capacity > buf->capacity && resize_buffer(buf, capacity, false) < 0)
     abort();
+  memcpy(buf->data + end, data, len);
+  buf->size += len;
+}
+
+/**
+ * Enlarge a buffer with its own memory so a block larger than BLOCKSIZE can be
+ * read after its data, as far as MKMIMO_MAX_MEMORY allows, or at least double
+ * it as when growing it for a record.  Returns -1 if it can't be enlarged at
+ * all while the block doesn't fit.
+ */
+int make_room_for_block(Buffer *buf, int block_size) {
+  if (block_size <= BLOCKSIZE || buf->owner != buf) return 0;
+  size_t capacity = buf->capacity;
+  while (capacity - buf->begin - buf->size < block_size) capacity *= 2;
+  if (capacity == buf->capacity || enlarge_buffer(buf, capacity) == 0)
+    return 0;
+  if (capacity > buf->capacity * 2 &&
+      enlarge_buffer(buf, buf->capacity * 2) == 0)
+    return 0;
+  return -1;
+}
+
+/**
+ * Whether the buffer can be doubled within MKMIMO_MAX_MEMORY right now.
+ */
+bool has_memory_to_enlarge(Buffer *buf) {
+  return MKMIMO_MAX_MEMORY == 0 ||
+         __atomic_load_n(&memory_stats.num_bytes_in_use, __ATOMIC_SEQ_CST) +
+                 cost_of_enlarging(buf, buf->capacity * 2) <=
+             MKMIMO_MAX_MEMORY;
+}
+
+/**
+ * Double a buffer that is full of an incomplete record, so more of it can be
+ * read.  When it can't be, returns the MEMORY_POLICY the caller should follow
+ * for the input, after cutting the buffer at its end for emitting.  Only with
+ * may_wait, the backpressure policy blocks until memory is released instead.
+ * Backpressure fails the input too once no memory could ever be released for
+ * the record, as it would otherwise wait forever.
+ */
+int grow_buffer_for_record(Buffer *buf, bool may_wait) {
+  int policy = MEMORY_POLICY;
+  for (;;) {
+    unsigned seq;
+    if (may_wait) prepare_to_wait(&is_memory_released, &seq);
+    if (enlarge_buffer(buf, buf->capacity * 2) == 0) {
+      if (may_wait) cancel_wait(&is_memory_released);
+      stop_waiting_for_memory(buf);
+      return 0;
+    }
+    if (policy != MEMORY_POLICY_BACKPRESSURE) {
+      if (may_wait) cancel_wait(&is_memory_released);
+      break;
+    }
+    start_waiting_for_memory(buf);
+    if (!may_memory_be_released()) {
+      // trying once more, in case some was released since
+      if (may_wait) cancel_wait(&is_memory_released);
+      policy = MEMORY_POLICY_FAIL;
+      continue;
+    }
+    if (!may_wait) return policy;
+    wait_for_event(&is_memory_released, seq);
+  }
+  stop_waiting_for_memory(buf);
+  if (policy == MEMORY_POLICY_EMIT) {
+    buf->end_of_last_record = buf->begin + buf->size - 1;
+    __atomic_add_fetch(&memory_stats.num_records_cut, 1, __ATOMIC_RELAXED);
+  } else if (policy == MEMORY_POLICY_FAIL) {
+    __atomic_add_fetch(&memory_stats.num_inputs_failed, 1, __ATOMIC_RELAXED);
   }
+  return policy;
+}
+
+/**
+ * Find the last record separator in the buffer, scanning no further down than
+ * the given offset.
+ */
+void find_end_of_last_record(Buffer *buf, int scan_end_of_record_down_to) {
+  // scan from the beginning of the first incomplete record
+  int records_begin = buf->end_of_last_record + 1;
+  if (records_begin < buf->begin) records_begin = buf->begin;
+  int j = framer->find_end_of_last_record(buf->data, records_begin,
+                                          scan_end_of_record_down_to,
+                                          buf->begin + buf->size);
+  if (j >= 0) buf->end_of_last_record = j;
+}
+
+/**
+ * Rewind a buffer an output stopped writing partway to the beginning of the
+ * first record it didn't write completely, so exactly the unwritten records
+ * are left.  Returns whether part of that record was written.
+ */
+bool rewind_to_unwritten_record(Buffer *buf) {
+  int num_bytes_written = buf->begin - buf->records_begin;
+  if (num_bytes_written <= 0) return false;
+  int j = framer->find_end_of_last_record(buf->data, buf->records_begin,
+                                          buf->records_begin, buf->begin);
+  int record_begin = j >= 0 ? j + 1 : buf->records_begin;
+  bool was_written_in_part = record_begin < buf->begin;
+  buf->size += buf->begin - record_begin;
+  buf->begin = buf->records_begin = record_begin;
+  return was_written_in_part;
+}
+
+/**
+ * Count the records in the data of the buffer, including an incomplete one at
+ * the end, scanning them only if they weren't counted since it was cleared,
+ * as the input, sequencing, and the output all ask for it.
+ */
+int count_records(Buffer *buf) {
+  if (buf->counted_begin == buf->begin && buf->counted_size == buf->size)
+    return buf->num_records;
+  int ends[MAX_RECORDS_COUNTED_AT_ONCE];
+  int num_records = 0;
+  int records_end = buf->begin + buf->size;
+  for (int begin = buf->begin; begin < records_end;) {
+    int num_ends = framer->find_ends_of_records(
+        buf->data, begin, records_end, ends, MAX_RECORDS_COUNTED_AT_ONCE);
+    if (num_ends == 0) {
+      ++num_records;
+      break;
+    }
+    num_records += num_ends;
+    begin = ends[num_ends - 1] + 1;
+  }
+  buf->num_records = num_records;
+  buf->counted_begin = buf->begin;
+  buf->counted_size = buf->size;
+  return num_records;
+}
+
+// the target now holds bytes read as early as the source's first ones, so
+// their time in mkmimo is told from then with LATENCY_REPORT
+static inline void carry_over_read_time(Buffer *tgt, Buffer *src) {
+  if (src->read_ns != 0 && (tgt->read_ns == 0 || src->read_ns < tgt->read_ns))
+    tgt->read_ns = src->read_ns;
 }
 
 /**
@@ -58,7 +551,9 @@ inline void move_trailing_data_after_last_record(Buffer *tgt, Buffer *src) {
     if (capacity > tgt->capacity) {
       DEBUG(" enlarging capacity of buffer %p to %d bytes from %d bytes", tgt,
             capacity, tgt->capacity);
-      enlarge_buffer(tgt, capacity);
+      // the bytes must be kept even beyond the budget, but this is only
+      // temporary until the source buffer is recycled
+      if (resize_buffer(tgt, capacity, false) < 0) abort();
     }
     // copy data
     DEBUG(" copying trailing data to buffer %p from %p", tgt, src);
@@ -66,5 +561,147 @@ inline void move_trailing_data_after_last_record(Buffer *tgt, Buffer *src) {
            num_trailing_bytes_to_copy);
     tgt->size += num_trailing_bytes_to_copy;
     src->size -= num_trailing_bytes_to_copy;
+    carry_over_read_time(tgt, src);
+  }
+}
+
+/**
+ * Make the target buffer hold the same data as the source without copying
+ * them, sharing the memory they're in, e.g., to write them to another output
+ * as well.
+ */
+void share_buffer(Buffer *tgt, Buffer *src) {
+  Buffer *owner = src->owner;
+  __atomic_add_fetch(&owner->num_refs, 1, __ATOMIC_RELAXED);
+  tgt->owner = owner;
+  tgt->data = src->data;
+  tgt->capacity = src->capacity;
+  tgt->begin = src->begin;
+  tgt->size = src->size;
+  tgt->end_of_last_record = src->end_of_last_record;
+  tgt->read_ns = src->read_ns;
+  tgt->num_records = src->num_records;
+  tgt->counted_begin = src->counted_begin;
+  tgt->counted_size = src->counted_size;
+}
+
+/**
+ * Continue the trailing bytes after the last record in the source buffer with
+ * the target buffer.  Instead of copying them, the target shares the memory
+ * of the source while there's room left in it for reading the rest of the
+ * record, so only the complete records are handed off from the source.
+ */
+void carry_over_trailing_data(Buffer *tgt, Buffer *src) {
+  int trailing_bytes_begin = src->end_of_last_record + 1;
+  int records_end = src->begin + src->size;
+  if (trailing_bytes_begin == records_end || records_end == src->capacity ||
+      tgt->slab == NULL) {
+    move_trailing_data_after_last_record(tgt, src);
+    return;
+  }
+  Buffer *owner = src->owner;
+  __atomic_add_fetch(&owner->num_refs, 1, __ATOMIC_RELAXED);
+  DEBUG(" buffer %p continues trailing data in buffer %p (%d bytes, from %d)",
+        tgt, owner, records_end - trailing_bytes_begin, trailing_bytes_begin);
+  tgt->owner = owner;
+  tgt->data = src->data;
+  tgt->capacity = src->capacity;
+  tgt->begin = trailing_bytes_begin;
+  tgt->size = records_end - trailing_bytes_begin;
+  tgt->end_of_last_record = -1;
+  src->size -= tgt->size;
+  carry_over_read_time(tgt, src);
+}
+
+/**
+ * Move all bytes after the last record separator in the source buffer in
+ * front of the data of the target buffer, which continue them and haven't
+ * been scanned for records yet.  They're copied into the room left before the
+ * data if it's large enough, or the data are shifted.  Returns the number of
+ * bytes moved.
+ */
+int move_trailing_data_in_front(Buffer *tgt, Buffer *src) {
+  int trailing_bytes_begin = src->end_of_last_record + 1;
+  if (trailing_bytes_begin < src->begin) trailing_bytes_begin = src->begin;
+  int num_trailing_bytes = src->begin + src->size - trailing_bytes_begin;
+  if (num_trailing_bytes == 0) return 0;
+  if (num_trailing_bytes > tgt->begin) {
+    DEBUG(" shifting data in buffer %p for %d trailing bytes from %p", tgt,
+          num_trailing_bytes, src);
+    int capacity = tgt->capacity;
+    while (capacity < num_trailing_bytes + tgt->size) capacity *= 2;
+    // like trailing bytes, these must be kept even beyond the budget
+    if (capacity > tgt->capacity && resize_buffer(tgt, capacity, false) < 0)
+      abort();
+    memmove(tgt->data + num_trailing_bytes, tgt->data + tgt->begin,
+            tgt->size);
+    tgt->begin = num_trailing_bytes;
+  }
+  DEBUG(" copying trailing data in front of buffer %p from %p", tgt, src);
+  tgt->begin -= num_trailing_bytes;
+  memcpy(tgt->data + tgt->begin, src->data + trailing_bytes_begin,
+         num_trailing_bytes);
+  tgt->size += num_trailing_bytes;
+  src->size -= num_trailing_bytes;
+  carry_over_read_time(tgt, src);
+  return num_trailing_bytes;
+}
+
+// points the buffer back to its own slab, after it shared another's memory
+static inline void return_to_own_memory(Buffer *buf) {
+  buf->owner = buf;
+  buf->data = buf->slab;
+  buf->capacity = BLOCKSIZE;
+}
+
+// drops a reference to the owner's memory, returning whether it was the last
+static inline bool unref_memory(Buffer *owner) {
+  if (__atomic_sub_fetch(&owner->num_refs, 1, __ATOMIC_ACQ_REL) > 0)
+    return false;
+  owner->num_refs = 1;
+  return true;
+}
+
+/**
+ * Move the data of a buffer sharing another's memory to its own, leaving room
+ * for reading more, once the shared memory has none.  Returns the owner of the
+ * shared memory if no one else refers to it anymore, so the caller can
+ * recycle it, or NULL.
+ */
+Buffer *unshare_buffer(Buffer *buf) {
+  Buffer *owner = buf->owner;
+  if (owner == buf) return NULL;
+  void *shared_data = buf->data + buf->begin;
+  return_to_own_memory(buf);
+  buf->begin = 0;
+  size_t capacity = BLOCKSIZE;
+  while (capacity <= buf->size) capacity *= 2;
+  // like trailing bytes, these must be kept even beyond the budget
+  if (capacity > buf->capacity && resize_buffer(buf, capacity, false) < 0)
+    abort();
+  DEBUG(" moving %d bytes shared with buffer %p to buffer %p", buf->size,
+        owner, buf);
+  memcpy(buf->data, shared_data, buf->size);
+  return unref_memory(owner) ? owner : NULL;
+}
+
+/**
+ * Let go of a buffer whose data were all consumed, storing the buffers that
+ * can be reused right away: itself, unless it owns memory others still refer
+ * to, and the owner of the memory it shared, once no one else refers to it.
+ * Returns how many were stored.
+ */
+int release_buffer(Buffer *buf, Buffer *reusable[2]) {
+  int num_reusable = 0;
+  Buffer *owner = buf->owner;
+  if (owner != buf) {
+    return_to_own_memory(buf);
+    reusable[num_reusable++] = buf;
   }
+  if (unref_memory(owner)) reusable[num_reusable++] = owner;
+  // letting go of what they were enlarged to right away within a budget, as
+  // records may be waiting for it while they're pooled
+  if (MKMIMO_MAX_MEMORY > 0)
+    for (int i = 0; i < num_reusable; ++i) clear_buffer(reusable[i]);
+  return num_reusable;
 }
@@ -1,22 +1,82 @@
 #ifndef BUFFER_H
 #define BUFFER_H
 
+#include <stdbool.h>
 #include <sys/types.h>
 
 #define DEFAULT_BLOCKSIZE (4 * BUFSIZ)  // 4096
 extern int BLOCKSIZE;
+#define DEFAULT_HUGEPAGES 0  // back buffers with regular pages by default
+extern int HUGEPAGES;
+#define DEFAULT_PREFAULT 0  // let buffers be paged in on first use by default
+extern int PREFAULT;
+#define DEFAULT_MKMIMO_MAX_MEMORY 0  // no limit on memory for buffers
+extern size_t MKMIMO_MAX_MEMORY;
+// what to do when a record can't fit in a buffer without exceeding the budget
+#define MEMORY_POLICY_BACKPRESSURE 1  // stop reading until memory is released
+#define MEMORY_POLICY_FAIL 2          // close the input, dropping the record
+#define MEMORY_POLICY_EMIT 3          // pass the record on in pieces
+#define DEFAULT_MEMORY_POLICY MEMORY_POLICY_BACKPRESSURE
+extern int MEMORY_POLICY;
+
+// how much memory buffers take, updated atomically
+typedef struct memory_stats {
+  size_t num_bytes_in_use;
+  size_t peak_num_bytes_in_use;
+  long num_growths_denied;  // buffer growths that would exceed the budget
+  long num_records_cut;     // records emitted in pieces
+  long num_inputs_failed;   // inputs closed for holding oversized records
+} MemoryStats;
+extern MemoryStats memory_stats;
 
 struct input;
 typedef struct input_buffer {
   void *data;
+  void *slab;  // memory carved from an arena, where data is until enlarged
   int capacity;
   int begin, size;         // Byte range containing data
   int end_of_last_record;  // Last record seperator found in range
+  int records_begin;       // Where the records handed to an output began
+  long seq;                // Number of the chunk when sequencing
+  int num_records;         // and how many records it holds
+  // the bytes num_records was counted in, so they're scanned only once
+  int counted_begin, counted_size;
+  // memory it holds while waiting for more to read a record
+  size_t num_bytes_held_waiting;
+  // whether its slab was given away to a pipe, so its pages must be replaced
+  // before it's filled again
+  bool is_gifted;
+  // when its first bytes were read, and an output took it, with LATENCY_REPORT
+  long long read_ns, taken_ns;
+  // the buffer whose memory data points to, which is itself unless the data
+  // continue the trailing bytes of a buffer handed off before, and the number
+  // of buffers referring to its memory, updated atomically
+  struct input_buffer *owner;
+  int num_refs;
 } Buffer;
 
+bool reserve_memory(size_t num_bytes, bool within_budget);
+void release_memory(size_t num_bytes);
+void reserve_memory_waiting(size_t num_bytes, size_t num_bytes_held);
+void keep_memory(long num_bytes);
 Buffer *new_buffer();
+Buffer *new_buffers(int num_buffers);
+void keep_buffer_capacity(int capacity);
+bool may_gift_buffer(Buffer *buf);
 void clear_buffer(Buffer *buf);
-void enlarge_buffer(Buffer *buf, size_t new_capacity);
+int enlarge_buffer(Buffer *buf, size_t new_capacity);
+bool has_memory_to_enlarge(Buffer *buf);
+void append_to_buffer(Buffer *buf, const void *data, int len);
+int make_room_for_block(Buffer *buf, int block_size);
+int grow_buffer_for_record(Buffer *buf, bool may_wait);
+void find_end_of_last_record(Buffer *buf, int scan_end_of_record_down_to);
 void move_trailing_data_after_last_record(Buffer *target, Buffer *source);
+void share_buffer(Buffer *tgt, Buffer *src);
+void carry_over_trailing_data(Buffer *target, Buffer *source);
+int move_trailing_data_in_front(Buffer *target, Buffer *source);
+Buffer *unshare_buffer(Buffer *buf);
+int release_buffer(Buffer *buf, Buffer *reusable[2]);
+bool rewind_to_unwritten_record(Buffer *buf);
+int count_records(Buffer *buf);
 
 #endif /* BUFFER_H */
@@ -0,0 +1,299 @@
+#include "compress.h"
+#include "pool.h"
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <zlib.h>
+
+CompressStats compress_stats;
+
+// bytes deflated into each BGZF block, as bgzip does, so that even ones that
+// don't compress fit in the 64 KiB a block can take
+#define BLOCK_INPUT_SIZE 65280
+#define MAX_BLOCK_SIZE 65536
+#define BLOCK_HEADER_SIZE 18
+#define BLOCK_TRAILER_SIZE 8
+// blocks a job deflates at once
+#define BLOCKS_PER_JOB 16
+#define JOB_INPUT_SIZE (BLOCKS_PER_JOB * BLOCK_INPUT_SIZE)
+#define JOB_MEMORY_SIZE (JOB_INPUT_SIZE + BLOCKS_PER_JOB * MAX_BLOCK_SIZE)
+// how long the output may stay idle before what was written to it so far is
+// deflated and written out without waiting for a whole job
+#define FLUSH_DELAY_MSEC 10
+
+// the empty block marking the end of a BGZF file, whose first bytes are also
+// the header of every block but for its size
+static const unsigned char BGZF_EOF[28] = {
+    0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C',
+    2,    0,    27, 0, 3, 0, 0, 0, 0, 0, 0,    0, 0, 0};
+
+// bytes written to an output that a worker deflates into BGZF blocks
+typedef struct deflate_job {
+  Task task;
+  struct compressed_output *output;
+  char *input;
+  size_t input_size;
+  unsigned char *blocks;
+  size_t blocks_size;
+} DeflateJob;
+
+// an output written through a pipe in its place, whose content is deflated
+// before it's written to the file
+typedef struct compressed_output {
+  const char *name;
+  int fd;
+  int pipe_fd;  // read end of the pipe, whose write end the engine owns
+  pthread_t thread;
+  int status;
+  // signaled whenever a worker finishes a job of the output
+  Event has_finished_job;
+} CompressedOutput;
+
+// the workers taking jobs of all outputs in turn
+static Pool *workers;
+// the outputs being compressed, to be waited for once the engine is done
+static CompressedOutput **compressed_outputs;
+static int num_compressed_outputs;
+
+// the stream of each worker, kept between jobs
+static __thread z_stream *stream;
+
+static inline void put_le32(unsigned char *p, uint32_t n) {
+  p[0] = n;
+  p[1] = n >> 8;
+  p[2] = n >> 16;
+  p[3] = n >> 24;
+}
+
+/**
+ * Function executed by workers for every job. Deflates the bytes into BGZF
+ * blocks, each a gzip member of its own that can be inflated independently.
+ */
+static void run_deflate_job(Task *task) {
+  DeflateJob *job = (DeflateJob *)task;
+  if (stream == NULL) {
+    stream = calloc(1, sizeof(z_stream));
+    if (deflateInit2(stream, COMPRESS_LEVEL, Z_DEFLATED, -MAX_WBITS, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+      abort();
+  }
+  job->blocks_size = 0;
+  for (size_t begin = 0; begin < job->input_size; begin += BLOCK_INPUT_SIZE) {
+    size_t len = job->input_size - begin;
+    if (len > BLOCK_INPUT_SIZE) len = BLOCK_INPUT_SIZE;
+    unsigned char *block = job->blocks + job->blocks_size;
+    deflateReset(stream);
+    stream->next_in = (unsigned char *)job->input + begin;
+    stream->avail_in = len;
+    stream->next_out = block + BLOCK_HEADER_SIZE;
+    stream->avail_out = MAX_BLOCK_SIZE - BLOCK_HEADER_SIZE - BLOCK_TRAILER_SIZE;
+    // can't run out of room, given how little a block takes
+    if (deflate(stream, Z_FINISH) != Z_STREAM_END) abort();
+    size_t block_size =
+        BLOCK_HEADER_SIZE + stream->total_out + BLOCK_TRAILER_SIZE;
+    memcpy(block, BGZF_EOF, BLOCK_HEADER_SIZE - 2);
+    block[BLOCK_HEADER_SIZE - 2] = (block_size - 1) & 0xff;
+    block[BLOCK_HEADER_SIZE - 1] = (block_size - 1) >> 8;
+    unsigned char *trailer = block + block_size - BLOCK_TRAILER_SIZE;
+    put_le32(trailer,
+             crc32(0, (unsigned char *)job->input + begin, len));
+    put_le32(trailer + 4, len);
+    job->blocks_size += block_size;
+  }
+}
+
+static int write_fully(CompressedOutput *output, const void *data,
+                       size_t len) {
+  while (len > 0) {
+    ssize_t num_bytes_written = write(output->fd, data, len);
+    if (num_bytes_written < 0) {
+      if (errno == EINTR) continue;
+      perrorf("write %s", output->name);
+      return -1;
+    }
+    data = (const char *)data + num_bytes_written;
+    len -= num_bytes_written;
+  }
+  return 0;
+}
+
+/**
+ * Allocate the buffers of a job the first time it's used, within
+ * MKMIMO_MAX_MEMORY unless the output has no other job yet, so it can always
+ * go on.  Returns false if the budget doesn't allow it.
+ */
+static bool allocate_job(DeflateJob *job, int *num_jobs_allocated) {
+  if (job->input != NULL) return true;
+  if (!reserve_memory(JOB_MEMORY_SIZE, *num_jobs_allocated > 0)) return false;
+  // until the output is finished, so records can't wait for it
+  keep_memory(JOB_MEMORY_SIZE);
+  ++*num_jobs_allocated;
+  job->input = malloc(JOB_INPUT_SIZE);
+  job->blocks = malloc(BLOCKS_PER_JOB * MAX_BLOCK_SIZE);
+  return true;
+}
+
+static void free_job(DeflateJob *job) {
+  if (job->input == NULL) return;
+  free(job->input);
+  free(job->blocks);
+  keep_memory(-JOB_MEMORY_SIZE);
+  release_memory(JOB_MEMORY_SIZE);
+}
+
+/**
+ * Read what's written to the output into the job until it's full, returning
+ * 1, or until nothing more was written for a while, returning 0, or until the
+ * pipe is closed, returning -1.
+ */
+static int fill_job(CompressedOutput *output, DeflateJob *job) {
+  job->input_size = 0;
+  while (job->input_size < JOB_INPUT_SIZE) {
+    if (job->input_size > 0) {
+      struct pollfd pfd = {.fd = output->pipe_fd, .events = POLLIN};
+      if (poll(&pfd, 1, FLUSH_DELAY_MSEC) == 0) return 0;
+    }
+    ssize_t num_bytes_read = read(output->pipe_fd, job->input + job->input_size,
+                                  JOB_INPUT_SIZE - job->input_size);
+    if (num_bytes_read < 0 && errno == EINTR) continue;
+    if (num_bytes_read < 0) perrorf("read pipe of %s", output->name);
+    if (num_bytes_read <= 0) return -1;
+    job->input_size += num_bytes_read;
+  }
+  return 1;
+}
+
+/**
+ * Write the blocks a job deflated, unless writing the output failed before.
+ */
+static void take_job_output(CompressedOutput *output, DeflateJob *job) {
+  wait_for_task(&job->task);
+  if (output->status < 0) return;
+  if (write_fully(output, job->blocks, job->blocks_size) < 0) {
+    output->status = -1;
+    // the engine fails over to the other outputs once it can't write to
+    // this one either
+    close(output->pipe_fd);
+    output->pipe_fd = -1;
+    return;
+  }
+  __atomic_add_fetch(&compress_stats.num_bytes_in, job->input_size,
+                     __ATOMIC_RELAXED);
+  __atomic_add_fetch(&compress_stats.num_bytes_out, job->blocks_size,
+                     __ATOMIC_RELAXED);
+}
+
+/**
+ * Function executed by a thread for every compressed output. Keeps the workers
+ * busy with jobs of what's written to the pipe while it streams, and writes
+ * the blocks they deflate to the file in order, all of them as soon as the
+ * pipe stays idle, so records don't linger there.
+ */
+static void *deflate_blocks_in_order(void *arg) {
+  CompressedOutput *output = arg;
+  int window = 2 * workers->num_threads + 1;
+  DeflateJob *jobs = calloc(window, sizeof(DeflateJob));
+  for (int i = 0; i < window; ++i) {
+    jobs[i].task.run = run_deflate_job;
+    jobs[i].task.has_finished = &output->has_finished_job;
+    jobs[i].output = output;
+  }
+  int first_job = 0, num_jobs = 0, num_jobs_allocated = 0;
+  bool is_eof = false;
+  for (;;) {
+    bool is_idle = false;
+    // the first job, allocated whatever the budget, is the one to go on with
+    if (num_jobs == 0) first_job = 0;
+    DeflateJob *job = &jobs[(first_job + num_jobs) % window];
+    if (!is_eof && output->status == 0 && num_jobs < window &&
+        allocate_job(job, &num_jobs_allocated)) {
+      int ret = fill_job(output, job);
+      if (job->input_size > 0) {
+        submit_task(workers, &job->task);
+        ++num_jobs;
+      }
+      is_eof = ret < 0;
+      is_idle = ret == 0;
+      if (ret > 0 && num_jobs < window) continue;
+    }
+    if (num_jobs == 0) {
+      if (is_eof || output->status < 0) break;
+      continue;
+    }
+    do {
+      take_job_output(output, &jobs[first_job]);
+      first_job = (first_job + 1) % window;
+      --num_jobs;
+    } while (num_jobs > 0 && (is_idle || is_eof || output->status < 0));
+  }
+  if (output->status == 0 && write_fully(output, BGZF_EOF, sizeof(BGZF_EOF)))
+    output->status = -1;
+  if (close(output->fd) < 0 && output->status == 0) {
+    perrorf("close %s", output->name);
+    output->status = -1;
+  }
+  if (output->pipe_fd >= 0) close(output->pipe_fd);
+  for (int i = 0; i < window; ++i) free_job(&jobs[i]);
+  free(jobs);
+  return NULL;
+}
+
+static inline bool is_named_gz(const char *name) {
+  size_t len = strlen(name);
+  return len > 3 && !strcmp(name + len - 3, ".gz");
+}
+
+/**
+ * Give a descriptor to write to in place of the given one, through which the
+ * content is deflated into BGZF blocks in parallel, or the same descriptor if
+ * the output isn't to be compressed.
+ */
+int open_compressed(int fd, const char *name) {
+  if (COMPRESS == COMPRESS_NEVER ||
+      (COMPRESS == COMPRESS_AUTO && !is_named_gz(name)))
+    return fd;
+  int pipe_fds[2];
+  if (pipe(pipe_fds) < 0) {
+    perrorf("pipe for %s", name);
+    return -1;
+  }
+  if (workers == NULL) workers = new_pool(COMPRESS_WORKERS);
+  __atomic_add_fetch(&compress_stats.num_outputs_deflated, 1,
+                     __ATOMIC_RELAXED);
+
+  CompressedOutput *output = calloc(1, sizeof(CompressedOutput));
+  output->name = name;
+  output->fd = fd;
+  output->pipe_fd = pipe_fds[0];
+  compressed_outputs =
+      realloc(compressed_outputs,
+              (num_compressed_outputs + 1) * sizeof(CompressedOutput *));
+  compressed_outputs[num_compressed_outputs++] = output;
+  DEBUG("%s: deflating into BGZF blocks through a pipe", name);
+  CHECK_ERRNO(pthread_create, &output->thread, NULL, deflate_blocks_in_order,
+              output);
+  return pipe_fds[1];
+}
+
+/**
+ * Wait for what was written to the pipes of the compressed outputs to reach
+ * the files, once the outputs were closed. Returns -1 if any couldn't be
+ * written.
+ */
+int finish_compressing(void) {
+  int status = 0;
+  for (int i = 0; i < num_compressed_outputs; ++i) {
+    CompressedOutput *output = compressed_outputs[i];
+    pthread_join(output->thread, NULL);
+    if (output->status < 0) {
+      __atomic_add_fetch(&compress_stats.num_outputs_failed, 1,
+                         __ATOMIC_RELAXED);
+      status = -1;
+    }
+    free(output);
+  }
+  free(compressed_outputs);
+  compressed_outputs = NULL;
+  num_compressed_outputs = 0;
+  return status;
+}
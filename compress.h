@@ -0,0 +1,30 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include "mkmimo.h"
+
+// which outputs to write gzip files to, at which level, and how many threads
+// to share the work among
+#define COMPRESS_NEVER 0
+#define COMPRESS_AUTO 1    // the ones named *.gz
+#define COMPRESS_ALWAYS 2  // all of them
+#define DEFAULT_COMPRESS COMPRESS_NEVER
+extern int COMPRESS;
+#define DEFAULT_COMPRESS_LEVEL 6  // as gzip does, where 1 is the fastest
+extern int COMPRESS_LEVEL;
+#define DEFAULT_COMPRESS_WORKERS 0  // as many as the online CPUs
+extern int COMPRESS_WORKERS;
+
+// how much outputs were deflated, updated atomically
+typedef struct compress_stats {
+  long num_outputs_deflated;
+  size_t num_bytes_in;
+  size_t num_bytes_out;
+  long num_outputs_failed;  // for errors writing the compressed bytes
+} CompressStats;
+extern CompressStats compress_stats;
+
+int open_compressed(int fd, const char *name);
+int finish_compressing(void);
+
+#endif /* COMPRESS_H */
@@ -0,0 +1,392 @@
+#ifdef __linux__
+#define _GNU_SOURCE  // for madvise(2)
+#endif
+
+#include "decompress.h"
+#include "pool.h"
+#include "scan.h"
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+DecompressStats decompress_stats;
+
+// compressed bytes whose members a job inflates, and how many bytes it may
+// inflate before leaving the rest of a member to be inflated in order, which
+// it does sooner once memory taken reaches MKMIMO_MAX_MEMORY
+#define JOB_INPUT_SIZE (256 * 1024)
+#define JOB_OUTPUT_LIMIT (16 * 1024 * 1024)
+// bytes inflated at a time in order, and at least room for in a job
+#define PIECE_SIZE (64 * 1024)
+// the shortest possible gzip member: header, empty deflate block, trailer
+#define MIN_MEMBER_SIZE 20
+
+// a range of a gzip file whose members a worker inflates ahead of their turn,
+// starting from the first one it can find unless the range is known to begin
+// with one, as multi-member files don't tell where members begin
+typedef struct inflate_job {
+  Task task;
+  struct compressed_input *input;
+  size_t begin, end;
+  bool is_at_member;
+  // the members inflated, where each began in the file and in the output,
+  // and where the next one would begin
+  size_t *member_begins;
+  size_t *member_offsets;
+  int num_members, max_members;
+  size_t resume_at;
+  // the stream, left in the middle of the last member once the output reached
+  // its limit
+  z_stream stream;
+  bool is_stream_left;
+  char *output;
+  size_t output_size, output_capacity;
+} InflateJob;
+
+// a gzip file mapped in memory, inflated into a pipe read in its place
+typedef struct compressed_input {
+  const char *name;
+  const unsigned char *data;
+  size_t size;
+  int fd;
+  // signaled whenever a worker finishes a job of the input
+  Event has_finished_job;
+} CompressedInput;
+
+// the workers taking jobs of all inputs in turn
+static Pool *workers;
+
+static inline bool looks_like_member(const unsigned char *p, size_t len) {
+  // deflated, with no reserved flags
+  return len >= MIN_MEMBER_SIZE && p[0] == 0x1f && p[1] == 0x8b && p[2] == 8 &&
+         (p[3] & 0xe0) == 0;
+}
+
+/**
+ * Find the first offset in the range where a member could begin, or the end
+ * of the range if there's none.
+ */
+static size_t find_member(const unsigned char *data, size_t size,
+                          size_t begin, size_t end) {
+  for (size_t i = begin; i < end; ++i) {
+    int offset = find_first_byte((const char *)data + i, end - i, 0x1f);
+    if (offset < 0) break;
+    i += offset;
+    if (looks_like_member(data + i, size - i)) return i;
+  }
+  return end;
+}
+
+/**
+ * Tell the size of the BGZF block at the given offset from the BC subfield in
+ * its header, or 0 if it isn't one.
+ * See: https://samtools.github.io/hts-specs/SAMv1.pdf
+ */
+static size_t bgzf_block_size(const unsigned char *p, size_t len) {
+  if (!looks_like_member(p, len) || !(p[3] & 0x04)) return 0;
+  size_t extra_end = 12 + (p[10] | p[11] << 8);
+  if (extra_end > len) return 0;
+  for (size_t i = 12; i + 4 <= extra_end;) {
+    size_t subfield_size = p[i + 2] | p[i + 3] << 8;
+    if (p[i] == 'B' && p[i + 1] == 'C' && subfield_size == 2 &&
+        i + 6 <= extra_end) {
+      size_t block_size = (p[i + 4] | p[i + 5] << 8) + 1;
+      return block_size <= len ? block_size : 0;
+    }
+    i += 4 + subfield_size;
+  }
+  return 0;
+}
+
+/**
+ * Inflate from where the stream is into the given room, feeding it the rest
+ * of the file whenever it runs out of input.  Returns what inflate(3) did.
+ */
+static int inflate_into(z_stream *zs, const unsigned char *data, size_t size,
+                        char *room, size_t room_size) {
+  zs->next_out = (Bytef *)room;
+  zs->avail_out = room_size > UINT_MAX ? UINT_MAX : room_size;
+  for (;;) {
+    if (zs->avail_in == 0) {
+      size_t num_bytes_left = size - (zs->next_in - data);
+      if (num_bytes_left == 0) return Z_BUF_ERROR;  // truncated
+      zs->avail_in = num_bytes_left > UINT_MAX ? UINT_MAX : num_bytes_left;
+    }
+    int ret = inflate(zs, Z_NO_FLUSH);
+    if (ret != Z_OK || zs->avail_out == 0) return ret;
+  }
+}
+
+static inline void start_member(z_stream *zs, const unsigned char *data,
+                                size_t begin) {
+  inflateReset(zs);
+  zs->next_in = (Bytef *)data + begin;
+  zs->avail_in = 0;
+}
+
+/**
+ * Make sure the job's output has room for another piece, growing it within
+ * MKMIMO_MAX_MEMORY, as the outputs of all jobs in flight add up to more than
+ * the buffers.  Returns false if the budget doesn't allow it.
+ */
+static bool make_room_for_piece(InflateJob *job) {
+  if (job->output_capacity - job->output_size >= PIECE_SIZE) return true;
+  size_t capacity =
+      job->output_capacity > 0 ? job->output_capacity * 2 : 4 * PIECE_SIZE;
+  if (!reserve_memory(capacity - job->output_capacity, true)) return false;
+  job->output = realloc(job->output, capacity);
+  job->output_capacity = capacity;
+  return true;
+}
+
+/**
+ * Inflate the members beginning in the job's range one after another into
+ * its output, up to the limit or as far as the budget allows, leaving the
+ * rest to be inflated in order.  One that fails to inflate is left for the
+ * thread putting members in order to find out about, unless it's the first
+ * found by looking, which may be a false match in the middle of another.
+ */
+static void run_inflate_job(Task *task) {
+  InflateJob *job = (InflateJob *)task;
+  CompressedInput *input = job->input;
+  const unsigned char *data = input->data;
+  z_stream *zs = &job->stream;
+  size_t begin = job->is_at_member
+                     ? job->begin
+                     : find_member(data, input->size, job->begin, job->end);
+  while (begin < job->end) {
+    if (job->num_members == job->max_members) {
+      job->max_members = job->max_members > 0 ? job->max_members * 2 : 16;
+      job->member_begins =
+          realloc(job->member_begins, job->max_members * sizeof(size_t));
+      job->member_offsets =
+          realloc(job->member_offsets, job->max_members * sizeof(size_t));
+    }
+    job->member_begins[job->num_members] = begin;
+    job->member_offsets[job->num_members] = job->output_size;
+    start_member(zs, data, begin);
+    int ret = Z_OK;
+    while (ret == Z_OK && job->output_size < JOB_OUTPUT_LIMIT &&
+           make_room_for_piece(job)) {
+      ret = inflate_into(zs, data, input->size, job->output + job->output_size,
+                         job->output_capacity - job->output_size);
+      job->output_size = (char *)zs->next_out - job->output;
+    }
+    if (ret == Z_OK &&
+        job->output_size == job->member_offsets[job->num_members])
+      break;  // not started for lack of room, so it's inflated in order
+    if (ret == Z_OK) {
+      job->is_stream_left = true;
+      ++job->num_members;
+      break;
+    } else if (ret != Z_STREAM_END) {
+      job->output_size = job->member_offsets[job->num_members];
+      if (job->num_members > 0 || job->is_at_member) break;
+      begin = find_member(data, input->size, begin + 1, job->end);
+      continue;
+    }
+    ++job->num_members;
+    begin = zs->next_in - data;
+  }
+  job->resume_at = begin;
+}
+
+/**
+ * Plan the next job from where the last one ended, taking whole BGZF blocks
+ * while their headers tell where the next begins, or a fixed range of bytes
+ * otherwise, and queue it to the workers.
+ */
+static void submit_job(CompressedInput *input, InflateJob *job, size_t *begin,
+                       bool *is_at_member) {
+  memset(job, 0, sizeof(InflateJob));
+  job->task.run = run_inflate_job;
+  job->task.has_finished = &input->has_finished_job;
+  job->input = input;
+  job->begin = *begin;
+  job->is_at_member = *is_at_member;
+  size_t end = *begin;
+  size_t block_size;
+  while (*is_at_member && end < input->size &&
+         end - *begin < JOB_INPUT_SIZE &&
+         (block_size = bgzf_block_size(input->data + end, input->size - end)) >
+             0)
+    end += block_size;
+  *is_at_member = end > *begin;
+  if (end == *begin) end = *begin + JOB_INPUT_SIZE;
+  if (end > input->size) end = input->size;
+  job->end = *begin = end;
+  if (inflateInit2(&job->stream, 16 + MAX_WBITS) != Z_OK) abort();
+  submit_task(workers, &job->task);
+}
+
+static void release_job(InflateJob *job) {
+  inflateEnd(&job->stream);
+  free(job->member_begins);
+  free(job->member_offsets);
+  free(job->output);
+  if (job->output_capacity > 0) release_memory(job->output_capacity);
+}
+
+static int write_fully(CompressedInput *input, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t num_bytes_written = write(input->fd, data, len);
+    if (num_bytes_written < 0) {
+      if (errno == EINTR) continue;
+      perrorf("write %s", input->name);
+      return -1;
+    }
+    data += num_bytes_written;
+    len -= num_bytes_written;
+  }
+  return 0;
+}
+
+/**
+ * Inflate the rest of the member the stream is in the middle of, writing it
+ * out a piece at a time.
+ */
+static int finish_member(CompressedInput *input, z_stream *zs) {
+  char piece[PIECE_SIZE];
+  for (;;) {
+    int ret = inflate_into(zs, input->data, input->size, piece, PIECE_SIZE);
+    if ((ret == Z_OK || ret == Z_STREAM_END) &&
+        write_fully(input, piece, (char *)zs->next_out - piece) < 0)
+      return -1;
+    if (ret == Z_STREAM_END) return 0;
+    if (ret != Z_OK) {
+      fprintf(stderr, "%s: invalid gzip data at byte %zu\n", input->name,
+              (size_t)(zs->next_in - input->data));
+      return -1;
+    }
+  }
+}
+
+/**
+ * Write the members a job inflated from the one due next, which it may have
+ * started from, and inflate the ones in its range it didn't in order.
+ * Returns 1 once the file ends, or -1 on errors.
+ */
+static int take_job_output(CompressedInput *input, InflateJob *job,
+                           z_stream *zs, size_t *next_member) {
+  int m = 0;
+  while (m < job->num_members && job->member_begins[m] != *next_member) ++m;
+  if (m < job->num_members) {
+    __atomic_add_fetch(&decompress_stats.num_members_ahead,
+                       job->num_members - m, __ATOMIC_RELAXED);
+    if (write_fully(input, job->output + job->member_offsets[m],
+                    job->output_size - job->member_offsets[m]) < 0)
+      return -1;
+    if (job->is_stream_left) {
+      if (finish_member(input, &job->stream) < 0) return -1;
+      *next_member = job->stream.next_in - input->data;
+    } else {
+      *next_member = job->resume_at;
+    }
+  }
+  while (*next_member < job->end) {
+    if (!looks_like_member(input->data + *next_member,
+                           input->size - *next_member)) {
+      fprintf(stderr, "%s: trailing garbage ignored at byte %zu\n",
+              input->name, *next_member);
+      return 1;
+    }
+    __atomic_add_fetch(&decompress_stats.num_members_in_order, 1,
+                       __ATOMIC_RELAXED);
+    start_member(zs, input->data, *next_member);
+    if (finish_member(input, zs) < 0) return -1;
+    *next_member = zs->next_in - input->data;
+  }
+  return *next_member < input->size ? 0 : 1;
+}
+
+/**
+ * Function executed by a thread for every gzip input. Keeps the workers busy
+ * with jobs planned ahead, and writes what they inflate to the pipe in order,
+ * inflating the members they couldn't tell began, or didn't finish, itself.
+ */
+static void *inflate_members_in_order(void *arg) {
+  CompressedInput *input = arg;
+  int window = 2 * workers->num_threads + 1;
+  InflateJob *jobs = calloc(window, sizeof(InflateJob));
+  int first_job = 0, num_jobs = 0;
+  size_t next_begin = 0;
+  bool is_at_member = true;
+  size_t next_member = 0;
+  int status = 0;
+  z_stream zs = {0};
+  if (inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK) abort();
+  for (;;) {
+    // jobs are planned after the last member written, once it went past them
+    while (status == 0 && num_jobs < window && next_begin < input->size) {
+      if (next_member > next_begin) {
+        next_begin = next_member;
+        is_at_member = true;
+      }
+      if (next_begin >= input->size) break;
+      submit_job(input, &jobs[(first_job + num_jobs++) % window], &next_begin,
+                 &is_at_member);
+    }
+    if (num_jobs == 0) break;
+    InflateJob *job = &jobs[first_job];
+    wait_for_task(&job->task);
+    if (status == 0 && next_member < job->end)
+      status = take_job_output(input, job, &zs, &next_member);
+    release_job(job);
+    first_job = (first_job + 1) % window;
+    --num_jobs;
+  }
+  if (status < 0)
+    __atomic_add_fetch(&decompress_stats.num_inputs_failed, 1,
+                       __ATOMIC_RELAXED);
+  inflateEnd(&zs);
+  free(jobs);
+  munmap((void *)input->data, input->size);
+  close(input->fd);
+  free(input);
+  return NULL;
+}
+
+/**
+ * Give a descriptor to read the inflated content of the gzip file open at the
+ * given one in its place, inflating its members in parallel where their
+ * beginnings can be told, as with BGZF blocks, or the same descriptor if it
+ * isn't a gzip file.  Only regular files are looked into, as bytes taken
+ * from a pipe couldn't be given back.
+ */
+int open_decompressed(int fd, const char *name) {
+  struct stat st;
+  unsigned char magic[MIN_MEMBER_SIZE];
+  if (!DECOMPRESS || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+      pread(fd, magic, sizeof(magic), 0) != sizeof(magic) ||
+      !looks_like_member(magic, sizeof(magic)))
+    return fd;
+  void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    perrorf("mmap %s", name);
+    return -1;
+  }
+  madvise(data, st.st_size, MADV_SEQUENTIAL);
+  int pipe_fds[2];
+  if (pipe(pipe_fds) < 0) {
+    perrorf("pipe for %s", name);
+    return -1;
+  }
+  close(fd);
+  if (workers == NULL) workers = new_pool(DECOMPRESS_WORKERS);
+  __atomic_add_fetch(&decompress_stats.num_inputs_inflated, 1,
+                     __ATOMIC_RELAXED);
+
+  CompressedInput *input = calloc(1, sizeof(CompressedInput));
+  input->name = name;
+  input->data = data;
+  input->size = st.st_size;
+  input->fd = pipe_fds[1];
+  DEBUG("%s: inflating %zu bytes of gzip members into a pipe", name,
+        input->size);
+  pthread_t thread;
+  CHECK_ERRNO(pthread_create, &thread, NULL, inflate_members_in_order, input);
+  pthread_detach(thread);
+  return pipe_fds[0];
+}
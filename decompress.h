@@ -0,0 +1,24 @@
+#ifndef DECOMPRESS_H
+#define DECOMPRESS_H
+
+#include "mkmimo.h"
+
+// whether to inflate inputs that are gzip files before reading records, and
+// how many threads to share the work among
+#define DEFAULT_DECOMPRESS 1
+extern int DECOMPRESS;
+#define DEFAULT_DECOMPRESS_WORKERS 0  // as many as the online CPUs
+extern int DECOMPRESS_WORKERS;
+
+// how the members of gzip inputs were inflated, updated atomically
+typedef struct decompress_stats {
+  long num_inputs_inflated;
+  long num_members_ahead;     // by a worker, ahead of their turn
+  long num_members_in_order;  // where no worker could tell they began
+  long num_inputs_failed;     // for holding invalid or truncated members
+} DecompressStats;
+extern DecompressStats decompress_stats;
+
+int open_decompressed(int fd, const char *name);
+
+#endif /* DECOMPRESS_H */
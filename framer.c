@@ -0,0 +1,339 @@
+#include "framer.h"
+#include "mkmimo.h"
+#include "scan.h"
+
+// the record delimiter for delimited formats
+static char *delimiter = "\n";
+static int delimiter_length = 1;
+// the number of bytes in every record for fixed-size records
+static int record_size = 0;
+
+/**
+ * Records ending with a single byte delimiter, e.g., newline or NUL.
+ */
+static int find_end_of_last_delimited_record(const char *data,
+                                             int records_begin, int scan_from,
+                                             int records_end) {
+  if (scan_from < records_begin) scan_from = records_begin;
+  if (scan_from >= records_end) return -1;
+  int j = find_last_byte(data + scan_from, records_end - scan_from,
+                         delimiter[0]);
+  return j < 0 ? -1 : scan_from + j;
+}
+
+static int find_ends_of_delimited_records(const char *data,
+                                          int records_begin, int records_end,
+                                          int *ends, int max_ends) {
+  int num_ends = find_all_bytes(data + records_begin,
+                                records_end - records_begin, delimiter[0],
+                                ends, max_ends);
+  for (int i = 0; i < num_ends; ++i) ends[i] += records_begin;
+  return num_ends;
+}
+
+/**
+ * Records ending with a delimiter of multiple bytes.
+ */
+static int find_end_of_last_multibyte_delimited_record(const char *data,
+                                                       int records_begin,
+                                                       int scan_from,
+                                                       int records_end) {
+  // a delimiter may straddle the bytes that were already scanned
+  scan_from -= delimiter_length - 1;
+  if (scan_from < records_begin) scan_from = records_begin;
+  char last_byte = delimiter[delimiter_length - 1];
+  for (int scan_end = records_end; scan_end > scan_from;) {
+    // find the last byte of the delimiter first, then check the rest
+    int j = find_last_byte(data + scan_from, scan_end - scan_from, last_byte);
+    if (j < 0) break;
+    int end = scan_from + j;
+    int begin = end - (delimiter_length - 1);
+    if (begin >= scan_from &&
+        memcmp(data + begin, delimiter, delimiter_length) == 0)
+      return end;
+    scan_end = end;
+  }
+  return -1;
+}
+
+static int find_end_of_first_multibyte_delimited_record(const char *data,
+                                                        int records_begin,
+                                                        int records_end) {
+  char first_byte = delimiter[0];
+  for (int begin = records_begin; begin + delimiter_length <= records_end;) {
+    // find the first byte of the delimiter first, then check the rest
+    int j = find_first_byte(data + begin, records_end - begin, first_byte);
+    if (j < 0 || begin + j + delimiter_length > records_end) break;
+    if (memcmp(data + begin + j, delimiter, delimiter_length) == 0)
+      return begin + j + delimiter_length - 1;
+    begin += j + 1;
+  }
+  return -1;
+}
+
+/**
+ * Records of a fixed size, which need no scanning.
+ */
+static int find_end_of_last_fixed_size_record(const char *data,
+                                              int records_begin, int scan_from,
+                                              int records_end) {
+  int num_records = (records_end - records_begin) / record_size;
+  return num_records > 0 ? records_begin + num_records * record_size - 1 : -1;
+}
+
+static int find_end_of_first_fixed_size_record(const char *data,
+                                               int records_begin,
+                                               int records_end) {
+  return records_end - records_begin >= record_size
+             ? records_begin + record_size - 1
+             : -1;
+}
+
+/**
+ * Records prefixed by their length as a 32-bit unsigned big-endian integer.
+ */
+static int find_end_of_last_u32_prefixed_record(const char *data,
+                                                int records_begin,
+                                                int scan_from,
+                                                int records_end) {
+  int last = -1;
+  for (long long begin = records_begin; begin + 4 <= records_end;) {
+    const unsigned char *prefix = (const unsigned char *)data + begin;
+    unsigned long length = (unsigned long)prefix[0] << 24 |
+                           (unsigned long)prefix[1] << 16 |
+                           (unsigned long)prefix[2] << 8 | prefix[3];
+    long long end = begin + 4 + length;
+    if (end > records_end) break;
+    last = end - 1;
+    begin = end;
+  }
+  return last;
+}
+
+static int find_end_of_first_u32_prefixed_record(const char *data,
+                                                 int records_begin,
+                                                 int records_end) {
+  if (records_begin + 4 > records_end) return -1;
+  const unsigned char *prefix = (const unsigned char *)data + records_begin;
+  unsigned long length = (unsigned long)prefix[0] << 24 |
+                         (unsigned long)prefix[1] << 16 |
+                         (unsigned long)prefix[2] << 8 | prefix[3];
+  long long end = records_begin + 4 + length;
+  return end <= records_end ? end - 1 : -1;
+}
+
+/**
+ * Records prefixed by their length as an unsigned LEB128 varint, as used by
+ * Protocol Buffers.
+ */
+static int find_end_of_last_varint_prefixed_record(const char *data,
+                                                   int records_begin,
+                                                   int scan_from,
+                                                   int records_end) {
+  int last = -1;
+  for (long long begin = records_begin; begin < records_end;) {
+    unsigned long long length = 0;
+    int i = 0, shift = 0;
+    for (;; shift += 7) {
+      if (begin + i >= records_end) return last;
+      unsigned char b = data[begin + i++];
+      if (shift < 64) length |= (unsigned long long)(b & 0x7f) << shift;
+      if (!(b & 0x80)) break;
+    }
+    if (length > (unsigned long long)(records_end - begin - i)) break;
+    long long end = begin + i + length;
+    last = end - 1;
+    begin = end;
+  }
+  return last;
+}
+
+static int find_end_of_first_varint_prefixed_record(const char *data,
+                                                    int records_begin,
+                                                    int records_end) {
+  unsigned long long length = 0;
+  int i = 0, shift = 0;
+  for (;; shift += 7) {
+    if (records_begin + i >= records_end) return -1;
+    unsigned char b = data[records_begin + i++];
+    if (shift < 64) length |= (unsigned long long)(b & 0x7f) << shift;
+    if (!(b & 0x80)) break;
+  }
+  if (length > (unsigned long long)(records_end - records_begin - i))
+    return -1;
+  return records_begin + i + length - 1;
+}
+
+/**
+ * RFC 4180 CSV records, where newlines inside double quotes don't end a
+ * record.  The quote state is only known from the beginning of a record, so
+ * the incomplete record is scanned entirely every time.
+ */
+static int find_end_of_last_csv_record(const char *data, int records_begin,
+                                       int scan_from, int records_end) {
+  int j = find_last_unquoted_byte(data + records_begin,
+                                  records_end - records_begin, '\n', '"');
+  return j < 0 ? -1 : records_begin + j;
+}
+
+static int find_end_of_first_csv_record(const char *data, int records_begin,
+                                        int records_end) {
+  bool is_quoted = false;
+  for (int j = records_begin; j < records_end; ++j) {
+    if (data[j] == '"')
+      is_quoted = !is_quoted;
+    else if (data[j] == '\n' && !is_quoted)
+      return j;
+  }
+  return -1;
+}
+
+/**
+ * Find the ends of records one at a time for the formats that can't tell
+ * where one ends without knowing where it begins.
+ */
+#define DEFINE_FIND_ENDS_OF_RECORDS(find_ends_of_records,                    \
+                                    find_end_of_first_record)                \
+  static int find_ends_of_records(const char *data, int records_begin,      \
+                                  int records_end, int *ends, int max_ends) { \
+    int num_ends = 0;                                                        \
+    while (num_ends < max_ends) {                                            \
+      int j = find_end_of_first_record(data, records_begin, records_end);    \
+      if (j < 0) break;                                                      \
+      ends[num_ends++] = j;                                                  \
+      records_begin = j + 1;                                                 \
+    }                                                                        \
+    return num_ends;                                                         \
+  }
+DEFINE_FIND_ENDS_OF_RECORDS(find_ends_of_multibyte_delimited_records,
+                            find_end_of_first_multibyte_delimited_record)
+DEFINE_FIND_ENDS_OF_RECORDS(find_ends_of_fixed_size_records,
+                            find_end_of_first_fixed_size_record)
+DEFINE_FIND_ENDS_OF_RECORDS(find_ends_of_u32_prefixed_records,
+                            find_end_of_first_u32_prefixed_record)
+DEFINE_FIND_ENDS_OF_RECORDS(find_ends_of_varint_prefixed_records,
+                            find_end_of_first_varint_prefixed_record)
+DEFINE_FIND_ENDS_OF_RECORDS(find_ends_of_csv_records,
+                            find_end_of_first_csv_record)
+
+static const Framer delimited_framer = {
+    "delimited", find_end_of_last_delimited_record,
+    find_ends_of_delimited_records,
+};
+static const Framer multibyte_delimited_framer = {
+    "delimited", find_end_of_last_multibyte_delimited_record,
+    find_ends_of_multibyte_delimited_records,
+};
+static const Framer fixed_size_framer = {
+    "fixed", find_end_of_last_fixed_size_record,
+    find_ends_of_fixed_size_records,
+};
+static const Framer u32_prefixed_framer = {
+    "u32", find_end_of_last_u32_prefixed_record,
+    find_ends_of_u32_prefixed_records,
+};
+static const Framer varint_prefixed_framer = {
+    "varint", find_end_of_last_varint_prefixed_record,
+    find_ends_of_varint_prefixed_records,
+};
+static const Framer csv_framer = {
+    "csv", find_end_of_last_csv_record, find_ends_of_csv_records,
+};
+
+const Framer *framer = &delimited_framer;
+
+/**
+ * Find where the content of a record ends, before the delimiter it ends with
+ * if any, given the offset past its last byte.
+ */
+int find_end_of_record_content(const char *data, int record_begin,
+                               int record_end) {
+  if (framer == &csv_framer) {
+    if (record_end > record_begin && data[record_end - 1] == '\n')
+      --record_end;
+    if (record_end > record_begin && data[record_end - 1] == '\r')
+      --record_end;
+  } else if (framer == &delimited_framer) {
+    if (record_end > record_begin && data[record_end - 1] == delimiter[0])
+      --record_end;
+  } else if (framer == &multibyte_delimited_framer) {
+    if (record_end - record_begin >= delimiter_length &&
+        memcmp(data + record_end - delimiter_length, delimiter,
+               delimiter_length) == 0)
+      record_end -= delimiter_length;
+  }
+  return record_end;
+}
+
+/**
+ * Decode C-style escape sequences, e.g., \t, \0, or \x1e, in the delimiter.
+ */
+int unescape(char *dst, const char *src) {
+  int len = 0;
+  while (*src) {
+    if (*src != '\\' || src[1] == '\0') {
+      dst[len++] = *src++;
+      continue;
+    }
+    ++src;
+    switch (*src) {
+      case 'n': dst[len++] = '\n'; ++src; break;
+      case 'r': dst[len++] = '\r'; ++src; break;
+      case 't': dst[len++] = '\t'; ++src; break;
+      case 'x': {
+        char *end;
+        char hex[3] = {src[1], src[1] ? src[2] : '\0', '\0'};
+        dst[len++] = strtol(hex, &end, 16);
+        src += 1 + (end - hex);
+        break;
+      }
+      default:
+        if (*src >= '0' && *src <= '7') {
+          int c = 0;
+          for (int i = 0; i < 3 && *src >= '0' && *src <= '7'; ++i)
+            c = c * 8 + (*src++ - '0');
+          dst[len++] = c;
+        } else {
+          dst[len++] = *src++;
+        }
+    }
+  }
+  return len;
+}
+
+/**
+ * Choose how records are delimited, returning -1 if the format is invalid.
+ */
+int set_record_format(const char *format, const char *record_delimiter,
+                      int fixed_record_size) {
+  if (!strcmp(format, "lines")) {
+    framer = &delimited_framer;
+    delimiter = "\n";
+    delimiter_length = 1;
+  } else if (!strcmp(format, "nul")) {
+    framer = &delimited_framer;
+    delimiter = "";  // the terminating NUL
+    delimiter_length = 1;
+  } else if (!strcmp(format, "delimited")) {
+    if (record_delimiter == NULL) return -1;
+    delimiter = malloc(strlen(record_delimiter) + 1);
+    delimiter_length = unescape(delimiter, record_delimiter);
+    if (delimiter_length == 0) return -1;
+    framer = delimiter_length == 1 ? &delimited_framer
+                                   : &multibyte_delimited_framer;
+  } else if (!strcmp(format, "fixed")) {
+    if (fixed_record_size <= 0) return -1;
+    framer = &fixed_size_framer;
+    record_size = fixed_record_size;
+  } else if (!strcmp(format, "u32")) {
+    framer = &u32_prefixed_framer;
+  } else if (!strcmp(format, "varint")) {
+    framer = &varint_prefixed_framer;
+  } else if (!strcmp(format, "csv")) {
+    framer = &csv_framer;
+  } else {
+    return -1;
+  }
+  DEBUG("RECORD_FORMAT=%s", format);
+  return 0;
+}
@@ -0,0 +1,29 @@
+#ifndef FRAMER_H
+#define FRAMER_H
+
+// How records are delimited in the streams, which determines where buffers
+// can be split
+typedef struct framer {
+  const char *name;
+  // Find the last byte of the last complete record among the bytes in
+  // data[records_begin, records_end), where records_begin is the start of a
+  // record and the bytes before scan_from were already scanned without
+  // finding any end of record.  Returns -1 if there's none.
+  int (*find_end_of_last_record)(const char *data, int records_begin,
+                                 int scan_from, int records_end);
+  // Find the last bytes of the complete records among the bytes in
+  // data[records_begin, records_end) in order, up to max_ends of them,
+  // returning how many were found.
+  int (*find_ends_of_records)(const char *data, int records_begin,
+                              int records_end, int *ends, int max_ends);
+} Framer;
+
+extern const Framer *framer;
+
+int unescape(char *dst, const char *src);
+int find_end_of_record_content(const char *data, int record_begin,
+                               int record_end);
+int set_record_format(const char *format, const char *delimiter,
+                      int record_size);
+
+#endif /* FRAMER_H */
@@ -0,0 +1,66 @@
+#include "io.h"
+#include <sys/uio.h>
+
+IoStats io_stats;
+
+/**
+ * Consume the given number of bytes from the data of the buffers in order, as
+ * they were written, so a partial write can resume where it stopped.
+ */
+void consume_buffers(Buffer **bufs, int num_bufs, size_t num_bytes) {
+  for (int i = 0; i < num_bufs && num_bytes > 0; ++i) {
+    Buffer *buf = bufs[i];
+    int num_bytes_consumed = buf->size < num_bytes ? buf->size : num_bytes;
+    buf->begin += num_bytes_consumed;
+    buf->size -= num_bytes_consumed;
+    num_bytes -= num_bytes_consumed;
+  }
+}
+
+/**
+ * Write the data left in the buffers with a single writev(2), and consume the
+ * bytes written from them.  Returns what writev(2) returns.
+ */
+ssize_t write_buffers(int fd, Buffer **bufs, int num_bufs) {
+  struct iovec iov[num_bufs];
+  int num_iov = 0;
+  for (int i = 0; i < num_bufs; ++i) {
+    Buffer *buf = bufs[i];
+    if (buf->size == 0) continue;
+    iov[num_iov].iov_base = buf->data + buf->begin;
+    iov[num_iov].iov_len = buf->size;
+    ++num_iov;
+  }
+  ssize_t num_bytes_written = num_iov == 1
+                                  ? write(fd, iov[0].iov_base, iov[0].iov_len)
+                                  : writev(fd, iov, num_iov);
+  COUNT_WRITE(num_bytes_written);
+  if (num_bytes_written > 0) consume_buffers(bufs, num_bufs, num_bytes_written);
+  return num_bytes_written;
+}
+
+/**
+ * Read into the free space after the data of the buffers with a single
+ * readv(2), filling them in order.  Returns what readv(2) returns, after adding
+ * the bytes read to the buffers.
+ */
+ssize_t read_buffers(int fd, Buffer **bufs, int num_bufs) {
+  struct iovec iov[num_bufs];
+  for (int i = 0; i < num_bufs; ++i) {
+    Buffer *buf = bufs[i];
+    iov[i].iov_base = buf->data + buf->begin + buf->size;
+    iov[i].iov_len = buf->capacity - buf->begin - buf->size;
+  }
+  ssize_t num_bytes_read = num_bufs == 1
+                               ? read(fd, iov[0].iov_base, iov[0].iov_len)
+                               : readv(fd, iov, num_bufs);
+  COUNT_READ(num_bytes_read);
+  ssize_t num_bytes_left = num_bytes_read;
+  for (int i = 0; i < num_bufs && num_bytes_left > 0; ++i) {
+    int num_bytes_added =
+        iov[i].iov_len < num_bytes_left ? iov[i].iov_len : num_bytes_left;
+    bufs[i]->size += num_bytes_added;
+    num_bytes_left -= num_bytes_added;
+  }
+  return num_bytes_read;
+}
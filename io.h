@@ -0,0 +1,39 @@
+#ifndef IO_H
+#define IO_H
+
+#include "mkmimo.h"
+
+#define DEFAULT_IO_REPORT 0  // don't count read and write calls by default
+extern int IO_REPORT;
+
+// most buffers a single writev(2) is given, within IOV_MAX on Linux
+#define MAX_GATHER_BUFFERS 1024
+
+// how many calls moved how many bytes, updated atomically when IO_REPORT is on
+typedef struct io_stats {
+  long num_reads;
+  long num_writes;
+  size_t num_bytes_read;
+  size_t num_bytes_written;
+} IoStats;
+extern IoStats io_stats;
+
+// shorthands for counting a read or write call that returned num_bytes
+#define COUNT_IO(num_calls, num_bytes_moved, num_bytes)                      \
+  do {                                                                       \
+    if (IO_REPORT) {                                                         \
+      __atomic_add_fetch(&io_stats.num_calls, 1, __ATOMIC_RELAXED);          \
+      if ((num_bytes) > 0)                                                   \
+        __atomic_add_fetch(&io_stats.num_bytes_moved, (num_bytes),           \
+                           __ATOMIC_RELAXED);                                \
+    }                                                                        \
+  } while (0)
+#define COUNT_READ(num_bytes) COUNT_IO(num_reads, num_bytes_read, num_bytes)
+#define COUNT_WRITE(num_bytes) \
+  COUNT_IO(num_writes, num_bytes_written, num_bytes)
+
+void consume_buffers(Buffer **bufs, int num_bufs, size_t num_bytes);
+ssize_t write_buffers(int fd, Buffer **bufs, int num_bufs);
+ssize_t read_buffers(int fd, Buffer **bufs, int num_bufs);
+
+#endif /* IO_H */
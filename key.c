@@ -0,0 +1,74 @@
+#include "key.h"
+#include "framer.h"
+#include "scan.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Narrow down the content of a record to its key, which is empty if the
+ * record has no such field or bytes.
+ */
+const char *find_key(const KeySpec *key, const char *content, int *len) {
+  if (key->field > 0) {
+    // skip the fields before, then cut the one at the next separator
+    for (int i = 1; i < key->field; ++i) {
+      int j = find_first_byte(content, *len, key->separator);
+      if (j < 0) {
+        *len = 0;
+        return content;
+      }
+      content += j + 1;
+      *len -= j + 1;
+    }
+    int j = find_first_byte(content, *len, key->separator);
+    if (j >= 0) *len = j;
+    return content;
+  } else if (key->bytes_from > 0) {
+    int from = key->bytes_from - 1;
+    int to = key->bytes_to < *len ? key->bytes_to : *len;
+    *len = to > from ? to - from : 0;
+    return content + from;
+  }
+  return content;
+}
+
+/**
+ * Read which part of records is their key from the given environment
+ * variables, where the bytes are given as FROM-TO, or a single byte N, as with
+ * cut -b.  Returns -1 if any is invalid.
+ */
+int parse_key_spec(KeySpec *key, const char *field_name,
+                   const char *separator_name, const char *bytes_name) {
+  char *field = getenv(field_name);
+  if (field != NULL) {
+    key->field = atoi(field);
+    if (key->field < 0) {
+      fprintf(stderr, "%d: Invalid %s, using default %d\n", key->field,
+              field_name, 0);
+      key->field = 0;
+    }
+  }
+  char *separator = getenv(separator_name);
+  if (separator != NULL) {
+    char unescaped[strlen(separator) + 1];
+    if (unescape(unescaped, separator) != 1) {
+      fprintf(stderr, "%s: Invalid %s\n", separator, separator_name);
+      return -1;
+    }
+    key->separator = unescaped[0];
+  }
+  char *bytes = getenv(bytes_name);
+  if (bytes != NULL) {
+    char *end;
+    key->bytes_from = strtol(bytes, &end, 10);
+    key->bytes_to =
+        *end == '-' ? strtol(end + 1, &end, 10) : key->bytes_from;
+    if (*end != '\0' || key->bytes_from < 1 ||
+        key->bytes_to < key->bytes_from || key->field > 0) {
+      fprintf(stderr, "%s: Invalid %s\n", bytes, bytes_name);
+      return -1;
+    }
+  }
+  return 0;
+}
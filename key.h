@@ -0,0 +1,26 @@
+#ifndef KEY_H
+#define KEY_H
+
+#include <stdbool.h>
+
+#define DEFAULT_KEY_SEPARATOR '\t'
+
+// which part of every record is its key: the field at a 1-based index among
+// ones separated by the separator, or a 1-based inclusive range of bytes, or
+// the whole content of the record when neither is given
+typedef struct key_spec {
+  int field;
+  char separator;
+  int bytes_from;
+  int bytes_to;
+} KeySpec;
+
+static inline bool is_key_given(const KeySpec *key) {
+  return key->field > 0 || key->bytes_from > 0;
+}
+
+const char *find_key(const KeySpec *key, const char *content, int *len);
+int parse_key_spec(KeySpec *key, const char *field_name,
+                   const char *separator_name, const char *bytes_name);
+
+#endif /* KEY_H */
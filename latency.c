@@ -0,0 +1,161 @@
+#include "latency.h"
+#include <pthread.h>
+#include <signal.h>
+
+static inline int bucket_of(unsigned long long value) {
+  if (value < SUB_BUCKETS) return value;
+  int exponent = 63 - __builtin_clzll(value);
+  return (exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS +
+         ((value >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1));
+}
+
+// the largest value that falls in the bucket
+static inline long long highest_in_bucket(int bucket) {
+  if (bucket < SUB_BUCKETS) return bucket;
+  int exponent = bucket / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+  int shift = exponent - SUB_BUCKET_BITS;
+  unsigned long long lowest =
+      (unsigned long long)(SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+  return lowest + ((1ULL << shift) - 1);
+}
+
+void record_value(Histogram *histogram, long long value) {
+  if (value < 0) value = 0;
+  __atomic_add_fetch(&histogram->counts[bucket_of(value)], 1,
+                     __ATOMIC_RELAXED);
+}
+
+/**
+ * Find the value below which the given percentage of the recorded ones fall,
+ * within the precision of the buckets, or -1 if none was recorded.
+ */
+long long value_at_percentile(Histogram *histogram, double percentile) {
+  long counts[NUM_BUCKETS];
+  long total = 0;
+  for (int i = 0; i < NUM_BUCKETS; ++i) {
+    counts[i] = __atomic_load_n(&histogram->counts[i], __ATOMIC_RELAXED);
+    total += counts[i];
+  }
+  if (total == 0) return -1;
+  long rank = (long)(percentile / 100 * total + 0.5);
+  if (rank < 1) rank = 1;
+  long num_values = 0;
+  for (int i = 0; i < NUM_BUCKETS; ++i) {
+    num_values += counts[i];
+    if (num_values >= rank) return highest_in_bucket(i);
+  }
+  return highest_in_bucket(NUM_BUCKETS - 1);
+}
+
+/**
+ * Record how long a buffer an output wrote all of stayed, and forget when it
+ * was read and taken, as it may be reused without being cleared.
+ */
+void record_written(Latency *latency, Buffer *buf) {
+  long long now = now_ns();
+  if (buf->taken_ns != 0) {
+    record_value(&latency->writing, now - buf->taken_ns);
+    if (buf->read_ns != 0)
+      record_value(&latency->queued, buf->taken_ns - buf->read_ns);
+  }
+  if (buf->read_ns != 0) record_value(&latency->dwell, now - buf->read_ns);
+  buf->read_ns = buf->taken_ns = 0;
+}
+
+// how many bytes snprintf(3) put in a buffer of len bytes, which returns how
+// many it would have put instead, so what follows is cut off rather than
+// formatted past the end
+static inline int num_bytes_put(int n, size_t len) {
+  if (n < 0 || len == 0) return 0;
+  return (size_t)n < len ? n : len - 1;
+}
+
+static int format_duration(char *s, size_t len, long long ns) {
+  if (ns < 0) return num_bytes_put(snprintf(s, len, "-"), len);
+  if (ns < 1000) return num_bytes_put(snprintf(s, len, "%lldns", ns), len);
+  if (ns < 1000000)
+    return num_bytes_put(snprintf(s, len, "%.1fus", ns / 1e3), len);
+  if (ns < 1000000000)
+    return num_bytes_put(snprintf(s, len, "%.1fms", ns / 1e6), len);
+  return num_bytes_put(snprintf(s, len, "%.2fs", ns / 1e9), len);
+}
+
+static int format_percentiles(char *s, size_t len, const char *what,
+                              Histogram *histogram) {
+  int n = num_bytes_put(snprintf(s, len, " %s=", what), len);
+  double percentiles[] = {50, 99, 99.9};
+  for (int i = 0; i < 3; ++i) {
+    if (i > 0) n += num_bytes_put(snprintf(s + n, len - n, "/"), len - n);
+    n += format_duration(s + n, len - n,
+                         value_at_percentile(histogram, percentiles[i]));
+  }
+  return n;
+}
+
+/**
+ * Print the 50th, 99th, and 99.9th percentiles of how long the buffers every
+ * output wrote stayed, a line formatted on the stack and written at once, so
+ * the ones of reports printed on signals and on exit don't mix.
+ */
+void report_latency(Outputs *outputs) {
+  for (int i = 0; i < outputs->num_outputs; ++i) {
+    Output *output = &outputs->outputs[i];
+    char line[BUFSIZ];
+    size_t len = sizeof(line) - 1;
+    int n = num_bytes_put(
+        snprintf(line, len, "%s: latency p50/p99/p999", output->name), len);
+    n += format_percentiles(line + n, len - n, "queued",
+                            &output->latency->queued);
+    n += format_percentiles(line + n, len - n, "writing",
+                            &output->latency->writing);
+    n += format_percentiles(line + n, len - n, "dwell",
+                            &output->latency->dwell);
+    line[n++] = '\n';
+    if (write(STDERR_FILENO, line, n) < 0) return;
+  }
+}
+
+static Outputs *reported_outputs;
+// the handler only writes a byte to it, as formatting the report isn't
+// async-signal-safe, and a thread reading it prints the report
+static int signal_pipe[2];
+
+static void report_latency_of_outputs(int sig) {
+  int saved_errno = errno;
+  char c = sig;
+  if (write(signal_pipe[1], &c, 1) < 0) {
+    // a full pipe already holds reports to print
+  }
+  errno = saved_errno;
+}
+
+/**
+ * Function executed by the thread printing the report whenever the signal
+ * was caught.
+ */
+static void *report_latency_on_request(void *arg) {
+  char c;
+  for (;;) {
+    ssize_t num_bytes_read = read(signal_pipe[0], &c, 1);
+    if (num_bytes_read < 0 && errno == EINTR) continue;
+    if (num_bytes_read <= 0) return NULL;
+    report_latency(reported_outputs);
+  }
+}
+
+void report_latency_on_signal(Outputs *outputs) {
+  reported_outputs = outputs;
+  if (pipe(signal_pipe) < 0) {
+    perrorf("pipe for %s", "SIGUSR2");
+    return;
+  }
+  fcntl(signal_pipe[1], F_SETFL, O_NONBLOCK);
+  pthread_t thread;
+  CHECK_ERRNO(pthread_create, &thread, NULL, report_latency_on_request, NULL);
+  pthread_detach(thread);
+  // restarting the calls it interrupts, which would otherwise fail the streams
+  struct sigaction action = {.sa_handler = report_latency_of_outputs,
+                             .sa_flags = SA_RESTART};
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGUSR2, &action, NULL);
+}
@@ -0,0 +1,58 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include "mkmimo.h"
+
+// whether to time how long buffers stay before their records are written, and
+// print the percentiles per output on exit, or on SIGUSR2
+#define DEFAULT_LATENCY_REPORT 0
+extern int LATENCY_REPORT;
+
+// log-linear buckets of nanoseconds as in HdrHistogram: exact below
+// SUB_BUCKETS, and SUB_BUCKETS of them for every power of two above, so a
+// value falls within 1/SUB_BUCKETS of its bucket's
+#define SUB_BUCKET_BITS 4
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define NUM_BUCKETS ((64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS)
+
+// counts of the values in every bucket, updated atomically
+typedef struct histogram {
+  long counts[NUM_BUCKETS];
+} Histogram;
+
+// how long the buffers written to an output stayed
+typedef struct latency {
+  Histogram queued;   // from reading their first bytes until it took them
+  Histogram writing;  // from then until it wrote all of them
+  Histogram dwell;    // the whole time
+} Latency;
+
+// shorthands doing nothing unless LATENCY_REPORT is on, for when a buffer's
+// first bytes were read, or the records of another buffer read before were
+// copied to it, when an output took it, and when it was written
+#define STAMP_READ(buf)                                           \
+  do {                                                            \
+    if (LATENCY_REPORT && (buf)->read_ns == 0)                    \
+      (buf)->read_ns = now_ns();                                  \
+  } while (0)
+#define STAMP_READ_AS(buf, when_read_ns)                          \
+  do {                                                            \
+    if (LATENCY_REPORT && (buf)->read_ns == 0)                    \
+      (buf)->read_ns = (when_read_ns) ? (when_read_ns) : now_ns(); \
+  } while (0)
+#define STAMP_TAKEN(buf)                                          \
+  do {                                                            \
+    if (LATENCY_REPORT) (buf)->taken_ns = now_ns();               \
+  } while (0)
+#define RECORD_WRITTEN(output, buf)                               \
+  do {                                                            \
+    if (LATENCY_REPORT) record_written((output)->latency, (buf)); \
+  } while (0)
+
+void record_value(Histogram *histogram, long long value);
+long long value_at_percentile(Histogram *histogram, double percentile);
+void record_written(Latency *latency, Buffer *buf);
+void report_latency(Outputs *outputs);
+void report_latency_on_signal(Outputs *outputs);
+
+#endif /* LATENCY_H */
@@ -1,9 +1,26 @@
+#include "adapt.h"
+#include "compress.h"
+#include "decompress.h"
+#include "framer.h"
+#include "io.h"
+#include "latency.h"
 #include "mkmimo.h"
+#include "mkmimo_epoll.h"
+#include "mkmimo_io_uring.h"
 #include "mkmimo_multithreaded.h"
 #include "mkmimo_nonblocking.h"
+#include "mkmimo_sharded.h"
+#include "merge.h"
+#include "partition.h"
+#include "routing.h"
+#include "sequence.h"
+#include "splice.h"
+#include "stats.h"
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <poll.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -17,8 +34,7 @@
 // Function pointer to the mkmimo implementation to use
 static int (*mkmimo)(Inputs *, Outputs *) = NULL;
 
-/* Declared externally in mkmimo.h */
-int BLOCKSIZE = DEFAULT_BLOCKSIZE;
+static int MEMORY_REPORT = 0;
 
 static char NAME_FOR_STDIN[] = "/dev/stdin";
 static char NAME_FOR_STDOUT[] = "/dev/stdout";
@@ -30,6 +46,18 @@ static inline void clean_up(Inputs *inputs, Outputs *outputs) {
   }
 }
 
+/**
+ * Close the outputs the engine left open, as it only closes the ones that
+ * failed, so the pipes of compressed outputs end.
+ */
+static inline void close_outputs(Outputs *outputs) {
+  for (int i = 0; i < outputs->num_outputs; i++) {
+    if (outputs->outputs[i].is_closed) continue;
+    close(outputs->outputs[i].fd);
+    outputs->outputs[i].is_closed = 1;
+  }
+}
+
 static inline int open_inputs(char *argv[], Inputs *inputs, int num_in,
                               bool use_stdin) {
   inputs->num_inputs = num_in;
@@ -47,6 +75,9 @@ static inline int open_inputs(char *argv[], Inputs *inputs, int num_in,
         return 1;
       }
     }
+    // and read gzip files inflated
+    fd = open_decompressed(fd, name);
+    if (fd < 0) return 1;
 
     // Initialize input struct
     struct input this = {
@@ -57,6 +88,9 @@ static inline int open_inputs(char *argv[], Inputs *inputs, int num_in,
         .is_near_eof = 0,
         .is_readable = 0,
         .is_buffered = 0,
+        .block_size = BLOCKSIZE,
+        .pipe_capacity = get_pipe_capacity(fd),
+        .stats = calloc(1, sizeof(StreamStats)),
     };
     inputs->inputs[i] = this;
   }
@@ -82,13 +116,19 @@ static inline int open_outputs(char *argv[], Outputs *outputs, int num_out,
         return 1;
       }
     }
+    fd = open_compressed(fd, name);
+    if (fd < 0) return 1;
     struct output this = {
         .fd = fd,
         .name = name,
         .buffer = NULL,
+        .spliced = new_spliced_pipe(fd),
         .is_closed = 0,
         .is_writable = 0,
         .is_busy = 0,
+        .pipe_capacity = get_pipe_capacity(fd),
+        .stats = calloc(1, sizeof(StreamStats)),
+        .latency = LATENCY_REPORT ? calloc(1, sizeof(Latency)) : NULL,
     };
     outputs->outputs[i] = this;
   }
@@ -131,6 +171,22 @@ static inline int parse_arguments(int argc, char *argv[], Inputs *inputs,
   return 0;
 }
 
+/**
+ * Parse a number of bytes with an optional K, M, or G suffix, returning -1 if
+ * it's invalid.
+ */
+static inline long long parse_size(const char *str) {
+  char *end;
+  long long size = strtoll(str, &end, 10);
+  if (end == str || size < 0) return -1;
+  switch (*end) {
+    case 'G': case 'g': size *= 1024;  // fall through
+    case 'M': case 'm': size *= 1024;  // fall through
+    case 'K': case 'k': size *= 1024; ++end; break;
+  }
+  return *end == '\0' ? size : -1;
+}
+
 static inline void parse_environ(void) {
   // determine which implementation to use
   char *impl = getenv("MKMIMO_IMPL");
@@ -141,12 +197,277 @@ static inline void parse_environ(void) {
     mkmimo = mkmimo_nonblocking;
   } else if (!strcmp(impl, "multithreaded")) {
     mkmimo = mkmimo_multithreaded;
+  } else if (!strcmp(impl, "epoll")) {
+    mkmimo = mkmimo_epoll;
+  } else if (!strcmp(impl, "io_uring")) {
+    mkmimo = mkmimo_io_uring;
+  } else if (!strcmp(impl, "sharded")) {
+    mkmimo = mkmimo_sharded;
   } else {
     fprintf(stderr, "%s: Invalid MKMIMO_IMPL\n", impl);
     exit(1);
   }
   // get initial buffer size
   readIntFromEnv(BLOCKSIZE, BLOCKSIZE, BLOCKSIZE > 0, DEFAULT_BLOCKSIZE);
+  // how large each stream's blocks can grow
+  char *adaptive_blocksize = getenv("ADAPTIVE_BLOCKSIZE");
+  if (adaptive_blocksize != NULL) {
+    long long size = parse_size(adaptive_blocksize);
+    if (size < 0 || size > INT_MAX) {
+      fprintf(stderr, "%s: Invalid ADAPTIVE_BLOCKSIZE\n", adaptive_blocksize);
+      exit(1);
+    }
+    ADAPTIVE_BLOCKSIZE = size;
+    DEBUG("ADAPTIVE_BLOCKSIZE=%d", ADAPTIVE_BLOCKSIZE);
+  }
+  // how the memory for buffers is backed
+  readIntFromEnv(HUGEPAGES, HUGEPAGES, HUGEPAGES >= 0 && HUGEPAGES <= 2,
+                 DEFAULT_HUGEPAGES);
+  readIntFromEnv(PREFAULT, PREFAULT, PREFAULT == 0 || PREFAULT == 1,
+                 DEFAULT_PREFAULT);
+  // how much memory buffers can take, and what to do with records beyond it
+  char *max_memory = getenv("MKMIMO_MAX_MEMORY");
+  if (max_memory != NULL) {
+    long long size = parse_size(max_memory);
+    if (size < 0) {
+      fprintf(stderr, "%s: Invalid MKMIMO_MAX_MEMORY\n", max_memory);
+      exit(1);
+    }
+    MKMIMO_MAX_MEMORY = size;
+    DEBUG("MKMIMO_MAX_MEMORY=%zu", MKMIMO_MAX_MEMORY);
+  }
+  char *memory_policy = getenv("MEMORY_POLICY");
+  if (memory_policy != NULL) {
+    if (!strcmp(memory_policy, "backpressure")) {
+      MEMORY_POLICY = MEMORY_POLICY_BACKPRESSURE;
+    } else if (!strcmp(memory_policy, "fail")) {
+      MEMORY_POLICY = MEMORY_POLICY_FAIL;
+    } else if (!strcmp(memory_policy, "emit")) {
+      MEMORY_POLICY = MEMORY_POLICY_EMIT;
+    } else {
+      fprintf(stderr, "%s: Invalid MEMORY_POLICY\n", memory_policy);
+      exit(1);
+    }
+  }
+  readIntFromEnv(MEMORY_REPORT, MEMORY_REPORT,
+                 MEMORY_REPORT == 0 || MEMORY_REPORT == 1, 0);
+  // determine how records are delimited
+  char *record_format = getenv("RECORD_FORMAT");
+  int record_size = 0;
+  readIntFromEnv(RECORD_SIZE, record_size, record_size > 0, 0);
+  if (record_format != NULL &&
+      set_record_format(record_format, getenv("RECORD_DELIMITER"),
+                        record_size) < 0) {
+    fprintf(stderr, "%s: Invalid RECORD_FORMAT\n", record_format);
+    exit(1);
+  }
+  // how outputs are chosen for filled buffers
+  char *routing = getenv("ROUTING");
+  if (routing != NULL) {
+    if (!strcmp(routing, "round-robin")) {
+      ROUTING = ROUTING_ROUND_ROBIN;
+    } else if (!strcmp(routing, "least-outstanding")) {
+      ROUTING = ROUTING_LEAST_OUTSTANDING;
+    } else if (!strcmp(routing, "p2c-ewma")) {
+      ROUTING = ROUTING_P2C_EWMA;
+    } else {
+      fprintf(stderr, "%s: Invalid ROUTING\n", routing);
+      exit(1);
+    }
+  }
+  // whether to send every record to every output, and how far one may lag
+  readIntFromEnv(BROADCAST, BROADCAST, BROADCAST == 0 || BROADCAST == 1,
+                 DEFAULT_BROADCAST);
+  readIntFromEnv(BROADCAST_LAG, BROADCAST_LAG, BROADCAST_LAG > 0,
+                 DEFAULT_BROADCAST_LAG);
+  char *broadcast_policy = getenv("BROADCAST_POLICY");
+  if (broadcast_policy != NULL) {
+    if (!strcmp(broadcast_policy, "block")) {
+      BROADCAST_POLICY = BROADCAST_POLICY_BLOCK;
+    } else if (!strcmp(broadcast_policy, "drop")) {
+      BROADCAST_POLICY = BROADCAST_POLICY_DROP;
+    } else {
+      fprintf(stderr, "%s: Invalid BROADCAST_POLICY\n", broadcast_policy);
+      exit(1);
+    }
+  }
+  // which part of records to route them by
+  if (parse_key_spec(&partition_key, "PARTITION_FIELD", "PARTITION_SEPARATOR",
+                     "PARTITION_BYTES") < 0)
+    exit(1);
+  // whether to merge sorted inputs, and by which part of records
+  readIntFromEnv(MERGE, MERGE, MERGE == 0 || MERGE == 1, DEFAULT_MERGE);
+  if (parse_key_spec(&merge_key, "MERGE_FIELD", "MERGE_SEPARATOR",
+                     "MERGE_BYTES") < 0)
+    exit(1);
+  // whether to log the chunks going out, or put them back in order coming in
+  SEQUENCE_FILE = getenv("SEQUENCE_FILE");
+  REORDER_FILE = getenv("REORDER_FILE");
+  readIntFromEnv(REORDER_WINDOW, REORDER_WINDOW, REORDER_WINDOW > 0,
+                 DEFAULT_REORDER_WINDOW);
+  if (is_sequencing() && (is_partitioning() || is_merging())) {
+    fprintf(stderr, "mkmimo: SEQUENCE_FILE can't be used while partitioning "
+                    "or merging records\n");
+    exit(1);
+  }
+  if (is_reordering() && (is_partitioning() || is_merging())) {
+    fprintf(stderr, "mkmimo: REORDER_FILE can't be used while partitioning "
+                    "or merging records\n");
+    exit(1);
+  }
+  if (is_broadcasting() && (is_partitioning() || is_merging() ||
+                            is_sequencing() || is_reordering())) {
+    fprintf(stderr, "mkmimo: BROADCAST=1 can't be used while partitioning, "
+                    "merging, or ordering records\n");
+    exit(1);
+  }
+  if ((is_partitioning() || is_merging() || is_sequencing() ||
+       is_reordering() || is_broadcasting()) &&
+      mkmimo != mkmimo_multithreaded) {
+    fprintf(stderr,
+            "mkmimo: %s can't partition, merge, order, or broadcast records, "
+            "falling back to %s\n",
+            impl, "multithreaded");
+    mkmimo = mkmimo_multithreaded;
+  }
+  // whether to inflate gzip inputs, and with how many threads
+  readIntFromEnv(DECOMPRESS, DECOMPRESS, DECOMPRESS == 0 || DECOMPRESS == 1,
+                 DEFAULT_DECOMPRESS);
+  readIntFromEnv(DECOMPRESS_WORKERS, DECOMPRESS_WORKERS,
+                 DECOMPRESS_WORKERS >= 0, DEFAULT_DECOMPRESS_WORKERS);
+  // which outputs to deflate, how hard, and with how many threads
+  char *compress = getenv("COMPRESS");
+  if (compress != NULL) {
+    if (!strcmp(compress, "auto")) {
+      COMPRESS = COMPRESS_AUTO;
+    } else if (!strcmp(compress, "always")) {
+      COMPRESS = COMPRESS_ALWAYS;
+    } else if (!strcmp(compress, "never")) {
+      COMPRESS = COMPRESS_NEVER;
+    } else {
+      fprintf(stderr, "%s: Invalid COMPRESS\n", compress);
+      exit(1);
+    }
+  }
+  readIntFromEnv(COMPRESS_LEVEL, COMPRESS_LEVEL,
+                 COMPRESS_LEVEL >= 1 && COMPRESS_LEVEL <= 9,
+                 DEFAULT_COMPRESS_LEVEL);
+  readIntFromEnv(COMPRESS_WORKERS, COMPRESS_WORKERS, COMPRESS_WORKERS >= 0,
+                 DEFAULT_COMPRESS_WORKERS);
+  // where to export what goes through every stream, and how often
+  STATS_FILE = getenv("STATS_FILE");
+  readIntFromEnv(STATS_INTERVAL, STATS_INTERVAL, STATS_INTERVAL > 0,
+                 DEFAULT_STATS_INTERVAL);
+  // whether to count the read and write calls
+  readIntFromEnv(IO_REPORT, IO_REPORT, IO_REPORT == 0 || IO_REPORT == 1,
+                 DEFAULT_IO_REPORT);
+  // whether to time how long records stay before they're written
+  readIntFromEnv(LATENCY_REPORT, LATENCY_REPORT,
+                 LATENCY_REPORT == 0 || LATENCY_REPORT == 1,
+                 DEFAULT_LATENCY_REPORT);
+  // whether to move bytes to pipe outputs without copying
+  readIntFromEnv(ZEROCOPY, ZEROCOPY, ZEROCOPY == 0 || ZEROCOPY == 1,
+                 DEFAULT_ZEROCOPY);
+  // pages gifted to one pipe can't be shared with the other outputs
+  if (ZEROCOPY && is_broadcasting()) {
+    fprintf(stderr, "mkmimo: ZEROCOPY can't be used while broadcasting, "
+                    "copying to pipes instead\n");
+    ZEROCOPY = 0;
+  }
+}
+
+/**
+ * Report how close buffers came to MKMIMO_MAX_MEMORY.
+ */
+static inline void report_memory_usage(void) {
+  fprintf(stderr, "mkmimo: memory peak=%zu",
+          memory_stats.peak_num_bytes_in_use);
+  if (MKMIMO_MAX_MEMORY > 0)
+    fprintf(stderr, " budget=%zu (%.1f%%)", MKMIMO_MAX_MEMORY,
+            100.0 * memory_stats.peak_num_bytes_in_use / MKMIMO_MAX_MEMORY);
+  fprintf(stderr, " in_use=%zu denied=%ld cut=%ld failed=%ld\n",
+          memory_stats.num_bytes_in_use, memory_stats.num_growths_denied,
+          memory_stats.num_records_cut, memory_stats.num_inputs_failed);
+}
+
+/**
+ * Report how far the order restored lagged behind what was read.
+ */
+static inline void report_reorder_window(void) {
+  fprintf(stderr,
+          "mkmimo: reorder chunks=%ld held=%ld moved=%ld "
+          "peak_chunks_ahead=%d (window %d) peak_bytes_held=%ld\n",
+          reorder_stats.num_chunks_restored, reorder_stats.num_chunks_held,
+          reorder_stats.num_chunks_moved, reorder_stats.peak_num_chunks_ahead,
+          REORDER_WINDOW,
+          reorder_stats.peak_num_bytes_held);
+}
+
+/**
+ * Report the records broadcast that outputs missed, while lagging behind or
+ * after they failed.
+ */
+static inline void report_records_skipped(Outputs *outputs) {
+  for (int i = 0; i < outputs->num_outputs; i++) {
+    Output *output = &outputs->outputs[i];
+    if (output->num_records_skipped > 0)
+      fprintf(stderr, "%s: skipped %ld records broadcast to the others\n",
+              output->name, output->num_records_skipped);
+  }
+}
+
+/**
+ * Report how many read and write calls it took to move every MiB.
+ */
+static inline void report_io_calls(void) {
+  double num_mib_read = io_stats.num_bytes_read / 1048576.0;
+  double num_mib_written = io_stats.num_bytes_written / 1048576.0;
+  fprintf(stderr, "mkmimo: io reads=%ld (%.1f/MiB) writes=%ld (%.1f/MiB)\n",
+          io_stats.num_reads,
+          num_mib_read > 0 ? io_stats.num_reads / num_mib_read : 0.0,
+          io_stats.num_writes,
+          num_mib_written > 0 ? io_stats.num_writes / num_mib_written : 0.0);
+}
+
+/**
+ * Report how many members of gzip inputs were inflated ahead of their turn.
+ */
+static inline void report_decompression(void) {
+  long num_members = decompress_stats.num_members_ahead +
+                     decompress_stats.num_members_in_order;
+  fprintf(stderr, "mkmimo: inflated inputs=%ld members=%ld ahead=%ld "
+                  "(%.1f%%) failed=%ld\n",
+          decompress_stats.num_inputs_inflated, num_members,
+          decompress_stats.num_members_ahead,
+          num_members > 0
+              ? 100.0 * decompress_stats.num_members_ahead / num_members
+              : 0.0,
+          decompress_stats.num_inputs_failed);
+}
+
+/**
+ * Report how much the compressed outputs were deflated.
+ */
+static inline void report_compression(void) {
+  fprintf(stderr, "mkmimo: deflated outputs=%ld bytes=%zu into %zu (%.1f%%) "
+                  "failed=%ld\n",
+          compress_stats.num_outputs_deflated, compress_stats.num_bytes_in,
+          compress_stats.num_bytes_out,
+          compress_stats.num_bytes_in > 0
+              ? 100.0 * compress_stats.num_bytes_out /
+                    compress_stats.num_bytes_in
+              : 0.0,
+          compress_stats.num_outputs_failed);
+}
+
+/**
+ * Report the records left by outputs that failed, and where they went.
+ */
+static inline void report_failover(void) {
+  fprintf(stderr, "mkmimo: failover rerouted=%ld resent=%ld dropped=%ld\n",
+          failover_stats.num_records_rerouted,
+          failover_stats.num_records_resent,
+          failover_stats.num_records_dropped);
 }
 
 int main(int argc, char *argv[]) {
@@ -160,10 +481,54 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
+  // records put back in order make a single stream
+  if (is_reordering() && outputs.num_outputs > 1) {
+    fprintf(stderr, "mkmimo: REORDER_FILE with %d outputs needs just one\n",
+            outputs.num_outputs);
+    return 1;
+  }
+  // a single sorted stream can only be split among outputs by key
+  if (is_merging() && outputs.num_outputs > 1 && !is_partitioning()) {
+    fprintf(stderr, "mkmimo: MERGE=1 with %d outputs needs PARTITION_FIELD or "
+                    "PARTITION_BYTES\n",
+            outputs.num_outputs);
+    return 1;
+  }
+
   DEBUG("Reading from %d inputs...", inputs.num_inputs);
   DEBUG("Writing to %d outputs...", outputs.num_outputs);
 
+  // let writes to an output whose reader is gone fail instead of killing the
+  // process, so the records left can go to the other outputs
+  signal(SIGPIPE, SIG_IGN);
+
+  if (start_exporting_stats(&inputs, &outputs) < 0) return 1;
+  if (LATENCY_REPORT) report_latency_on_signal(&outputs);
   int exitstatus = mkmimo(&inputs, &outputs);
+  stop_exporting_stats();
+  // inputs failed for oversized records fail the whole run
+  if (memory_stats.num_inputs_failed > 0) exitstatus = 1;
+  // as do records lost with all outputs
+  if (failover_stats.num_records_dropped > 0) exitstatus = 1;
+  // or gzip inputs that couldn't be inflated whole
+  if (decompress_stats.num_inputs_failed > 0) exitstatus = 1;
+  // or compressed outputs whose blocks couldn't all be written
+  close_outputs(&outputs);
+  if (finish_compressing() < 0) exitstatus = 1;
+
+  if (MEMORY_REPORT) report_memory_usage();
+  if (MEMORY_REPORT && is_reordering()) report_reorder_window();
+  if (failover_stats.num_records_rerouted > 0 ||
+      failover_stats.num_records_dropped > 0)
+    report_failover();
+  if (is_broadcasting()) report_records_skipped(&outputs);
+  if (IO_REPORT) report_io_calls();
+  if (IO_REPORT && decompress_stats.num_inputs_inflated > 0)
+    report_decompression();
+  if (IO_REPORT && compress_stats.num_outputs_deflated > 0)
+    report_compression();
+  if (IO_REPORT && ADAPTIVE_BLOCKSIZE) report_stream_sizes(&inputs, &outputs);
+  if (LATENCY_REPORT) report_latency(&outputs);
 
   clean_up(&inputs, &outputs);
   DEBUG("%s", "All done!");
@@ -0,0 +1,129 @@
+#include "merge.h"
+#include "framer.h"
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Split the records at the cursor into a batch, taking the bytes that don't
+ * make a complete record, e.g., a last one missing its delimiter, as one.
+ */
+static inline void split_records(MergeCursor *cursor, int records_begin) {
+  Buffer *buf = cursor->buf;
+  int records_end = buf->begin + buf->size;
+  cursor->num_ends = framer->find_ends_of_records(
+      buf->data, records_begin, records_end, cursor->ends,
+      MAX_RECORDS_MERGED_AT_ONCE);
+  for (int k = 0; k < cursor->num_ends; ++k) ++cursor->ends[k];
+  if (cursor->num_ends == 0) cursor->ends[cursor->num_ends++] = records_end;
+  cursor->next_end = 0;
+}
+
+/**
+ * Move the head to the next record split, and find its key.
+ */
+static inline void take_next_record(MergeCursor *cursor) {
+  const char *data = cursor->buf->data;
+  cursor->end = cursor->ends[cursor->next_end++];
+  cursor->key_length =
+      find_end_of_record_content(data, cursor->begin, cursor->end) -
+      cursor->begin;
+  cursor->key = find_key(&merge_key, data + cursor->begin, &cursor->key_length);
+}
+
+/**
+ * Point the cursor at the first record of a buffer holding the next records
+ * of its input, or at none once the input is exhausted.
+ */
+void set_cursor_buffer(MergeCursor *cursor, Buffer *buf) {
+  cursor->buf = buf;
+  cursor->is_exhausted = buf == NULL;
+  if (buf == NULL) return;
+  cursor->begin = buf->begin;
+  split_records(cursor, cursor->begin);
+  take_next_record(cursor);
+}
+
+/**
+ * Move the cursor past the record at its head.  Returns false if no record is
+ * left in its buffer.
+ */
+bool advance_cursor(MergeCursor *cursor) {
+  Buffer *buf = cursor->buf;
+  cursor->begin = cursor->end;
+  if (cursor->begin >= buf->begin + buf->size) return false;
+  if (cursor->next_end == cursor->num_ends)
+    split_records(cursor, cursor->begin);
+  take_next_record(cursor);
+  return true;
+}
+
+/**
+ * Whether the head of cursor a comes before that of b, comparing the bytes of
+ * their keys as with LC_ALL=C sort, or the order of the inputs for equal keys,
+ * so records with the same key keep it.  Exhausted inputs come last.
+ */
+static inline bool comes_before(const Merger *merger, int a, int b) {
+  const MergeCursor *x = &merger->cursors[a], *y = &merger->cursors[b];
+  if (x->buf == NULL || y->buf == NULL) return y->buf == NULL && x->buf != NULL;
+  int len = x->key_length < y->key_length ? x->key_length : y->key_length;
+  int cmp = memcmp(x->key, y->key, len);
+  if (cmp != 0) return cmp < 0;
+  if (x->key_length != y->key_length) return x->key_length < y->key_length;
+  return a < b;
+}
+
+Merger *new_merger(int num_cursors) {
+  Merger *merger = malloc(sizeof(Merger));
+  merger->num_cursors = num_cursors;
+  merger->cursors = calloc(num_cursors, sizeof(MergeCursor));
+  merger->losers = calloc(num_cursors, sizeof(int));
+  merger->winner = 0;
+  return merger;
+}
+
+void free_merger(Merger *merger) {
+  free(merger->cursors);
+  free(merger->losers);
+  free(merger);
+}
+
+/**
+ * Play the matches below a node of the tree, where the leaves are the nodes
+ * from num_cursors on, returning the winner.
+ */
+static int play_matches(Merger *merger, int node) {
+  if (node >= merger->num_cursors) return node - merger->num_cursors;
+  int a = play_matches(merger, 2 * node);
+  int b = play_matches(merger, 2 * node + 1);
+  if (comes_before(merger, b, a)) {
+    merger->losers[node] = a;
+    return b;
+  }
+  merger->losers[node] = b;
+  return a;
+}
+
+/**
+ * Find the first record among the heads of all cursors once they're set.
+ * Returns the cursor holding it.
+ */
+int start_merge(Merger *merger) {
+  merger->winner = merger->num_cursors > 1 ? play_matches(merger, 1) : 0;
+  return merger->winner;
+}
+
+/**
+ * Find the first record again after the winner's cursor moved on, with one
+ * match at every level of the tree.  Returns the cursor holding it.
+ */
+int replay_merge(Merger *merger) {
+  int winner = merger->winner;
+  for (int node = (winner + merger->num_cursors) / 2; node > 0; node /= 2) {
+    if (comes_before(merger, merger->losers[node], winner)) {
+      int loser = winner;
+      winner = merger->losers[node];
+      merger->losers[node] = loser;
+    }
+  }
+  return merger->winner = winner;
+}
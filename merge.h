@@ -0,0 +1,46 @@
+#ifndef MERGE_H
+#define MERGE_H
+
+#include "buffer.h"
+#include "key.h"
+
+// whether to merge inputs holding sorted records into a single sorted stream,
+// comparing the bytes of their keys
+#define DEFAULT_MERGE 0
+extern int MERGE;
+extern KeySpec merge_key;
+
+static inline bool is_merging(void) { return MERGE != 0; }
+
+// how many records of an input are split in one go
+#define MAX_RECORDS_MERGED_AT_ONCE 256
+
+// the record at the head of an input, and the ones after it in its buffer
+typedef struct merge_cursor {
+  Buffer *buf;  // NULL once the input is exhausted
+  bool is_exhausted;
+  int begin, end;  // Byte range of the record at the head
+  const char *key;
+  int key_length;
+  int ends[MAX_RECORDS_MERGED_AT_ONCE];
+  int num_ends, next_end;
+} MergeCursor;
+
+// a tournament among the heads of the inputs, keeping the loser of every match
+// at the inner nodes, so only the matches on the winner's path are replayed
+// when it advances
+typedef struct merger {
+  int num_cursors;
+  MergeCursor *cursors;
+  int *losers;
+  int winner;
+} Merger;
+
+Merger *new_merger(int num_cursors);
+void free_merger(Merger *merger);
+void set_cursor_buffer(MergeCursor *cursor, Buffer *buf);
+bool advance_cursor(MergeCursor *cursor);
+int start_merge(Merger *merger);
+int replay_merge(Merger *merger);
+
+#endif /* MERGE_H */
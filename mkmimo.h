@@ -10,6 +10,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 // a shorthand for debug messages
@@ -20,12 +21,18 @@
 #define DEBUG(fmt, args...)
 #endif
 
-// a shorthand for printing error messages
-#define perrorf(fmt, args...)                        \
-  do {                                               \
-    char strerrbuf[BUFSIZ];                          \
-    strerror_r(errno, strerrbuf, sizeof(strerrbuf)); \
-    fprintf(stderr, fmt ": %s", args, strerrbuf);    \
+// a shorthand for printing error messages, where GNU's strerror_r(3) may
+// return a static string instead of filling the given one
+#if defined(__GLIBC__) && defined(_GNU_SOURCE)
+#define STRERROR_R(errnum, buf, len) strerror_r(errnum, buf, len)
+#else
+#define STRERROR_R(errnum, buf, len) (strerror_r(errnum, buf, len), (buf))
+#endif
+#define perrorf(fmt, args...)                                         \
+  do {                                                                \
+    char strerrbuf[BUFSIZ];                                           \
+    fprintf(stderr, fmt ": %s\n", args,                               \
+            STRERROR_R(errno, strerrbuf, sizeof(strerrbuf)));         \
   } while (0)
 
 // a shorthand for checking error return values from system and library calls
@@ -41,6 +48,12 @@
   }
 #define CHECK_ERRNO(fn, args...) (void)(CHECKED_ERRNO(fn, args))
 
+static inline long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
 typedef struct input {
   int fd;
   char *name;
@@ -49,6 +62,12 @@ typedef struct input {
   int is_near_eof;
   int is_readable;
   int is_buffered;
+
+  int block_size;       // bytes to read at once, adapted to the stream
+  int num_short_reads;  // reads in a row with much less than that
+  int pipe_capacity;    // of the pipe being read, or 0 if it isn't one
+
+  struct stream_stats *stats;  // shared by the copies of shards
 } Input;
 
 typedef struct {
@@ -65,10 +84,27 @@ typedef struct output {
   int fd;
   char *name;
   Buffer *buffer;
+  struct spliced_pipe *spliced;  // non-NULL when writing with vmsplice(2)
 
   int is_closed;
   int is_writable;
   int is_busy;
+
+  int pipe_capacity;  // of the pipe being written, or 0 if it isn't one
+
+  // load for routing, updated atomically where threads share outputs
+  long num_bytes_outstanding;  // routed to the output but not written yet
+  long throughput;  // moving average of bytes per second written while busy
+  long long drain_start_ns;  // when the output started writing, and how much
+  long num_bytes_draining;
+
+  // buffers broadcast to the output but not written yet, and the records it
+  // missed while too far behind, or after it failed
+  int num_buffers_lagging;
+  long num_records_skipped;
+
+  struct stream_stats *stats;  // shared by the copies of shards
+  struct latency *latency;     // with LATENCY_REPORT, likewise
 } Output;
 
 typedef struct {
@@ -0,0 +1,220 @@
+#include "mkmimo_epoll.h"
+#include "mkmimo_nonblocking.h"
+
+#ifdef __linux__
+#include <sys/epoll.h>
+
+// max number of events to pick up from a single epoll_wait(2)
+#define MAX_EVENTS 256
+// data of the event for the wakeup fd
+#define WAKEUP_EVENT UINT32_MAX
+
+struct event_loop {
+  int epoll_fd;
+  Inputs *inputs;
+  Outputs *outputs;
+  // whether each input/output is registered to epoll (regular files aren't)
+  bool *is_registered;
+  // events of interest currently registered for each output
+  uint32_t *output_events;
+  struct epoll_event events[MAX_EVENTS];
+};
+
+/**
+ * Create an epoll instance and register all inputs and outputs to it once.
+ */
+EventLoop *new_event_loop(Inputs *inputs, Outputs *outputs) {
+  EventLoop *loop = calloc(1, sizeof(EventLoop));
+  loop->inputs = inputs;
+  loop->outputs = outputs;
+  loop->is_registered =
+      calloc(inputs->num_inputs + outputs->num_outputs, sizeof(bool));
+  loop->output_events = calloc(outputs->num_outputs, sizeof(uint32_t));
+  loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (loop->epoll_fd < 0) {
+    perror("epoll_create1");
+    return NULL;
+  }
+  for (int i = 0; i < inputs->num_inputs; ++i) {
+    Input *input = &inputs->inputs[i];
+    struct epoll_event ev = {
+        .events = EPOLLIN | EPOLLRDHUP | EPOLLET, .data.u32 = i,
+    };
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, input->fd, &ev) == 0) {
+      loop->is_registered[i] = true;
+    } else if (errno == EPERM) {
+      // regular files can't be polled, but are always readable
+      DEBUG("%s: not pollable, regarding as always readable", input->name);
+      SET(input, readable, 1);
+    } else {
+      perrorf("epoll_ctl %s", input->name);
+      return NULL;
+    }
+  }
+  for (int i = 0; i < outputs->num_outputs; ++i) {
+    Output *output = &outputs->outputs[i];
+    // outputs start without POLLOUT interest, which is turned on only when a
+    // write would block
+    struct epoll_event ev = {
+        .events = EPOLLET, .data.u32 = inputs->num_inputs + i,
+    };
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, output->fd, &ev) == 0) {
+      loop->is_registered[inputs->num_inputs + i] = true;
+    } else if (errno != EPERM) {
+      perrorf("epoll_ctl %s", output->name);
+      return NULL;
+    }
+    loop->output_events[i] = ev.events;
+    // regard all outputs writable until a write says otherwise
+    SET(output, writable, 1);
+  }
+  return loop;
+}
+
+/**
+ * Watch an extra fd, e.g., an eventfd(2), only for waking up the loop.
+ */
+int watch_wakeup_fd(EventLoop *loop, int fd) {
+  struct epoll_event ev = {
+      .events = EPOLLIN | EPOLLET, .data.u32 = WAKEUP_EVENT,
+  };
+  if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    perror("epoll_ctl");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Turn POLLOUT interest on for outputs whose writes would block, and off for
+ * the ones that became idle.
+ */
+void update_output_interests(EventLoop *loop) {
+  Inputs *inputs = loop->inputs;
+  Outputs *outputs = loop->outputs;
+  for (int i = 0; i < outputs->num_outputs; ++i) {
+    if (!loop->is_registered[inputs->num_inputs + i]) continue;
+    Output *output = &outputs->outputs[i];
+    if (output->is_closed) {
+      // closed fds are dropped by epoll automatically
+      loop->is_registered[inputs->num_inputs + i] = false;
+      continue;
+    }
+    uint32_t events =
+        EPOLLET | (output->is_busy && !output->is_writable ? EPOLLOUT : 0);
+    if (events == loop->output_events[i]) continue;
+    DEBUG("%s: turning POLLOUT %s", output->name,
+          events & EPOLLOUT ? "on" : "off");
+    struct epoll_event ev = {
+        .events = events, .data.u32 = inputs->num_inputs + i,
+    };
+    CHECK_ERRNO(epoll_ctl, loop->epoll_fd, EPOLL_CTL_MOD, output->fd, &ev);
+    loop->output_events[i] = events;
+  }
+}
+
+/**
+ * Wait for readiness changes and reflect them to the inputs and outputs.
+ */
+int wait_for_io_events(EventLoop *loop, int timeout_msec) {
+  Inputs *inputs = loop->inputs;
+  Outputs *outputs = loop->outputs;
+  int num_events =
+      epoll_wait(loop->epoll_fd, loop->events, MAX_EVENTS, timeout_msec);
+  if (num_events < 0) {
+    if (errno == EINTR) return 0;
+    perror("epoll_wait");
+    return -1;
+  }
+  for (int i = 0; i < num_events; ++i) {
+    struct epoll_event *ev = &loop->events[i];
+    uint32_t idx = ev->data.u32;
+    if (idx == WAKEUP_EVENT) {
+      // nothing to reflect, but the caller gets to check its other work
+      continue;
+    } else if (idx < inputs->num_inputs) {
+      Input *input = &inputs->inputs[idx];
+      if (input->is_closed) continue;
+      SET(input, readable, 1);
+      if (ev->events & (EPOLLHUP | EPOLLRDHUP | EPOLLERR))
+        input->is_near_eof = 1;
+    } else {
+      Output *output = &outputs->outputs[idx - inputs->num_inputs];
+      if (output->is_closed) continue;
+      // an error or hangup will be picked up by the next write
+      SET(output, writable, 1);
+    }
+  }
+  DEBUG("epoll returned %d events, %d readable inputs, %d writable outputs",
+        num_events, inputs->num_readable, outputs->num_writable);
+  return num_events;
+}
+
+#else /* !__linux__ */
+
+EventLoop *new_event_loop(Inputs *inputs, Outputs *outputs) {
+  errno = ENOSYS;
+  perror("epoll");
+  return NULL;
+}
+int watch_wakeup_fd(EventLoop *loop, int fd) { return -1; }
+int wait_for_io_events(EventLoop *loop, int timeout_msec) { return -1; }
+void update_output_interests(EventLoop *loop) {}
+
+#endif /* __linux__ */
+
+/**
+ * Whether any I/O can be done right away without waiting for new events.
+ */
+bool has_pending_io(Inputs *inputs, Outputs *outputs) {
+  // buffered records that can be routed to an idle output
+  if (inputs->num_buffered > 0 &&
+      outputs->num_busy < outputs->num_outputs - outputs->num_closed)
+    return true;
+  // readable inputs with room left in their buffers
+  if (inputs->num_readable > 0)
+    for (int i = 0; i < inputs->num_inputs; ++i) {
+      Input *input = &inputs->inputs[i];
+      if (input->is_closed || !input->is_readable) continue;
+      if (input->buffer->size < input->buffer->capacity) return true;
+      // or ones waiting for memory to hold more of a record
+      if (!input->is_buffered && has_memory_to_enlarge(input->buffer))
+        return true;
+    }
+  // busy outputs that can still be written
+  if (outputs->num_writable > 0)
+    for (int i = 0; i < outputs->num_outputs; ++i) {
+      Output *output = &outputs->outputs[i];
+      if (output->is_closed) continue;
+      if (output->is_busy && output->is_writable) return true;
+    }
+  return false;
+}
+
+/**
+ * Nonblocking I/O implementation of mkmimo driven by edge-triggered epoll(7)
+ * events instead of polling every fd at each step.
+ */
+int mkmimo_epoll(Inputs *inputs, Outputs *outputs) {
+  if (initialize_ios(inputs, outputs)) {
+    perror("mkmimo");
+    return 1;
+  }
+  EventLoop *loop = new_event_loop(inputs, outputs);
+  if (loop == NULL) return 1;
+
+  while (records_may_flow_between(inputs, outputs)) {
+    update_output_interests(loop);
+    // block only when there's nothing to do until new events arrive
+    int timeout_msec = has_pending_io(inputs, outputs) ? 0 : -1;
+    if (wait_for_io_events(loop, timeout_msec) < 0) return 1;
+    write_to_available(outputs);
+    if (read_from_available(inputs) > 0)
+      while (exchange_buffered_records(inputs, outputs) > 0)
+        write_to_available(outputs);
+    DEBUG("%s", "----------------------------------------");
+  }
+  drop_records_left(inputs, outputs);
+
+  return outputs->num_closed < outputs->num_outputs ? 0 : 1;
+}
@@ -0,0 +1,19 @@
+#ifndef MKMIMO_EPOLL_H
+#define MKMIMO_EPOLL_H
+
+#include "mkmimo.h"
+
+int mkmimo_epoll(Inputs *inputs, Outputs *outputs);
+
+// an edge-triggered event loop over a set of inputs and outputs, where every
+// fd is registered only once and readiness is kept in the is_readable and
+// is_writable flags until a read or write says otherwise
+typedef struct event_loop EventLoop;
+
+EventLoop *new_event_loop(Inputs *inputs, Outputs *outputs);
+int watch_wakeup_fd(EventLoop *loop, int fd);
+int wait_for_io_events(EventLoop *loop, int timeout_msec);
+void update_output_interests(EventLoop *loop);
+bool has_pending_io(Inputs *inputs, Outputs *outputs);
+
+#endif /* MKMIMO_EPOLL_H */
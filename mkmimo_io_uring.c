@@ -0,0 +1,452 @@
+#ifdef __linux__
+#define _GNU_SOURCE  // for syscall(2) and MAP_POPULATE
+#endif
+
+#include "mkmimo_io_uring.h"
+#include "io.h"
+#include "latency.h"
+#include "routing.h"
+#include "stats.h"
+#include "mkmimo_epoll.h"
+#include "mkmimo_nonblocking.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#ifdef __NR_io_uring_setup
+#define HAVE_IO_URING
+#endif
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+
+/**
+ * Submission and completion queues shared with the kernel.
+ */
+typedef struct {
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  unsigned num_unsubmitted;  // SQEs queued since the last io_uring_enter(2)
+  // the regions mapped, which are unmapped along with closing fd
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_size, cq_ring_size, sqes_size;
+} Ring;
+
+static inline int io_uring_setup(unsigned entries, struct io_uring_params *p) {
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+static inline int io_uring_enter(int fd, unsigned to_submit,
+                                 unsigned min_complete, unsigned flags) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL,
+                 0);
+}
+static inline int io_uring_register(int fd, unsigned opcode, void *arg,
+                                    unsigned nr_args) {
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/**
+ * Unmap the queues of a ring and close it, even one set up only in part,
+ * keeping errno as it was.
+ */
+static void free_ring(Ring *ring) {
+  int saved_errno = errno;
+  if (ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  if (ring->sq_ring != MAP_FAILED) munmap(ring->sq_ring, ring->sq_ring_size);
+  if (ring->fd >= 0) close(ring->fd);
+  ring->fd = -1;
+  ring->sq_ring = ring->cq_ring = ring->sqes = MAP_FAILED;
+  errno = saved_errno;
+}
+
+/**
+ * Set up a ring that can hold the given number of requests in flight, or
+ * release what was set up of it if that fails.
+ */
+static inline int init_ring(Ring *ring, unsigned entries) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  ring->sq_ring = ring->cq_ring = ring->sqes = MAP_FAILED;
+  ring->fd = io_uring_setup(entries, &p);
+  if (ring->fd < 0) return -1;
+  // map the submission and completion queues
+  size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+  ring->sq_ring_size = sq_size;
+  ring->cq_ring_size = cq_size;
+  ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  void *sq = ring->sq_ring =
+      mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+           ring->fd, IORING_OFF_SQ_RING);
+  if (sq == MAP_FAILED) {
+    free_ring(ring);
+    return -1;
+  }
+  void *cq = ring->cq_ring = sq;
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+    cq = ring->cq_ring =
+        mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+             ring->fd, IORING_OFF_CQ_RING);
+    if (cq == MAP_FAILED) {
+      free_ring(ring);
+      return -1;
+    }
+  }
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    free_ring(ring);
+    return -1;
+  }
+  ring->sq_head = sq + p.sq_off.head;
+  ring->sq_tail = sq + p.sq_off.tail;
+  ring->sq_mask = sq + p.sq_off.ring_mask;
+  ring->sq_array = sq + p.sq_off.array;
+  ring->cq_head = cq + p.cq_off.head;
+  ring->cq_tail = cq + p.cq_off.tail;
+  ring->cq_mask = cq + p.cq_off.ring_mask;
+  ring->cqes = cq + p.cq_off.cqes;
+  ring->num_unsubmitted = 0;
+  return 0;
+}
+
+/**
+ * Queue a read or write request, which is submitted to the kernel in batch.
+ */
+static inline struct io_uring_sqe *queue_request(Ring *ring) {
+  unsigned tail = *ring->sq_tail;
+  unsigned idx = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_array[idx] = idx;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ++ring->num_unsubmitted;
+  return sqe;
+}
+
+/**
+ * Buffers and files registered to the ring, so the kernel doesn't have to
+ * map them for every request.
+ */
+typedef struct {
+  Buffer *buffers;  // all buffers in use, indexed as registered
+  struct iovec *registered_buffers;
+  bool use_registered_buffers;
+  bool use_registered_files;
+  // whether a request is in flight for each input and output
+  bool *is_in_flight;
+  int num_in_flight;
+} Requests;
+
+static inline void prepare_request(Ring *ring, Requests *reqs, int op, int idx,
+                                   int fd, Buffer *buf, void *addr,
+                                   unsigned len) {
+  struct io_uring_sqe *sqe = queue_request(ring);
+  int buf_idx = buf - reqs->buffers;
+  if (reqs->use_registered_buffers &&
+      buf->data == reqs->registered_buffers[buf_idx].iov_base &&
+      buf->capacity <= reqs->registered_buffers[buf_idx].iov_len) {
+    sqe->opcode = op == IORING_OP_READ ? IORING_OP_READ_FIXED
+                                       : IORING_OP_WRITE_FIXED;
+    sqe->buf_index = buf_idx;
+  } else {
+    // the buffer was enlarged and moved away from its registered memory
+    sqe->opcode = op;
+  }
+  if (reqs->use_registered_files) {
+    sqe->fd = idx;
+    sqe->flags |= IOSQE_FIXED_FILE;
+  } else {
+    sqe->fd = fd;
+  }
+  sqe->addr = (unsigned long)addr;
+  sqe->len = len;
+  sqe->off = -1;  // at the current file position
+  sqe->user_data = idx;
+  reqs->is_in_flight[idx] = true;
+  ++reqs->num_in_flight;
+}
+
+/**
+ * Close a file after dropping the ring's reference to it, so pipes can see
+ * the end of file.
+ */
+static inline void close_registered(Ring *ring, Requests *reqs, int idx,
+                                    int fd) {
+  if (reqs->use_registered_files) {
+    int no_fd = -1;
+    struct io_uring_files_update update = {
+        .offset = idx, .fds = (unsigned long)&no_fd,
+    };
+    io_uring_register(ring->fd, IORING_REGISTER_FILES_UPDATE, &update, 1);
+  }
+  close(fd);
+}
+
+static inline void register_buffers_and_files(Ring *ring, Requests *reqs,
+                                              Inputs *inputs, Outputs *outputs,
+                                              int num_buffers) {
+  reqs->registered_buffers = calloc(num_buffers, sizeof(struct iovec));
+  for (int i = 0; i < num_buffers; ++i) {
+    reqs->registered_buffers[i].iov_base = reqs->buffers[i].data;
+    reqs->registered_buffers[i].iov_len = reqs->buffers[i].capacity;
+  }
+  reqs->use_registered_buffers =
+      io_uring_register(ring->fd, IORING_REGISTER_BUFFERS,
+                        reqs->registered_buffers, num_buffers) == 0;
+  if (!reqs->use_registered_buffers)
+    DEBUG("io_uring: not using registered buffers: %s", strerror(errno));
+  int *fds = calloc(num_buffers, sizeof(int));
+  for (int i = 0; i < inputs->num_inputs; ++i) fds[i] = inputs->inputs[i].fd;
+  for (int i = 0; i < outputs->num_outputs; ++i)
+    fds[inputs->num_inputs + i] = outputs->outputs[i].fd;
+  reqs->use_registered_files =
+      io_uring_register(ring->fd, IORING_REGISTER_FILES, fds, num_buffers) ==
+      0;
+  if (!reqs->use_registered_files)
+    DEBUG("io_uring: not using registered files: %s", strerror(errno));
+  free(fds);
+}
+
+/**
+ * Drop the ring's references to the files left open, so outputs that are
+ * pipes read within the process can see the end of file once closed.
+ */
+static inline void unregister_files(Ring *ring, Requests *reqs) {
+  if (reqs->use_registered_files)
+    io_uring_register(ring->fd, IORING_UNREGISTER_FILES, NULL, 0);
+}
+
+/**
+ * Make room in an input's buffer that is full of an incomplete record,
+ * following MEMORY_POLICY when it can't grow, and returning whether more can
+ * be read into it.
+ */
+static inline bool make_room_for_record(Ring *ring, Requests *reqs,
+                                        Inputs *inputs, Input *input,
+                                        int idx) {
+  DEBUG("%s: doubling buffer size to %d bytes", input->name,
+        input->buffer->capacity * 2);
+  switch (grow_buffer_for_record(input->buffer, false)) {
+    case 0:
+      return true;
+    case MEMORY_POLICY_EMIT:
+      SET(input, buffered, 1);
+      return false;
+    case MEMORY_POLICY_FAIL:
+      fprintf(stderr, "%s: record exceeds MKMIMO_MAX_MEMORY, closing input\n",
+              input->name);
+      close_registered(ring, reqs, idx, input->fd);
+      clear_buffer(input->buffer);
+      SET(input, closed, 1);
+      return false;
+    default:
+      return false;
+  }
+}
+
+static inline void complete_read(Ring *ring, Requests *reqs, Inputs *inputs,
+                                 Input *input, int idx, int res) {
+  Buffer *buf = input->buffer;
+  COUNT_READ(res);
+  COUNT_CALL(input, res, -res);
+  if (res < 0) {
+    // retry reads that were interrupted
+    if (res == -EINTR || res == -EAGAIN) return;
+    errno = -res;
+    perrorf("read %s", input->name);
+    DEBUG("%s: input closed due to error", input->name);
+    close_registered(ring, reqs, idx, input->fd);
+    SET(input, closed, 1);
+  } else if (res == 0) {
+    DEBUG("%s: input closed", input->name);
+    close_registered(ring, reqs, idx, input->fd);
+    SET(input, closed, 1);
+  } else {
+    DEBUG("%s: %d bytes read", input->name, res);
+    int scan_end_of_record_down_to = buf->begin + buf->size;
+    buf->size += res;
+    STAMP_READ(buf);
+    find_end_of_last_record(buf, scan_end_of_record_down_to);
+    DEBUG("%s: record ends at %d", input->name, buf->end_of_last_record);
+    if (buf->end_of_last_record > -1) {
+      SET(input, buffered, 1);
+    } else if (buf->size == buf->capacity) {
+      // enlarge the buffer so a record larger than it can be read
+      make_room_for_record(ring, reqs, inputs, input, idx);
+    }
+  }
+}
+
+static inline void complete_write(Ring *ring, Requests *reqs, Outputs *outputs,
+                                  Output *output, int idx, int res) {
+  Buffer *buf = output->buffer;
+  COUNT_WRITE(res);
+  COUNT_CALL(output, res, -res);
+  if (res < 0) {
+    if (res == -EINTR || res == -EAGAIN) return;
+    errno = -res;
+    perrorf("write %s", output->name);
+    DEBUG("%s: output closed due to error", output->name);
+    close_registered(ring, reqs, idx, output->fd);
+    SET(output, closed, 1);
+    // the output stays busy until another one takes the records left
+    route_bytes(output, -buf->size);
+    if (fail_over_buffer(output, buf) == 0) SET(output, busy, 0);
+  } else {
+    DEBUG("%s: wrote %d bytes", output->name, res);
+    buf->begin += res;
+    buf->size -= res;
+    route_bytes(output, -res);
+    if (buf->size == 0) {
+      finish_draining(output);
+      RECORD_WRITTEN(output, buf);
+      SET(output, busy, 0);
+    }
+  }
+}
+
+/**
+ * Queue a read for every input that needs more data, and a write for every
+ * output holding records.
+ */
+static inline void queue_requests(Ring *ring, Requests *reqs, Inputs *inputs,
+                                  Outputs *outputs) {
+  for (int i = 0; i < inputs->num_inputs; ++i) {
+    Input *input = &inputs->inputs[i];
+    // inputs holding records wait until their buffers are exchanged
+    if (input->is_closed || input->is_buffered || reqs->is_in_flight[i])
+      continue;
+    Buffer *buf = input->buffer;
+    // a buffer full of an incomplete record can only be read into once it
+    // grows, which the memory budget may not allow yet
+    if (buf->size == buf->capacity &&
+        !make_room_for_record(ring, reqs, inputs, input, i))
+      continue;
+    prepare_request(ring, reqs, IORING_OP_READ, i, input->fd, buf,
+                    buf->data + buf->begin + buf->size,
+                    buf->capacity - buf->size);
+  }
+  for (int i = 0; i < outputs->num_outputs; ++i) {
+    Output *output = &outputs->outputs[i];
+    int idx = inputs->num_inputs + i;
+    if (output->is_closed || !output->is_busy || reqs->is_in_flight[idx])
+      continue;
+    Buffer *buf = output->buffer;
+    prepare_request(ring, reqs, IORING_OP_WRITE, idx, output->fd, buf,
+                    buf->data + buf->begin, buf->size);
+  }
+}
+
+/**
+ * Submit all queued requests at once, wait for at least one to complete, then
+ * reflect every completion to the inputs and outputs.
+ */
+static inline int submit_and_complete_requests(Ring *ring, Requests *reqs,
+                                               Inputs *inputs,
+                                               Outputs *outputs) {
+  DEBUG("io_uring: submitting %d requests, %d in flight", ring->num_unsubmitted,
+        reqs->num_in_flight);
+  if (io_uring_enter(ring->fd, ring->num_unsubmitted, 1,
+                     IORING_ENTER_GETEVENTS) < 0) {
+    if (errno != EINTR) {
+      perror("io_uring_enter");
+      return -1;
+    }
+  } else {
+    ring->num_unsubmitted = 0;
+  }
+  int num_completed = 0;
+  unsigned head = *ring->cq_head;
+  unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; ++head, ++num_completed) {
+    struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    int idx = cqe->user_data;
+    reqs->is_in_flight[idx] = false;
+    --reqs->num_in_flight;
+    if (idx < inputs->num_inputs)
+      complete_read(ring, reqs, inputs, &inputs->inputs[idx], idx, cqe->res);
+    else
+      complete_write(ring, reqs, outputs,
+                     &outputs->outputs[idx - inputs->num_inputs], idx,
+                     cqe->res);
+  }
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  return num_completed;
+}
+
+/**
+ * io_uring(7) implementation of mkmimo, where reads into the input buffers
+ * and writes from the exchanged output buffers are submitted in batches.
+ */
+int mkmimo_io_uring(Inputs *inputs, Outputs *outputs) {
+  int num_ios = inputs->num_inputs + outputs->num_outputs;
+  Ring ring;
+  if (init_ring(&ring, num_ios) < 0) {
+    fprintf(stderr, "mkmimo: io_uring unavailable (%s), falling back to %s\n",
+            strerror(errno), "epoll");
+    return mkmimo_epoll(inputs, outputs);
+  }
+
+  // every input and output holds one buffer, which is registered by its index
+  Requests reqs = {0};
+  reqs.buffers = new_buffers(num_ios);
+  if (reqs.buffers == NULL) return 1;
+  for (int i = 0; i < inputs->num_inputs; ++i)
+    inputs->inputs[i].buffer = &reqs.buffers[i];
+  for (int i = 0; i < outputs->num_outputs; ++i)
+    outputs->outputs[i].buffer = &reqs.buffers[inputs->num_inputs + i];
+  reqs.is_in_flight = calloc(num_ios, sizeof(bool));
+  register_buffers_and_files(&ring, &reqs, inputs, outputs, num_ios);
+
+  while (records_may_flow_between(inputs, outputs)) {
+    queue_requests(&ring, &reqs, inputs, outputs);
+    if (reqs.num_in_flight == 0) {
+      DEBUG("%s", "io_uring: no request can make progress");
+      // which can only be inputs waiting for memory that'll never be released
+      if (inputs->num_closed < inputs->num_inputs) {
+        fprintf(stderr, "mkmimo: records exceed MKMIMO_MAX_MEMORY\n");
+        unregister_files(&ring, &reqs);
+        free_ring(&ring);
+        return 1;
+      }
+      break;
+    }
+    if (submit_and_complete_requests(&ring, &reqs, inputs, outputs) < 0) {
+      unregister_files(&ring, &reqs);
+      free_ring(&ring);
+      return 1;
+    }
+    // exchange buffers only once no request is in flight for them, giving
+    // the records closed outputs left to idle ones first
+    if (outputs->num_closed > 0) reroute_records_of_closed_outputs(outputs);
+    while (exchange_buffered_records(inputs, outputs) > 0) continue;
+    DEBUG("%s", "----------------------------------------");
+  }
+  drop_records_left(inputs, outputs);
+  unregister_files(&ring, &reqs);
+  free_ring(&ring);
+
+  return outputs->num_closed < outputs->num_outputs ? 0 : 1;
+}
+
+#else /* !HAVE_IO_URING */
+
+int mkmimo_io_uring(Inputs *inputs, Outputs *outputs) {
+  fprintf(stderr, "mkmimo: io_uring unavailable, falling back to %s\n",
+          "nonblocking");
+  return mkmimo_nonblocking(inputs, outputs);
+}
+
+#endif /* HAVE_IO_URING */
@@ -0,0 +1,8 @@
+#ifndef MKMIMO_IO_URING_H
+#define MKMIMO_IO_URING_H
+
+#include "mkmimo.h"
+
+int mkmimo_io_uring(Inputs *inputs, Outputs *outputs);
+
+#endif /* MKMIMO_IO_URING_H */
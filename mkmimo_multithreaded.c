@@ -1,17 +1,58 @@
+#ifdef __linux__
+#define _GNU_SOURCE  // for sched_getcpu(3)
+#endif
+
 #include "mkmimo_multithreaded.h"
-#include "queue.h"
+#include "adapt.h"
+#include "io.h"
+#include "latency.h"
+#include "merge.h"
+#include "partition.h"
+#include "ring.h"
+#include "routing.h"
+#include "sequence.h"
+#include "splice.h"
+#include "stats.h"
+#include <limits.h>
 #include <pthread.h>
+#include <sched.h>
 
 /**
  * Parameters
  */
 static int MULTIBUFFERING = DEFAULT_MULTIBUFFERING;
+static int GATHER_BUFFERS = DEFAULT_GATHER_BUFFERS;
+static int GATHER_BYTES = DEFAULT_GATHER_BYTES;
+static int SCATTER_BUFFERS = DEFAULT_SCATTER_BUFFERS;
+static int READ_AHEAD = DEFAULT_READ_AHEAD;
 
 /**
-  * Buffer pools
+  * Buffer pools, where filled buffers are queued locally to each output
   */
-static Queue *full_buffers;
-static Queue *empty_buffers;
+static Ring **full_buffers;
+static Ring *empty_buffers;
+// signaled whenever a filled buffer is queued to any output
+static Event has_full_buffers;
+// signaled whenever an output is done with buffers broadcast to it
+static Event has_caught_up;
+// filled buffers of every input in order while merging or reordering, which
+// bound how far each can read ahead of the others
+static Ring **buffers_read_ahead;
+
+static inline bool is_reading_ahead(void) {
+  return is_merging() || is_reordering();
+}
+
+/**
+  * The inputs
+  */
+static Inputs *all_inputs;
+
+/**
+  * The outputs, and the CPU each output thread last ran on
+  */
+static Outputs *all_outputs;
+static int *output_cpus;
 
 /**
   * Flags
@@ -20,6 +61,10 @@ static bool data_is_flowing_in = true;
 static bool data_should_flow_in = true;
 static bool data_should_flow_out = true;
 static bool something_went_wrong = false;
+// outputs still open, and the threads stop once none is left
+static int num_open_outputs;
+// outputs holding filled buffers, which may still fail over to the others
+static int num_outputs_writing;
 
 /**
   * Stop all threads upon error.
@@ -28,35 +73,361 @@ static inline void teardown_all_threads_due_to_error(void) {
   // XXX this tears down all input threads
   data_should_flow_in = false;
   // XXX this tears down all output threads
-  data_should_flow_out = false;
+  __atomic_store_n(&data_should_flow_out, false, __ATOMIC_SEQ_CST);
+  notify_event(&has_full_buffers, INT_MAX);
+  // along with the inputs waiting for a lagging output while broadcasting
+  notify_event(&has_caught_up, INT_MAX);
   // escalate error to exit status
   something_went_wrong = true;
 }
 
+static inline int current_cpu(void) {
+#ifdef __linux__
+  return sched_getcpu();
+#else
+  return -1;
+#endif
+}
+
 /**
- * Find the last record separator in a full buffer.
- */
-static inline void find_record_separator(Buffer *buf,
-                                         int scan_end_of_record_down_to) {
-  for (int j = buf->begin + buf->size - 1; j >= scan_end_of_record_down_to;
-       --j) {
-    char c = ((char *)buf->data)[j];
-    if (c == '\n') {
-      buf->end_of_last_record = j;
-      break;
+  * Queue a filled buffer to the given output.
+  */
+static inline void queue_full_buffer(Buffer *buf, int target) {
+  buf->records_begin = buf->begin;
+  route_bytes(&all_outputs->outputs[target], buf->size);
+  ring_push(full_buffers[target], buf);
+  // no one else may take it while partitioning or broadcasting, so everyone
+  // has to check
+  notify_event(&has_full_buffers,
+               is_partitioning() || is_broadcasting() ? INT_MAX : 1);
+}
+
+/**
+  * Queue a filled buffer to an output thread running on the same CPU, so it's
+  * likely written while still in the cache, or otherwise to the next open
+  * output in turn, unless another ROUTING is chosen.
+  */
+static inline void submit_full_buffer(Buffer *buf, int *next_output) {
+  int num_outputs = all_outputs->num_outputs;
+  int target = -1;
+  if (ROUTING != ROUTING_ROUND_ROBIN) {
+    target = choose_output(all_outputs, next_output, false);
+  } else {
+    int cpu = current_cpu();
+    for (int n = 0; n < num_outputs; ++n) {
+      int i = (*next_output + n) % num_outputs;
+      if (all_outputs->outputs[i].is_closed) continue;
+      if (target < 0) target = i;
+      if (cpu < 0) break;
+      if (__atomic_load_n(&output_cpus[i], __ATOMIC_RELAXED) == cpu) {
+        target = i;
+        break;
+      }
     }
   }
+  // some output must take it even if all are closed, and every local queue
+  // can hold all buffers, so this never blocks
+  if (target < 0) target = *next_output;
+  *next_output = (target + 1) % num_outputs;
+  queue_full_buffer(buf, target);
+}
+
+/**
+  * Take a filled buffer from the output's own queue, or steal one from the
+  * others starting at a different peer each time, except from open outputs
+  * while partitioning, whose records must go to them, and from anyone while
+  * broadcasting, where every output takes its own.
+  */
+static inline Buffer *take_or_steal_full_buffer(int self, int *next_victim) {
+  void *buf;
+  if (ring_try_pop(full_buffers[self], &buf)) return buf;
+  if (is_broadcasting()) return NULL;
+  int num_outputs = all_outputs->num_outputs;
+  // every peer is tried, as the queue of a closed output must be emptied
+  for (int n = 0; n < num_outputs - 1; ++n) {
+    int i = (self + 1 + (*next_victim + n) % (num_outputs - 1)) % num_outputs;
+    if (is_partitioning() &&
+        !__atomic_load_n(&all_outputs->outputs[i].is_closed, __ATOMIC_SEQ_CST))
+      continue;
+    if (ring_try_pop(full_buffers[i], &buf)) {
+      *next_victim = (*next_victim + 1) % (num_outputs - 1);
+      route_bytes(&all_outputs->outputs[i], -((Buffer *)buf)->size);
+      route_bytes(&all_outputs->outputs[self], ((Buffer *)buf)->size);
+      return buf;
+    }
+  }
+  return NULL;
+}
+
+/**
+  * Gather more filled buffers already queued to the output after the first
+  * one, up to GATHER_BUFFERS or GATHER_BYTES in total, so they can be written
+  * with a single call.  Returns the number of buffers gathered.
+  */
+static inline int gather_full_buffers(int self, Buffer **bufs) {
+  int num_bufs = 1;
+  int num_bytes = bufs[0]->size;
+  void *buf;
+  while (num_bufs < GATHER_BUFFERS && num_bytes < GATHER_BYTES &&
+         ring_try_pop(full_buffers[self], &buf)) {
+    bufs[num_bufs++] = buf;
+    num_bytes += ((Buffer *)buf)->size;
+  }
+  return num_bufs;
+}
+
+/**
+  * Let the outputs waiting for the last buffers know once none is held by
+  * another output that could still fail over to them.
+  */
+static inline void finish_writing(void) {
+  if (__atomic_sub_fetch(&num_outputs_writing, 1, __ATOMIC_SEQ_CST) == 0 &&
+      !__atomic_load_n(&data_is_flowing_in, __ATOMIC_SEQ_CST))
+    notify_event(&has_full_buffers, INT_MAX);
+}
+
+/**
+  * Take a filled buffer for the output, counting it as writing already while
+  * looking, so no one finds the queues empty and stops in the meantime.
+  */
+static inline Buffer *start_writing(int self, int *next_victim) {
+  __atomic_add_fetch(&num_outputs_writing, 1, __ATOMIC_SEQ_CST);
+  Buffer *buf = take_or_steal_full_buffer(self, next_victim);
+  if (buf == NULL) finish_writing();
+  return buf;
+}
+
+/**
+  * Wait until a filled buffer is available to the output, or return NULL when
+  * no more will come.
+  */
+static Buffer *wait_for_full_buffer(int self, int *next_victim) {
+  for (;;) {
+    __atomic_store_n(&output_cpus[self], current_cpu(), __ATOMIC_RELAXED);
+    Buffer *buf = start_writing(self, next_victim);
+    if (buf != NULL) return buf;
+    unsigned seq;
+    prepare_to_wait(&has_full_buffers, &seq);
+    buf = start_writing(self, next_victim);
+    if (buf != NULL ||
+        (!__atomic_load_n(&data_is_flowing_in, __ATOMIC_SEQ_CST) &&
+         __atomic_load_n(&num_outputs_writing, __ATOMIC_SEQ_CST) == 0) ||
+        !__atomic_load_n(&data_should_flow_out, __ATOMIC_SEQ_CST)) {
+      cancel_wait(&has_full_buffers);
+      return buf;
+    }
+    wait_for_event(&has_full_buffers, seq);
+  }
 }
 
 /**
   * Grab a buffer from the empty pool and clear it for fresh data.
   */
 static inline Buffer *grab_empty_buffer(void) {
-  Buffer *buf = dequeue_or_wait(empty_buffers);
+  Buffer *buf = ring_pop(empty_buffers);
   clear_buffer(buf);
   return buf;
 }
 
+/**
+  * Claim up to the given number of empty buffers without waiting, leaving
+  * room in front of each for the partial record to be continued from the
+  * buffer before it.  Returns the number of buffers claimed.
+  */
+static inline int claim_empty_buffers(Buffer **bufs, int max_bufs) {
+  int num_bufs = 0;
+  void *buf;
+  while (num_bufs < max_bufs && ring_try_pop(empty_buffers, &buf)) {
+    clear_buffer(buf);
+    ((Buffer *)buf)->begin = BLOCKSIZE / 8;
+    bufs[num_bufs++] = buf;
+  }
+  return num_bufs;
+}
+
+/**
+  * Return a buffer done with back to the empty pool, along with the buffer
+  * whose memory it shared once no one else refers to it.
+  */
+static inline void recycle_buffer(Buffer *buf) {
+  Buffer *reusable[2];
+  int num_reusable = release_buffer(buf, reusable);
+  for (int i = 0; i < num_reusable; ++i) ring_push(empty_buffers, reusable[i]);
+}
+
+static inline int num_buffers_lagging(int i) {
+  return __atomic_load_n(&all_outputs->outputs[i].num_buffers_lagging,
+                         __ATOMIC_SEQ_CST);
+}
+
+/**
+  * Count buffers broadcast to the output as written, or skipped, letting the
+  * inputs waiting for it to catch up know.
+  */
+static inline void catch_up(Output *output, int num_bufs) {
+  __atomic_sub_fetch(&output->num_buffers_lagging, num_bufs, __ATOMIC_SEQ_CST);
+  notify_event(&has_caught_up, INT_MAX);
+}
+
+/**
+  * Find the open output with the fewest buffers left to write, or -1 if none
+  * is open.
+  */
+static inline int find_leading_output(void) {
+  int leader = -1;
+  for (int i = 0; i < all_outputs->num_outputs; ++i) {
+    if (__atomic_load_n(&all_outputs->outputs[i].is_closed, __ATOMIC_SEQ_CST))
+      continue;
+    if (leader < 0 || num_buffers_lagging(i) < num_buffers_lagging(leader))
+      leader = i;
+  }
+  return leader;
+}
+
+/**
+  * Wait until fewer than BROADCAST_LAG buffers broadcast to the given output,
+  * or to whichever leads the others if it's negative, are left to write, or
+  * it's closed, or no more can be written.  Returns the output waited for.
+  */
+static int wait_for_output_to_catch_up(int i) {
+  for (;;) {
+    unsigned seq;
+    prepare_to_wait(&has_caught_up, &seq);
+    int j = i >= 0 ? i : find_leading_output();
+    if (j < 0 || num_buffers_lagging(j) < BROADCAST_LAG ||
+        __atomic_load_n(&all_outputs->outputs[j].is_closed, __ATOMIC_SEQ_CST) ||
+        !__atomic_load_n(&data_should_flow_out, __ATOMIC_SEQ_CST)) {
+      cancel_wait(&has_caught_up);
+      return j;
+    }
+    DEBUG("%s: waiting to catch up with the broadcast",
+          all_outputs->outputs[j].name);
+    wait_for_event(&has_caught_up, seq);
+  }
+}
+
+/**
+  * Queue the records in a filled buffer to every open output, sharing its
+  * memory instead of copying it.  An output with BROADCAST_LAG buffers left to
+  * write is waited for, unless BROADCAST_POLICY=drop, where only the one ahead
+  * of all others is, setting the pace for reading, and any that has as many
+  * more left than it is skipped, counting the records it misses.
+  */
+static void broadcast_full_buffer(Buffer *buf) {
+  int num_outputs = all_outputs->num_outputs;
+  int targets[num_outputs];
+  int num_targets = 0;
+  int leader = -1;
+  if (BROADCAST_POLICY == BROADCAST_POLICY_DROP)
+    leader = wait_for_output_to_catch_up(-1);
+  for (int i = 0; i < num_outputs; ++i) {
+    Output *output = &all_outputs->outputs[i];
+    if (BROADCAST_POLICY == BROADCAST_POLICY_BLOCK)
+      wait_for_output_to_catch_up(i);
+    if (__atomic_load_n(&output->is_closed, __ATOMIC_SEQ_CST)) continue;
+    if (BROADCAST_POLICY == BROADCAST_POLICY_DROP && leader >= 0 &&
+        num_buffers_lagging(i) - num_buffers_lagging(leader) >=
+            BROADCAST_LAG) {
+      DEBUG("%s: skipping the buffer %p while lagging behind", output->name,
+            buf);
+      skip_records(output, buf);
+      continue;
+    }
+    targets[num_targets++] = i;
+  }
+  if (num_targets == 0) {
+    // no output is left to take the records, unless all were skipped
+    if (__atomic_load_n(&num_open_outputs, __ATOMIC_SEQ_CST) == 0)
+      drop_records(buf);
+    recycle_buffer(buf);
+    return;
+  }
+  // every output gets its own view of the data, all taken before any is
+  // queued, as the memory could be reused once the first one is written
+  Buffer *views[num_targets];
+  views[0] = buf;
+  for (int k = 1; k < num_targets; ++k) {
+    views[k] = grab_empty_buffer();
+    share_buffer(views[k], buf);
+  }
+  for (int k = 0; k < num_targets; ++k) {
+    __atomic_add_fetch(&all_outputs->outputs[targets[k]].num_buffers_lagging, 1,
+                       __ATOMIC_SEQ_CST);
+    queue_full_buffer(views[k], targets[k]);
+  }
+}
+
+/**
+  * Copy a record to the staging buffer of the given output, queueing it first
+  * if it can't take more.
+  */
+static inline void stage_record(Buffer **staged, int i, const char *record,
+                                int len, long long read_ns) {
+  if (staged[i] != NULL && staged[i]->size + len > staged[i]->capacity) {
+    queue_full_buffer(staged[i], i);
+    staged[i] = NULL;
+  }
+  if (staged[i] == NULL) staged[i] = grab_empty_buffer();
+  STAMP_READ_AS(staged[i], read_ns);
+  append_to_buffer(staged[i], record, len);
+}
+
+/**
+  * Copy every record in a filled buffer to the staging buffer of the output its
+  * key hashes to, queueing ones that can't take more to their outputs, and
+  * return the filled buffer to the pool.
+  */
+static void partition_full_buffer(Buffer *buf, Buffer **staged) {
+  int ends[MAX_RECORDS_PARTITIONED_AT_ONCE];
+  int partitions[MAX_RECORDS_PARTITIONED_AT_ONCE];
+  int records_end = buf->begin + buf->size;
+  for (int begin = buf->begin; begin < records_end;) {
+    int num_records =
+        partition_records(buf->data, begin, records_end,
+                          all_outputs->num_outputs, ends, partitions);
+    for (int k = 0; k < num_records; begin = ends[k++])
+      stage_record(staged, partitions[k], buf->data + begin, ends[k] - begin,
+                   buf->read_ns);
+  }
+  recycle_buffer(buf);
+}
+
+/**
+  * Queue every staging buffer holding records to its output.
+  */
+static inline void flush_staged_buffers(Buffer **staged) {
+  for (int i = 0; i < all_outputs->num_outputs; ++i) {
+    if (staged[i] == NULL) continue;
+    queue_full_buffer(staged[i], i);
+    staged[i] = NULL;
+  }
+}
+
+/**
+  * Submit the records in a filled buffer to an output, or stage them for the
+  * outputs their keys hash to while partitioning, or to every output while
+  * broadcasting, or pass them on to be merged or put in order with the other
+  * inputs'.
+  */
+static inline void submit_records(Input *input, Buffer *buf, int *next_output,
+                                  Buffer **staged) {
+  COUNT_BUFFER(input, buf);
+  if (is_reading_ahead()) {
+    if (buf->size > 0) {
+      ring_push(buffers_read_ahead[input - all_inputs->inputs], buf);
+    } else {
+      recycle_buffer(buf);
+    }
+  } else if (staged != NULL) {
+    partition_full_buffer(buf, staged);
+  } else if (is_broadcasting()) {
+    broadcast_full_buffer(buf);
+  } else {
+    if (is_sequencing()) number_chunk(buf);
+    submit_full_buffer(buf, next_output);
+  }
+}
+
 /**
  * Function executed by the input threads. Grabs an empty buffer from
  * the empty buffers queue, fills it, and adds it to the full buffers
@@ -64,6 +435,14 @@ static inline Buffer *grab_empty_buffer(void) {
  */
 static void *read_buffers_from_input(void *arg) {
   Input *input = arg;
+  int next_output = 0;
+  Buffer *bufs[SCATTER_BUFFERS];
+  bool is_input_fast = false;
+  // records are staged for each output in batches while partitioning, unless
+  // they're merged first
+  Buffer **staged = is_partitioning() && !is_reading_ahead()
+                        ? calloc(all_outputs->num_outputs, sizeof(Buffer *))
+                        : NULL;
 
   input->buffer = grab_empty_buffer();
   DEBUG("%s: grabbed an empty buffer %p", input->name, input->buffer);
@@ -72,12 +451,50 @@ static void *read_buffers_from_input(void *arg) {
     Buffer *buf = input->buffer;
     int scan_end_of_record_down_to = buf->end_of_last_record + 1;
     for (;;) {
-      int num_bytes_readable = buf->capacity - buf->size;
-      DEBUG("%s: can read %d bytes", input->name, num_bytes_readable);
+      // Read into more empty buffers at once while the input fills up all
+      // it's given, after making room for as much as it tends to give, unless
+      // memory is bounded, as a record continued across the buffers would
+      // have to grow them past the budget
+      if (make_room_for_block(buf, input->block_size) < 0)
+        reset_input_block_size(input);
+      bufs[0] = buf;
+      int num_bufs = 1;
+      if (is_input_fast && MKMIMO_MAX_MEMORY == 0)
+        num_bufs += claim_empty_buffers(&bufs[1], SCATTER_BUFFERS - 1);
+      DEBUG("%s: can read %d bytes into %d buffers", input->name,
+            buf->capacity - buf->begin - buf->size, num_bufs);
 
-      int num_bytes_read = read(input->fd, buf->data + buf->begin + buf->size,
-                                num_bytes_readable);
+      COUNT_BLOCKING(input);
+      int num_bytes_read = read_buffers(input->fd, bufs, num_bufs);
+      COUNT_CALL(input, num_bytes_read, errno);
+      if (LATENCY_REPORT && num_bytes_read > 0)
+        for (int i = 0; i < num_bufs; ++i)
+          if (bufs[i]->size > 0) STAMP_READ(bufs[i]);
       DEBUG("%s: %d bytes read", input->name, num_bytes_read);
+      adapt_input_block_size(input, num_bytes_read);
+      Buffer *last = bufs[num_bufs - 1];
+      is_input_fast = last->begin + last->size == last->capacity;
+
+      // Split the bytes that spilled over to the claimed buffers at record
+      // boundaries, submitting complete records and continuing the partial
+      // one in the next buffer
+      for (int i = 1; i < num_bufs; ++i) {
+        Buffer *next = bufs[i];
+        if (next->size == 0) {
+          ring_push(empty_buffers, next);
+          continue;
+        }
+        find_end_of_last_record(buf, scan_end_of_record_down_to);
+        int num_bytes_continued = move_trailing_data_in_front(next, buf);
+        if (buf->size > 0) {
+          DEBUG("%s: submitting the filled buffer %p", input->name, buf);
+          submit_records(input, buf, &next_output, staged);
+        } else {
+          recycle_buffer(buf);
+        }
+        buf = input->buffer = next;
+        scan_end_of_record_down_to = buf->begin + num_bytes_continued;
+      }
 
       if (num_bytes_read < 0) {
         // Close input upon errors
@@ -94,13 +511,9 @@ static void *read_buffers_from_input(void *arg) {
         close(input->fd);
         input->is_closed = 1;
         break;
-
-      } else {
-        // Normal read
-        buf->size += num_bytes_read;
       }
 
-      find_record_separator(buf, scan_end_of_record_down_to);
+      find_end_of_last_record(buf, scan_end_of_record_down_to);
       DEBUG("%s: record ends at %d", input->name, buf->end_of_last_record);
 
       // Stop reading if at least one complete record has been read into the
@@ -108,12 +521,35 @@ static void *read_buffers_from_input(void *arg) {
       if (buf->end_of_last_record > -1) {
         break;
 
-      } else if (buf->size == buf->capacity) {
+      } else if (buf->begin + buf->size == buf->capacity &&
+                 buf->owner != buf) {
+        // Move the record to the buffer's own memory once it runs out of the
+        // memory shared with the buffers handed off before
+        DEBUG("%s: moving %d bytes to own memory", input->name, buf->size);
+        Buffer *owner = unshare_buffer(buf);
+        if (owner != NULL) ring_push(empty_buffers, owner);
+        scan_end_of_record_down_to = buf->begin + buf->size;
+
+      } else if (buf->begin + buf->size == buf->capacity) {
         // Enlarge the buffer so a record that is larger than the current
-        // buffer capacity can be read
+        // buffer capacity can be read, waiting for memory to be released if
+        // it would exceed the budget
         DEBUG("%s: doubling buffer size to %d bytes", input->name,
               buf->capacity * 2);
-        enlarge_buffer(buf, buf->capacity * 2);
+        int policy = grow_buffer_for_record(buf, true);
+        if (policy == MEMORY_POLICY_EMIT) {
+          DEBUG("%s: emitting %d bytes of an oversized record", input->name,
+                buf->size);
+          break;
+        } else if (policy == MEMORY_POLICY_FAIL) {
+          fprintf(stderr,
+                  "%s: record exceeds MKMIMO_MAX_MEMORY, closing input\n",
+                  input->name);
+          close(input->fd);
+          input->is_closed = 1;
+          clear_buffer(buf);
+          break;
+        }
 
         // Bound the next scan for end-of-record separator
         scan_end_of_record_down_to = buf->begin + buf->size;
@@ -127,11 +563,12 @@ static void *read_buffers_from_input(void *arg) {
       // and exit the loop since no more can be read
       DEBUG("%s: submitting the last filled buffer %p", input->name,
             input->buffer);
-      queue_and_signal(full_buffers, input->buffer);
+      submit_records(input, input->buffer, &next_output, staged);
       break;
     } else if (input->buffer->size > 0) {
-      // Otherwise, keep only complete records in the buffer and move the
-      // trailing bytes to a new empty buffer
+      // Otherwise, keep only complete records in the buffer and continue the
+      // trailing bytes with a new empty buffer, which keeps reading into the
+      // same memory unless it's being spliced
       DEBUG("%s: grabbing next empty buffer", input->name);
       Buffer *overflow = grab_empty_buffer();
       DEBUG("%s: grabbed an empty buffer %p", input->name, overflow);
@@ -139,9 +576,14 @@ static void *read_buffers_from_input(void *arg) {
       // buffer
       DEBUG("%s: submitting after trimming the filled buffer %p", input->name,
             input->buffer);
-      move_trailing_data_after_last_record(overflow, input->buffer);
-      queue_and_signal(full_buffers, input->buffer);
+      if (ZEROCOPY)
+        move_trailing_data_after_last_record(overflow, input->buffer);
+      else
+        carry_over_trailing_data(overflow, input->buffer);
+      submit_records(input, input->buffer, &next_output, staged);
       input->buffer = overflow;
+      // hold staged records for larger batches only while more keep coming
+      if (staged != NULL && !is_input_fast) flush_staged_buffers(staged);
     } else {
       // XXX This should never happen, but it's harmless try to fill the buffer
       // again if it ever does
@@ -152,94 +594,342 @@ static void *read_buffers_from_input(void *arg) {
     }
   }
 
+  if (staged != NULL) {
+    flush_staged_buffers(staged);
+    free(staged);
+  }
+  // let the merge or reorder know no more records will come
+  if (is_reading_ahead())
+    ring_push(buffers_read_ahead[input - all_inputs->inputs], NULL);
   DEBUG("%s: stops input thread", input->name);
   return NULL;
 }
 
 /**
- * Function executed by the output threads. Reads a filled buffer produced by
- * input threads,
- * writes it, and adds the
- * buffer back into the empty buffer queue.
+  * Take the next filled buffer an input read ahead, queueing the records
+  * merged or put in order so far first if it has to wait, so they aren't held
+  * back while the input catches up.  Returns NULL once the input is exhausted.
+  */
+static inline Buffer *take_buffer_read_ahead(int i, Buffer **staged) {
+  void *buf;
+  if (ring_try_pop(buffers_read_ahead[i], &buf)) return buf;
+  flush_staged_buffers(staged);
+  return ring_pop(buffers_read_ahead[i]);
+}
+
+/**
+  * Drop the records left in every input read ahead once no output can take
+  * them, or they can't be put in order, so the input threads never wait for
+  * room.
+  */
+static void drop_records_read_ahead(MergeCursor *cursors, int num_cursors,
+                                    Buffer **staged) {
+  for (int i = 0; i < num_cursors; ++i) {
+    MergeCursor *cursor = &cursors[i];
+    if (cursor->is_exhausted) continue;
+    if (cursor->buf != NULL) {
+      cursor->buf->size -= cursor->begin - cursor->buf->begin;
+      cursor->buf->begin = cursor->begin;
+    } else {
+      cursor->buf = take_buffer_read_ahead(i, staged);
+    }
+    for (; cursor->buf != NULL;
+         cursor->buf = take_buffer_read_ahead(i, staged)) {
+      drop_records(cursor->buf);
+      recycle_buffer(cursor->buf);
+    }
+    cursor->is_exhausted = true;
+  }
+}
+
+/**
+ * Function executed by the thread merging sorted inputs. Takes the first
+ * record among the heads of the inputs' filled buffers one after another with
+ * a loser tree, copying them in order to the staging buffer of the output, or
+ * the outputs their keys hash to while partitioning.
+ */
+static void *merge_sorted_inputs(void *arg) {
+  int num_outputs = all_outputs->num_outputs;
+  Buffer **staged = calloc(num_outputs, sizeof(Buffer *));
+  Merger *merger = new_merger(all_inputs->num_inputs);
+  for (int i = 0; i < merger->num_cursors; ++i)
+    set_cursor_buffer(&merger->cursors[i], take_buffer_read_ahead(i, staged));
+  for (int i = start_merge(merger); merger->cursors[i].buf != NULL;
+       i = replay_merge(merger)) {
+    if (!__atomic_load_n(&data_should_flow_out, __ATOMIC_SEQ_CST)) {
+      drop_records_read_ahead(merger->cursors, merger->num_cursors, staged);
+      break;
+    }
+    MergeCursor *cursor = &merger->cursors[i];
+    const char *data = cursor->buf->data;
+    int target = is_partitioning() ? partition_of_record(data, cursor->begin,
+                                                         cursor->end,
+                                                         num_outputs)
+                                   : 0;
+    stage_record(staged, target, data + cursor->begin,
+                 cursor->end - cursor->begin, cursor->buf->read_ns);
+    if (!advance_cursor(cursor)) {
+      recycle_buffer(cursor->buf);
+      set_cursor_buffer(cursor, take_buffer_read_ahead(i, staged));
+    }
+  }
+  flush_staged_buffers(staged);
+  free(staged);
+  free_merger(merger);
+  DEBUG("%s", "stops merge thread");
+  return NULL;
+}
+
+/**
+  * Copy the records of the first chunk left in an input to the staging buffer
+  * of the output, or hold them aside if it isn't their turn yet, skipping the
+  * ones taken from another input it went to before.  Moves on once the chunk
+  * shows up for another input after this one ends before all its records.
+  * Returns -1 if the input ends before them otherwise.
+  */
+static inline int read_chunk_records(MergeCursor *cursors, Chunk *chunk,
+                                     bool is_due, Buffer **staged) {
+  int input = chunk->output;
+  MergeCursor *cursor = &cursors[input];
+  int num_records_skipped = chunk->num_records_taken;
+  pass_chunk(chunk, is_due);
+  for (int n = 0; n < chunk->num_records; ++n) {
+    if (cursor->buf == NULL) {
+      if (!cursor->is_exhausted)
+        set_cursor_buffer(cursor, take_buffer_read_ahead(input, staged));
+      if (cursor->buf == NULL) {
+        // the fan-out side sends the chunk whole to another output when the
+        // one it went to fails
+        flush_staged_buffers(staged);
+        int found = find_chunk_moved(chunk);
+        if (found > 0) return 0;
+        if (found == 0)
+          fprintf(stderr, "%s: chunk %ld has fewer than %d records\n",
+                  all_inputs->inputs[input].name, chunk->seq,
+                  chunk->num_records);
+        return -1;
+      }
+    }
+    const char *record = (char *)cursor->buf->data + cursor->begin;
+    int len = cursor->end - cursor->begin;
+    if (n < num_records_skipped) {
+      // taken already
+    } else if (is_due) {
+      stage_record(staged, 0, record, len, cursor->buf->read_ns);
+    } else if (!hold_record(chunk, record, len, false)) {
+      // let the outputs release what's staged for them while waiting
+      flush_staged_buffers(staged);
+      hold_record(chunk, record, len, true);
+    }
+    if (n >= num_records_skipped) ++chunk->num_records_taken;
+    if (!advance_cursor(cursor)) {
+      recycle_buffer(cursor->buf);
+      cursor->buf = NULL;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Function executed by the thread putting records back in order. Takes the
+ * chunks the fan-out side logged one after another by their numbers, copying
+ * as many records as each held from the input it went through to the staging
+ * buffer of the output, after holding aside the records of the chunks that
+ * came before it there but are due later.  An input's buffers are taken only
+ * when its records are, so it never waits on one whose records come later.
+ */
+static void *restore_order_of_inputs(void *arg) {
+  Buffer **staged = calloc(1, sizeof(Buffer *));
+  int num_inputs = all_inputs->num_inputs;
+  MergeCursor *cursors = calloc(num_inputs, sizeof(MergeCursor));
+  int status = open_reorder_file(num_inputs);
+  for (long seq = 0; status == 0; ++seq) {
+    Chunk *chunk;
+    int found = take_chunk(seq, &chunk);
+    if (found <= 0) {
+      status = found;
+      break;
+    }
+    if (!__atomic_load_n(&data_should_flow_out, __ATOMIC_SEQ_CST)) break;
+    for (int offset = 0; offset < chunk->num_bytes_held;) {
+      // copy the records in pieces no larger than a buffer
+      int len = chunk->num_bytes_held - offset;
+      if (len > BLOCKSIZE) len = BLOCKSIZE;
+      stage_record(staged, 0, chunk->held + offset, len, 0);
+      offset += len;
+    }
+    // take the records not held from the input it went through, or the one
+    // it was moved to
+    while (status == 0 && !chunk->is_passed) {
+      Chunk *first;
+      while (status == 0 && (first = first_chunk_of(chunk->output)) != NULL &&
+             first != chunk)
+        status = read_chunk_records(cursors, first, false, staged);
+      if (status == 0) status = read_chunk_records(cursors, chunk, true, staged);
+    }
+    release_chunk(chunk);
+  }
+  flush_staged_buffers(staged);
+  // records the log doesn't account for can't be put anywhere, except what was
+  // written to an output that failed before the chunks were moved elsewhere
+  for (int i = 0; i < num_inputs && status == 0 && data_should_flow_out; ++i) {
+    if (cursors[i].buf == NULL && !cursors[i].is_exhausted)
+      set_cursor_buffer(&cursors[i], take_buffer_read_ahead(i, staged));
+    if (cursors[i].buf != NULL && !had_chunks_moved_from(i)) {
+      fprintf(stderr, "%s: records left beyond the chunks in %s\n",
+              all_inputs->inputs[i].name, REORDER_FILE);
+      status = -1;
+    }
+  }
+  if (status < 0) something_went_wrong = true;
+  drop_records_read_ahead(cursors, num_inputs, staged);
+  free(staged);
+  free(cursors);
+  DEBUG("%s", "stops reorder thread");
+  return NULL;
+}
+
+/**
+ * Function executed by the output threads. Reads filled buffers produced by
+ * input threads, from its own queue or stolen from others, writes them
+ * together, and adds the buffers back into the empty buffer queue.
  */
 static void *write_buffers_to_output(void *arg) {
   Output *output = arg;
+  int self = output - all_outputs->outputs;
+  int next_victim = 0;
+  Buffer *bufs[GATHER_BUFFERS];
 
   while (data_should_flow_out) {
     // Grab a filled buffer
     DEBUG("%s: waiting for a filled buffer", output->name);
-    Buffer *buf = output->buffer = dequeue_or_wait(full_buffers);
-    DEBUG("%s: got a filled buffer %p, holding %d bytes", output->name, buf,
-          buf->size);
-
-    // Write all buffered data to the output
-    int num_bytes_writable = buf->size;
-    int buf_offset = 0;
-    while (num_bytes_writable > 0) {
-      int num_bytes_written = write(
-          output->fd, buf->data + buf->begin + buf_offset, num_bytes_writable);
-      DEBUG("%s: wrote %d bytes", output->name, num_bytes_written);
+    Buffer *buf = output->buffer = wait_for_full_buffer(self, &next_victim);
+    if (buf == NULL) {
+      // Stop if no data is flowing in and remains in the queues
+      DEBUG("%s: anticipates no more buffers to arrive", output->name);
+      break;
+    }
+    // along with others queued up behind it
+    bufs[0] = buf;
+    int num_bufs = gather_full_buffers(self, bufs);
+    DEBUG("%s: got %d filled buffers, the first %p holding %d bytes",
+          output->name, num_bufs, buf, buf->size);
+    if (output->is_closed) {
+      // records broadcast to a closed output are only let go
+      for (int i = 0; i < num_bufs; ++i) {
+        route_bytes(output, -bufs[i]->size);
+        skip_records(output, bufs[i]);
+        recycle_buffer(bufs[i]);
+      }
+      catch_up(output, num_bufs);
+      finish_writing();
+      continue;
+    }
+    long num_bytes_gathered = 0;
+    for (int i = 0; i < num_bufs; ++i) {
+      num_bytes_gathered += bufs[i]->size;
+      COUNT_BUFFER(output, bufs[i]);
+      STAMP_TAKEN(bufs[i]);
+    }
+    // tell the fan-in side where the chunks go before they can get there
+    if (is_sequencing())
+      for (int i = 0; i < num_bufs; ++i) log_chunk(bufs[i], self);
+    start_draining(output, num_bytes_gathered);
+
+    // Write all buffered data to the output, consuming the bytes written from
+    // the buffers in order
+    int num_bufs_written = 0;
+    for (;;) {
+      // Return the buffers written back to the pool
+      while (num_bufs_written < num_bufs &&
+             bufs[num_bufs_written]->size == 0) {
+        buf = bufs[num_bufs_written++];
+        RECORD_WRITTEN(output, buf);
+        recycle_buffer(buf);
+        DEBUG("%s: recycling the buffer %p", output->name, buf);
+      }
+      if (num_bufs_written == num_bufs) {
+        finish_draining(output);
+        break;
+      }
+
+      ssize_t num_bytes_written;
+      COUNT_BLOCKING(output);
+      if (output->spliced != NULL) {
+        buf = bufs[num_bufs_written];
+        num_bytes_written = splice_buffer(output->spliced, output->fd, buf,
+                                          buf->begin, buf->size);
+        COUNT_WRITE(num_bytes_written);
+        if (num_bytes_written > 0)
+          consume_buffers(&buf, 1, num_bytes_written);
+      } else {
+        num_bytes_written = write_buffers(
+            output->fd, &bufs[num_bufs_written], num_bufs - num_bufs_written);
+      }
+      COUNT_CALL(output, num_bytes_written, errno);
+      DEBUG("%s: wrote %zd bytes", output->name, num_bytes_written);
+      // a write cut short means the pipe filled up
+      if (output->spliced == NULL && num_bytes_written > 0 &&
+          bufs[num_bufs - 1]->size > 0)
+        adapt_output_pipe_capacity(output);
 
       if (num_bytes_written <= 0) {
         perrorf("write %s", output->name);
         DEBUG("%s: output closed due to error", output->name);
         close(output->fd);
-        output->is_closed = 1;
-        teardown_all_threads_due_to_error();
+        __atomic_store_n(&output->is_closed, 1, __ATOMIC_SEQ_CST);
+        // the others carry on with the records left, unless none is left
+        if (__atomic_sub_fetch(&num_open_outputs, 1, __ATOMIC_SEQ_CST) == 0)
+          teardown_all_threads_due_to_error();
         break;
       }
-
-      buf_offset += num_bytes_written;
-      num_bytes_writable -= num_bytes_written;
+      route_bytes(output, -num_bytes_written);
     }
 
-    if (num_bytes_writable == 0) {
-      // Return the buffer back to the pool and continue with the next available
-      // buffer
-      queue_and_signal(empty_buffers, buf);
-      DEBUG("%s: recycling the buffer %p", output->name, buf);
-    } else {
-      // Otherwise, the output was closed before everything in the buffer was
-      // written, so send the buffer back to filled pool, so someone else can
-      // handle it
+    // If the output was closed before everything in the buffers was written,
+    // send exactly the records it didn't write to another output, so someone
+    // else can handle them, or drop them if no output is left
+    for (int i = num_bufs_written; i < num_bufs; ++i) {
       DEBUG("%s: resubmitting the buffer %p since output closed prematurely",
-            output->name, buf);
-      queue_and_signal(full_buffers, buf);
-      // XXX This can inevitably create duplicate records
-      // TODO Allow user to choose whether to drop or retransmit such records
+            output->name, bufs[i]);
+      route_bytes(output, -bufs[i]->size);
+      // a numbered chunk is sent again whole, so the fan-in side can take it
+      // from the other output by the same number
+      if (is_sequencing()) {
+        bufs[i]->size += bufs[i]->begin - bufs[i]->records_begin;
+        bufs[i]->begin = bufs[i]->records_begin;
+      }
+      // the other outputs got records broadcast to them already
+      if (is_broadcasting() &&
+          __atomic_load_n(&num_open_outputs, __ATOMIC_SEQ_CST) > 0) {
+        skip_records(output, bufs[i]);
+        recycle_buffer(bufs[i]);
+        continue;
+      }
+      fail_over_buffer(output, bufs[i]);
+      if (__atomic_load_n(&num_open_outputs, __ATOMIC_SEQ_CST) == 0) {
+        drop_records(bufs[i]);
+        recycle_buffer(bufs[i]);
+        continue;
+      }
+      int next_output = (self + 1) % all_outputs->num_outputs;
+      submit_full_buffer(bufs[i], &next_output);
     }
+    if (is_broadcasting()) catch_up(output, num_bufs);
+    finish_writing();
 
-    // Stop once the output is closed
-    if (output->is_closed) {
+    // Stop once the output is closed, unless records are broadcast to it, which
+    // it keeps taking off its queue so their memory can be reused
+    if (output->is_closed && !is_broadcasting()) {
       DEBUG("%s: output is now closed", output->name);
       break;
     }
-
-    // Also stop if no data is flowing in and remains in the pool
-    if (!data_is_flowing_in && is_empty(full_buffers)) {
-      DEBUG("%s: anticipates no more buffers to arrive", output->name);
-      data_should_flow_out = false;
-      break;
-    }
   }
 
   DEBUG("%s: stops output thread", output->name);
   return NULL;
 }
 
-/**
-  * Function executed as a thread once all input threads are finished to wake
-  * pending output threads to flush all the buffered data.
-  */
-static void *flush_remaining_data(void *arg) {
-  for (int i = 0;; ++i) {
-    Buffer *empty = grab_empty_buffer();
-    DEBUG("Submitting an empty buffer to wake an output thread (%d)", i);
-    queue_and_signal(full_buffers, empty);
-  }
-  return NULL;
-}
-
 /**
   * Parse runtime parameters from environment variables
   */
@@ -247,6 +937,19 @@ static inline void parse_environ(void) {
   // allow multiple buffering factor to be tuned
   readIntFromEnv(MULTIBUFFERING, MULTIBUFFERING, MULTIBUFFERING > 0,
                  DEFAULT_MULTIBUFFERING);
+  // how many filled buffers or bytes an output can write with a single call
+  readIntFromEnv(GATHER_BUFFERS, GATHER_BUFFERS,
+                 GATHER_BUFFERS > 0 && GATHER_BUFFERS <= MAX_GATHER_BUFFERS,
+                 DEFAULT_GATHER_BUFFERS);
+  readIntFromEnv(GATHER_BYTES, GATHER_BYTES, GATHER_BYTES > 0,
+                 DEFAULT_GATHER_BYTES);
+  // how many buffers an input can read into with a single call
+  readIntFromEnv(SCATTER_BUFFERS, SCATTER_BUFFERS,
+                 SCATTER_BUFFERS > 0 && SCATTER_BUFFERS <= MAX_GATHER_BUFFERS,
+                 DEFAULT_SCATTER_BUFFERS);
+  // how many filled buffers an input can queue ahead of the merge
+  readIntFromEnv(READ_AHEAD, READ_AHEAD, READ_AHEAD > 0,
+                 DEFAULT_READ_AHEAD);
 }
 
 /**
@@ -255,15 +958,48 @@ static inline void parse_environ(void) {
 inline int mkmimo_multithreaded(Inputs *inputs, Outputs *outputs) {
   parse_environ();
 
-  full_buffers = new_queue();
-  empty_buffers = new_queue();
-
-  // Initialize the empty pool with k * (I + O) buffers
+  // Initialize the empty pool with k * (I + O) buffers, where the pool and
+  // every output's queue is large enough to hold all of them, so pushing never
+  // blocks, plus one per input for the buffer whose memory the input keeps
+  // reading into after it was written, and I * O more for staging records
+  // while partitioning.  While merging or reordering, every input may hold as
+  // many as it reads ahead besides the ones it reads into and the merge takes
+  // from, while the merge waits for another, so those are added on top with O
+  // more for staging the records in order.  While broadcasting, every output
+  // may have up to twice BROADCAST_LAG buffers left to write when dropping
+  // the ones lagging behind the leader, each a view sharing the memory of
+  // another.
   int num_buffers =
-      MULTIBUFFERING * (inputs->num_inputs + outputs->num_outputs);
+      MULTIBUFFERING * (inputs->num_inputs + outputs->num_outputs) +
+      inputs->num_inputs;
+  if (is_reading_ahead()) {
+    buffers_read_ahead = malloc(inputs->num_inputs * sizeof(Ring *));
+    for (int i = 0; i < inputs->num_inputs; i++) {
+      buffers_read_ahead[i] = new_ring(READ_AHEAD);
+      num_buffers += buffers_read_ahead[i]->mask + 1 + SCATTER_BUFFERS + 3;
+    }
+    num_buffers += outputs->num_outputs;
+  } else if (is_partitioning()) {
+    num_buffers += inputs->num_inputs * outputs->num_outputs;
+  } else if (is_broadcasting()) {
+    num_buffers += outputs->num_outputs * 2 * BROADCAST_LAG;
+  }
+  if (is_sequencing() && open_sequence_file() < 0) return 1;
+  all_inputs = inputs;
+  all_outputs = outputs;
+  num_open_outputs = outputs->num_outputs;
+  output_cpus = malloc(outputs->num_outputs * sizeof(int));
+  full_buffers = malloc(outputs->num_outputs * sizeof(Ring *));
+  for (int i = 0; i < outputs->num_outputs; i++) {
+    output_cpus[i] = -1;
+    full_buffers[i] = new_ring(num_buffers);
+  }
+  empty_buffers = new_ring(num_buffers);
   DEBUG("Creating %d empty buffers", num_buffers);
+  Buffer *bufs = new_buffers(num_buffers);
+  if (bufs == NULL) return 1;
   for (int i = 0; i < num_buffers; i++) {
-    queue(empty_buffers, new_buffer());
+    ring_push(empty_buffers, &bufs[i]);
   }
 
   // Initialize the state
@@ -285,6 +1021,14 @@ inline int mkmimo_multithreaded(Inputs *inputs, Outputs *outputs) {
                 read_buffers_from_input, input);
   }
 
+  pthread_t merge_thread;
+  if (is_reading_ahead()) {
+    DEBUG("Spawning merge thread for %d inputs", inputs->num_inputs);
+    CHECK_ERRNO(pthread_create, &merge_thread, NULL,
+                is_merging() ? merge_sorted_inputs : restore_order_of_inputs,
+                NULL);
+  }
+
   // Wait for all input threads to read all data
   for (int i = 0; i < inputs->num_inputs; i++) {
     DEBUG("Waiting for %s and %d more input threads to finish",
@@ -292,18 +1036,23 @@ inline int mkmimo_multithreaded(Inputs *inputs, Outputs *outputs) {
     CHECK_ERRNO(pthread_join, input_threads[i], NULL);
   }
   DEBUG("%s", "All input threads finished");
-  // Let output threads know no more data is coming in
-  data_is_flowing_in = false;
-  // Spawn a thread for waking up all pending output threads
-  pthread_t flush_thread;
-  CHECK_ERRNO(pthread_create, &flush_thread, NULL, flush_remaining_data, NULL);
+  // and for the merge or reorder to pass on all their records
+  if (is_reading_ahead()) CHECK_ERRNO(pthread_join, merge_thread, NULL);
+  // Let output threads know no more data is coming in, waking up all pending
+  // ones to flush the buffered data
+  __atomic_store_n(&data_is_flowing_in, false, __ATOMIC_SEQ_CST);
+  notify_event(&has_full_buffers, INT_MAX);
   // Wait for all output threads to finish writing the buffers
   for (int i = 0; i < outputs->num_outputs; i++) {
     DEBUG("Waiting for %s and %d more output threads to finish",
           outputs->outputs[i].name, outputs->num_outputs - 1 - i);
     CHECK_ERRNO(pthread_join, output_threads[i], NULL);
   }
-  CHECK_ERRNO(pthread_cancel, flush_thread);
+  // Count the records left behind once no output could take them
+  for (int i = 0; i < outputs->num_outputs; i++) {
+    void *buf;
+    while (ring_try_pop(full_buffers[i], &buf)) drop_records(buf);
+  }
 
   // Exit with non-zero status if something goes wrong
   return something_went_wrong ? 1 : 0;
@@ -6,5 +6,9 @@
 int mkmimo_multithreaded(Inputs *inputs, Outputs *outputs);
 
 #define DEFAULT_MULTIBUFFERING 2  // use double buffering by default
+#define DEFAULT_GATHER_BUFFERS 16        // write up to 16 buffers at once
+#define DEFAULT_GATHER_BYTES (1 << 20)  // or up to 1MiB
+#define DEFAULT_SCATTER_BUFFERS 4  // read into up to 4 buffers at once
+#define DEFAULT_READ_AHEAD 4  // buffers read ahead of a merge or reorder
 
 #endif /* MKMIMO_MULTITHREADED_H */
@@ -1,4 +1,10 @@
 #include "mkmimo_nonblocking.h"
+#include "adapt.h"
+#include "io.h"
+#include "latency.h"
+#include "routing.h"
+#include "splice.h"
+#include "stats.h"
 #include <poll.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -44,9 +50,11 @@ static inline int setNonblocking(int fd) {
  * Initialize an empty buffer for each input and output, set all of
  * the sockets to be nonblocking.
  */
-static inline int initialize_ios(Inputs *inputs, Outputs *outputs) {
+int initialize_ios(Inputs *inputs, Outputs *outputs) {
+  Buffer *bufs = new_buffers(inputs->num_inputs + outputs->num_outputs);
+  if (bufs == NULL) return 1;
   for (int i = 0; i < inputs->num_inputs; i++) {
-    inputs->inputs[i].buffer = new_buffer();
+    inputs->inputs[i].buffer = &bufs[i];
 
     Input input = inputs->inputs[i];
     if (setNonblocking(input.fd) < 0) {
@@ -56,7 +64,7 @@ static inline int initialize_ios(Inputs *inputs, Outputs *outputs) {
   }
 
   for (int i = 0; i < outputs->num_outputs; i++) {
-    outputs->outputs[i].buffer = new_buffer();
+    outputs->outputs[i].buffer = &bufs[inputs->num_inputs + i];
 
     Output output = outputs->outputs[i];
     if (setNonblocking(output.fd) < 0) {
@@ -109,6 +117,16 @@ static inline void move_closed_inputs_outputs_to_the_end(Inputs *inputs,
     }
 }
 
+bool records_may_flow_between(Inputs *inputs, Outputs *outputs) {
+  // no more data can flow once all inputs are closed and every buffer has
+  // been drained
+  if (inputs->num_closed == inputs->num_inputs && inputs->num_buffered == 0 &&
+      outputs->num_busy == 0)
+    return false;
+  // or when there's no output left to write to
+  return outputs->num_closed < outputs->num_outputs;
+}
+
 static inline int records_are_flowing_between(Inputs *inputs,
                                               Outputs *outputs) {
   // we can be sure no data will flow if all of the following holds:
@@ -122,6 +140,9 @@ static inline int records_are_flowing_between(Inputs *inputs,
       outputs->num_busy == 0) {
     DEBUG("%s", "no data flow possible, skipping polling");
     return 0;
+  } else if (outputs->num_closed == outputs->num_outputs) {
+    DEBUG("%s", "no output left to write to, skipping polling");
+    return 0;
   } else
     DEBUG(
         "%d open inputs, %d buffered inputs, %d open outputs, %d busy "
@@ -172,6 +193,8 @@ static inline int records_are_flowing_between(Inputs *inputs,
   inputs->num_readable = outputs->num_writable = 0;
   int num_events = poll(fds, num_fds_to_poll, POLL_TIMEOUT_MSEC);
   if (num_events < 0) {
+    // a signal reporting the state only means polling again
+    if (errno == EINTR) return 1;
     perror("poll");
     return 0;
   } else if (num_events > 0) {
@@ -219,7 +242,38 @@ static inline int records_are_flowing_between(Inputs *inputs,
   }
 }
 
-static inline int read_from_available(Inputs *inputs) {
+/**
+ * Make room in an input's buffer that is full of an incomplete record,
+ * following MEMORY_POLICY when it can't grow, and returning whether more can
+ * be read into it.
+ */
+static inline bool make_room_for_record(Inputs *inputs, Input *input) {
+  Buffer *buf = input->buffer;
+  DEBUG("%s: doubling buffer size to %d bytes", input->name,
+        buf->capacity * 2);
+  switch (grow_buffer_for_record(buf, false)) {
+    case 0:
+      return true;
+    case MEMORY_POLICY_EMIT:
+      DEBUG("%s: emitting %d bytes of an oversized record", input->name,
+            buf->size);
+      SET(input, buffered, 1);
+      return false;
+    case MEMORY_POLICY_FAIL:
+      fprintf(stderr, "%s: record exceeds MKMIMO_MAX_MEMORY, closing input\n",
+              input->name);
+      close(input->fd);
+      clear_buffer(buf);
+      SET(input, readable, 0);
+      SET(input, closed, 1);
+      return false;
+    default:
+      DEBUG("%s: waiting for memory to be released", input->name);
+      return false;
+  }
+}
+
+int read_from_available(Inputs *inputs) {
   // read from available inputs
   if (inputs->num_readable > 0)
     for (int i = 0; i < inputs->num_inputs; ++i) {
@@ -228,14 +282,19 @@ static inline int read_from_available(Inputs *inputs) {
       if (input->is_closed) continue;
       if (!input->is_readable) continue;
       Buffer *buf = input->buffer;
-      // skip inputs whose buffer is full
-      if (buf->size == buf->capacity) continue;
+      // skip inputs whose buffer is full, unless it's waiting for memory to
+      // hold more of a record
+      if (buf->size == buf->capacity &&
+          (input->is_buffered || !make_room_for_record(inputs, input)))
+        continue;
       int scan_end_of_record_down_to = buf->end_of_last_record + 1;
       // XXX optionally reading twice to detect the EOF earlier
       for (int num_reads = input->is_near_eof ? 2 : 1; num_reads > 0;
            --num_reads) {
         // read from the input to fill its buffer with at least one
-        // record
+        // record, making room for as much as it tends to give
+        if (make_room_for_block(buf, input->block_size) < 0)
+          reset_input_block_size(input);
         int num_bytes_readable = buf->capacity - buf->size;
         // skip reading if buffer is already full
         if (num_bytes_readable <= 0) {
@@ -247,15 +306,20 @@ static inline int read_from_available(Inputs *inputs) {
         int num_bytes_read = read(input->fd, buf->data + buf->begin + buf->size,
                                   num_bytes_readable);
         DEBUG("%s: %d bytes read", input->name, num_bytes_read);
+        COUNT_READ(num_bytes_read);
+        COUNT_CALL(input, num_bytes_read, errno);
+        adapt_input_block_size(input, num_bytes_read);
         if (num_bytes_read < 0) {
-          if (errno == EAGAIN)
+          if (errno == EAGAIN) {
             // stop reading when input is exhausted
+            SET(input, readable, 0);
             break;
-          else {
+          } else {
             // close the input on other errors
             perrorf("read %s", input->name);
             DEBUG("%s: input closed due to error", input->name);
             close(input->fd);
+            SET(input, readable, 0);
             SET(input, closed, 1);
             break;
           }
@@ -263,23 +327,16 @@ static inline int read_from_available(Inputs *inputs) {
           // EOF reached, close the input
           DEBUG("%s: input closed", input->name);
           close(input->fd);
+          SET(input, readable, 0);
           SET(input, closed, 1);
           break;
         } else {
           // read normally, reflect size increase
           buf->size += num_bytes_read;
+          STAMP_READ(buf);
         }
         // find the last record separator in the buffer
-        // TODO use strrchr or a faster string matching algorithm
-        for (int j = buf->begin + buf->size - 1;
-             j >= scan_end_of_record_down_to; --j) {
-          char c = ((char *)buf->data)[j];
-          // TODO support user defined record delimiters
-          if (c == '\n') {
-            buf->end_of_last_record = j;
-            break;
-          }
-        }
+        find_end_of_last_record(buf, scan_end_of_record_down_to);
         DEBUG("%s: record ends at %d", input->name, buf->end_of_last_record);
         if (buf->end_of_last_record > -1) {
           // stop reading if at least one record exists in the buffer
@@ -287,9 +344,7 @@ static inline int read_from_available(Inputs *inputs) {
         } else if (!input->is_closed && buf->size == buf->capacity) {
           // enlarge the buffer so a record that is larger than the
           // current buffer capacity can be read
-          DEBUG("%s: doubling buffer size to %d bytes", input->name,
-                buf->capacity * 2);
-          enlarge_buffer(buf, buf->capacity * 2);
+          if (!make_room_for_record(inputs, input)) break;
           // bound the next scan for end-of-record separator
           scan_end_of_record_down_to = buf->begin + buf->size;
         }
@@ -300,7 +355,7 @@ static inline int read_from_available(Inputs *inputs) {
   return inputs->num_buffered;
 }
 
-static inline int write_to_available(Outputs *outputs) {
+int write_to_available(Outputs *outputs) {
   // write to each output its buffered records
   if (outputs->num_writable > 0)
     for (int i = 0; i < outputs->num_outputs; ++i) {
@@ -318,22 +373,33 @@ static inline int write_to_available(Outputs *outputs) {
         continue;
       }
       int num_bytes_written =
-          write(output->fd, buf->data + buf->begin, num_bytes_writable);
+          output->spliced != NULL
+              ? splice_buffer(output->spliced, output->fd, buf, buf->begin,
+                              num_bytes_writable)
+              : write(output->fd, buf->data + buf->begin, num_bytes_writable);
       DEBUG("%s: wrote %d bytes", output->name, num_bytes_written);
+      COUNT_WRITE(num_bytes_written);
+      COUNT_CALL(output, num_bytes_written, errno);
       if (num_bytes_written >= 0) {
         // normal write
         buf->begin += num_bytes_written;
         buf->size -= num_bytes_written;
+        route_bytes(output, -num_bytes_written);
         if (buf->size == 0) {
+          finish_draining(output);
+          RECORD_WRITTEN(output, buf);
           SET(output, busy, 0);
         } else {
           SET(output, busy, 1);
           DEBUG("%s: %d bytes still left", output->name, buf->size);
+          adapt_output_pipe_capacity(output);
         }
       } else {
         if (errno == EAGAIN) {
-          // output is busy, will try again later
+          // output is busy, will try again once it becomes writable
           DEBUG("%s: output busy", output->name);
+          adapt_output_pipe_capacity(output);
+          SET(output, writable, 0);
           SET(output, busy, 1);
           DEBUG("%s: %d bytes still left", output->name, buf->size);
         } else {
@@ -341,17 +407,52 @@ static inline int write_to_available(Outputs *outputs) {
           perrorf("write %s", output->name);
           DEBUG("%s: output closed due to error", output->name);
           close(output->fd);
+          SET(output, writable, 0);
           SET(output, closed, 1);
-          // XXX the buffer should be routed to another output
+          // the output stays busy until another one takes the records left
+          route_bytes(output, -buf->size);
+          if (fail_over_buffer(output, buf) == 0) SET(output, busy, 0);
         }
       }
     }
+  if (outputs->num_closed > 0) reroute_records_of_closed_outputs(outputs);
   DEBUG("wrote to %d writable outputs, %d still busy", outputs->num_writable,
         outputs->num_busy);
   return outputs->num_busy;
 }
 
-static inline int exchange_buffered_records(Inputs *inputs, Outputs *outputs) {
+int reroute_records_of_closed_outputs(Outputs *outputs) {
+  int num_rerouted = 0;
+  // swap the buffer of every closed output still holding records with an
+  // idle output's
+  for (int i = 0; i < outputs->num_outputs; ++i) {
+    Output *output = &outputs->outputs[i];
+    if (!output->is_closed || !output->is_busy) continue;
+    int j = choose_output(outputs, &outputs->next_output, true);
+    if (j < 0) break;
+    Output *target = &outputs->outputs[j];
+    DEBUG("rerouting %d bytes: %s > %s", output->buffer->size, output->name,
+          target->name);
+    Buffer *buf = output->buffer;
+    output->buffer = target->buffer;
+    target->buffer = buf;
+    SET(output, busy, 0);
+    SET_FLAG(outputs, target, busy, 1);
+    route_bytes(target, buf->size);
+    start_draining(target, buf->size);
+    ++num_rerouted;
+  }
+  return num_rerouted;
+}
+
+void drop_records_left(Inputs *inputs, Outputs *outputs) {
+  for (int i = 0; i < inputs->num_inputs; ++i)
+    drop_records(inputs->inputs[i].buffer);
+  for (int i = 0; i < outputs->num_outputs; ++i)
+    drop_records(outputs->outputs[i].buffer);
+}
+
+int exchange_buffered_records(Inputs *inputs, Outputs *outputs) {
   int num_exchanges = 0;
   // every buffered input should swap its buffer with an idle output
   for (int i = 0; i < inputs->num_inputs; ++i) {
@@ -368,17 +469,10 @@ static inline int exchange_buffered_records(Inputs *inputs, Outputs *outputs) {
     Input *input = &inputs->inputs[i];
     if (!input->is_buffered) continue;
     // find an output that isn't busy, i.e., whose buffer is free
-    Output *output = NULL;
-    for (int j = 0; j < outputs->num_outputs; ++j) {
-      Output *o = &outputs->outputs[outputs->next_output];
-      ++outputs->next_output;
-      outputs->next_output %= outputs->num_outputs;
-      if (o->is_busy) continue;
-      output = o;
-      break;
-    }
+    int j = choose_output(outputs, &outputs->next_output, true);
     // stop if no idle output can be found
-    if (output == NULL) continue;
+    if (j < 0) continue;
+    Output *output = &outputs->outputs[j];
     DEBUG("routing %d bytes: %s > %s",
           input->buffer->end_of_last_record + 1 - input->buffer->begin,
           input->name, output->name);
@@ -389,22 +483,23 @@ static inline int exchange_buffered_records(Inputs *inputs, Outputs *outputs) {
     output->buffer = buf;
 
     // Reset input buffer
-    input->buffer->size = 0;
-    input->buffer->begin = 0;
-    input->buffer->end_of_last_record = -1;
+    clear_buffer(input->buffer);
 
     // Make sure the trailing bytes at the end of input's buffer isn't lost
     move_trailing_data_after_last_record(input->buffer, output->buffer);
+    output->buffer->records_begin = output->buffer->begin;
+    COUNT_EXCHANGE(input, output, output->buffer);
+    STAMP_TAKEN(output->buffer);
     // now, mark the input as holding an incomplete buffer
     SET(input, buffered, 0);
     // and mark the output as busy
     SET(output, busy, 1);
+    route_bytes(output, output->buffer->size);
+    start_draining(output, output->buffer->size);
     // keep track of the number of exchanges
     ++num_exchanges;
   }
-  // TODO any closed but busy output's buffer should be swapped with another
-  // idle output
-  // TODO similarly a straggler output's buffer could be reallocated to
+  // TODO a straggler output's buffer could be reallocated to
   // another faster one
   DEBUG("exchanged %d input-output pairs", num_exchanges);
   return num_exchanges;
@@ -488,6 +583,7 @@ int mkmimo_nonblocking(Inputs *inputs, Outputs *outputs) {
         write_to_available(outputs);
     DEBUG("%s", "----------------------------------------");
   }
+  drop_records_left(inputs, outputs);
 
   return 0;
 }
@@ -10,6 +10,16 @@
 
 int mkmimo_nonblocking(Inputs *inputs, Outputs *outputs);
 
+// steps of the nonblocking I/O loop, shared with other event-driven
+// implementations that only differ in how readiness is detected
+int initialize_ios(Inputs *inputs, Outputs *outputs);
+bool records_may_flow_between(Inputs *inputs, Outputs *outputs);
+int read_from_available(Inputs *inputs);
+int write_to_available(Outputs *outputs);
+int exchange_buffered_records(Inputs *inputs, Outputs *outputs);
+int reroute_records_of_closed_outputs(Outputs *outputs);
+void drop_records_left(Inputs *inputs, Outputs *outputs);
+
 // when POLLHUP support is unreliable, use a timeout to detect input EOFs
 #ifdef POLLHUP_SUPPORT_UNRELIABLE
 #define DEFAULT_POLL_TIMEOUT_MSEC 1000 /* msec */
@@ -0,0 +1,386 @@
+#include "mkmimo_sharded.h"
+#include "latency.h"
+#include "mkmimo_epoll.h"
+#include "mkmimo_multithreaded.h"
+#include "mkmimo_nonblocking.h"
+#include "ring.h"
+#include "routing.h"
+#include "stats.h"
+#include <pthread.h>
+
+#ifdef __linux__
+#include <stdint.h>
+#include <sys/eventfd.h>
+
+/**
+ * Parameters
+ */
+static int WORKERS = DEFAULT_WORKERS;
+static int POOL_BUFFERS_PER_WORKER = DEFAULT_POOL_BUFFERS_PER_WORKER;
+
+// what a sleeping worker can be woken up for
+#define WANTS_FULL_BUFFERS 1   // it has idle outputs
+#define WANTS_EMPTY_BUFFERS 2  // it has inputs holding records
+
+// a thread running an event loop over its own shard of inputs and outputs
+typedef struct worker {
+  int index;
+  Inputs inputs;
+  Outputs outputs;
+  EventLoop *loop;
+  int wakeup_fd;
+  bool is_producing;
+  int num_closed_outputs;
+  pthread_t thread;
+  // what the worker is waiting for while it sleeps, or zero
+  int wants __attribute__((aligned(CACHE_LINE_SIZE)));
+} Worker;
+
+static Worker *workers;
+static int num_workers;
+
+/**
+  * Buffer pools shared by all workers for exchanging records across shards
+  */
+static Ring *full_buffers;
+static Ring *empty_buffers;
+
+/**
+  * Counters and flags
+  */
+static int num_producing_workers;
+static int num_open_outputs;
+static bool something_went_wrong = false;
+
+static inline void wake_up(Worker *w) {
+  uint64_t one = 1;
+  if (write(w->wakeup_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    perror("write eventfd");
+}
+
+static inline void wake_up_all_workers(void) {
+  for (int i = 0; i < num_workers; ++i) wake_up(&workers[i]);
+}
+
+/**
+  * Wake up one sleeping worker that wants buffers of the given kind, after
+  * they were pushed to the pool.
+  */
+static inline void wake_up_worker_wanting(int kind, Worker *self) {
+  for (int n = 1; n <= num_workers; ++n) {
+    Worker *w = &workers[(self->index + n) % num_workers];
+    int wants = __atomic_load_n(&w->wants, __ATOMIC_SEQ_CST);
+    if (!(wants & kind)) continue;
+    if (!__atomic_compare_exchange_n(&w->wants, &wants, 0, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+      continue;
+    DEBUG("worker %d: waking up worker %d", self->index, w->index);
+    wake_up(w);
+    return;
+  }
+}
+
+static inline bool has_idle_outputs(Outputs *outputs) {
+  return outputs->num_busy < outputs->num_outputs - outputs->num_closed;
+}
+
+/**
+  * Whether the shard holds records to hand off in place of empty buffers,
+  * either read by its inputs or left by its closed outputs.
+  */
+static inline bool has_records_to_hand_off(Worker *w) {
+  if (w->inputs.num_buffered > 0) return true;
+  Outputs *outputs = &w->outputs;
+  if (outputs->num_closed > 0)
+    for (int i = 0; i < outputs->num_outputs; ++i)
+      if (outputs->outputs[i].is_closed && outputs->outputs[i].is_busy)
+        return true;
+  return false;
+}
+
+/**
+  * Whether the pools have buffers the worker can take right away.
+  */
+static inline bool has_pooled_work(Worker *w) {
+  return (has_idle_outputs(&w->outputs) && !ring_is_empty(full_buffers)) ||
+         (has_records_to_hand_off(w) && !ring_is_empty(empty_buffers));
+}
+
+/**
+  * Let others know what this worker is about to sleep for, returning whether
+  * it should rather go on because the pools changed in the meantime.
+  */
+static inline bool announce_sleep(Worker *w) {
+  int wants = (has_idle_outputs(&w->outputs) ? WANTS_FULL_BUFFERS : 0) |
+              (has_records_to_hand_off(w) ? WANTS_EMPTY_BUFFERS : 0);
+  __atomic_store_n(&w->wants, wants, __ATOMIC_SEQ_CST);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  return has_pooled_work(w);
+}
+
+/**
+  * Let idle outputs take filled buffers from other shards in place of their
+  * drained ones.
+  */
+static int take_from_pool(Worker *w) {
+  Outputs *outputs = &w->outputs;
+  int num_exchanges = 0;
+  void *buf;
+  while (has_idle_outputs(outputs) && ring_try_pop(full_buffers, &buf)) {
+    Output *output =
+        &outputs->outputs[choose_output(outputs, &outputs->next_output, true)];
+    DEBUG("worker %d: %s took a filled buffer %p", w->index, output->name, buf);
+    clear_buffer(output->buffer);
+    ring_push(empty_buffers, output->buffer);
+    wake_up_worker_wanting(WANTS_EMPTY_BUFFERS, w);
+    output->buffer = buf;
+    output->buffer->records_begin = output->buffer->begin;
+    COUNT_BUFFER(output, output->buffer);
+    STAMP_TAKEN(output->buffer);
+    SET(output, busy, 1);
+    route_bytes(output, output->buffer->size);
+    start_draining(output, output->buffer->size);
+    ++num_exchanges;
+  }
+  return num_exchanges;
+}
+
+/**
+  * Let inputs holding records hand them off to other shards in place of empty
+  * buffers.
+  */
+static int hand_off_to_pool(Worker *w) {
+  Inputs *inputs = &w->inputs;
+  int num_exchanges = 0;
+  void *buf;
+  for (int i = 0; i < inputs->num_inputs && inputs->num_buffered > 0; ++i) {
+    Input *input = &inputs->inputs[i];
+    if (!input->is_buffered) continue;
+    if (!ring_try_pop(empty_buffers, &buf)) break;
+    DEBUG("worker %d: %s handed off a filled buffer %p", w->index, input->name,
+          input->buffer);
+    Buffer *empty = buf;
+    clear_buffer(empty);
+    move_trailing_data_after_last_record(empty, input->buffer);
+    COUNT_BUFFER(input, input->buffer);
+    ring_push(full_buffers, input->buffer);
+    wake_up_worker_wanting(WANTS_FULL_BUFFERS, w);
+    input->buffer = empty;
+    SET(input, buffered, 0);
+    ++num_exchanges;
+  }
+  return num_exchanges;
+}
+
+/**
+  * Let closed outputs hand the records they left to other shards when no
+  * output within the shard is idle to take them.
+  */
+static int hand_off_failed_over_to_pool(Worker *w) {
+  Outputs *outputs = &w->outputs;
+  int num_exchanges = 0;
+  void *buf;
+  for (int i = 0; i < outputs->num_outputs; ++i) {
+    Output *output = &outputs->outputs[i];
+    if (!output->is_closed || !output->is_busy) continue;
+    if (!ring_try_pop(empty_buffers, &buf)) break;
+    DEBUG("worker %d: %s handed off its records left %p", w->index,
+          output->name, output->buffer);
+    clear_buffer(buf);
+    ring_push(full_buffers, output->buffer);
+    wake_up_worker_wanting(WANTS_FULL_BUFFERS, w);
+    output->buffer = buf;
+    SET(output, busy, 0);
+    ++num_exchanges;
+  }
+  return num_exchanges;
+}
+
+/**
+  * Keep the global counts up to date with the shard, and tell whether it can
+  * still move any records.
+  */
+static bool records_may_flow_through(Worker *w) {
+  Inputs *inputs = &w->inputs;
+  Outputs *outputs = &w->outputs;
+  if (outputs->num_closed > w->num_closed_outputs) {
+    int num_newly_closed = outputs->num_closed - w->num_closed_outputs;
+    w->num_closed_outputs = outputs->num_closed;
+    if (__atomic_sub_fetch(&num_open_outputs, num_newly_closed,
+                           __ATOMIC_SEQ_CST) == 0)
+      wake_up_all_workers();
+  }
+  if (w->is_producing && inputs->num_closed == inputs->num_inputs &&
+      inputs->num_buffered == 0) {
+    DEBUG("worker %d: all inputs drained", w->index);
+    w->is_producing = false;
+    if (__atomic_sub_fetch(&num_producing_workers, 1, __ATOMIC_SEQ_CST) == 0)
+      wake_up_all_workers();
+  }
+  // nothing can flow once there's no output left anywhere
+  if (__atomic_load_n(&num_open_outputs, __ATOMIC_SEQ_CST) == 0) return false;
+  if (__atomic_load_n(&something_went_wrong, __ATOMIC_SEQ_CST)) return false;
+  if (w->is_producing || outputs->num_busy > 0) return true;
+  // otherwise, the worker is only a consumer of other shards' records
+  if (outputs->num_closed == outputs->num_outputs) return false;
+  return __atomic_load_n(&num_producing_workers, __ATOMIC_SEQ_CST) > 0 ||
+         !ring_is_empty(full_buffers);
+}
+
+/**
+  * Function executed by the worker threads, which is the same loop as the
+  * epoll implementation over the shard, except records are also exchanged
+  * with other shards.
+  */
+static void *run_worker(void *arg) {
+  Worker *w = arg;
+  Inputs *inputs = &w->inputs;
+  Outputs *outputs = &w->outputs;
+
+  while (records_may_flow_through(w)) {
+    update_output_interests(w->loop);
+    // block only when there's nothing to do until new events arrive
+    int timeout_msec =
+        has_pending_io(inputs, outputs) || has_pooled_work(w) ? 0 : -1;
+    if (timeout_msec < 0 && announce_sleep(w)) timeout_msec = 0;
+    if (wait_for_io_events(w->loop, timeout_msec) < 0) {
+      __atomic_store_n(&something_went_wrong, true, __ATOMIC_SEQ_CST);
+      wake_up_all_workers();
+      break;
+    }
+    __atomic_store_n(&w->wants, 0, __ATOMIC_SEQ_CST);
+    write_to_available(outputs);
+    read_from_available(inputs);
+    // records already in the pool go first to keep them in order, then ones
+    // within the shard, and the rest are left to the other shards
+    for (;;) {
+      int num_exchanges = take_from_pool(w);
+      num_exchanges += exchange_buffered_records(inputs, outputs);
+      num_exchanges += hand_off_to_pool(w);
+      if (outputs->num_closed > 0)
+        num_exchanges += hand_off_failed_over_to_pool(w);
+      if (num_exchanges == 0) break;
+      write_to_available(outputs);
+    }
+    DEBUG("worker %d: %s", w->index,
+          "----------------------------------------");
+  }
+
+  DEBUG("worker %d: stops", w->index);
+  return NULL;
+}
+
+/**
+  * Parse runtime parameters from environment variables
+  */
+static inline void parse_environ(void) {
+  readIntFromEnv(WORKERS, WORKERS, WORKERS >= 0, DEFAULT_WORKERS);
+  readIntFromEnv(POOL_BUFFERS_PER_WORKER, POOL_BUFFERS_PER_WORKER,
+                 POOL_BUFFERS_PER_WORKER > 0, DEFAULT_POOL_BUFFERS_PER_WORKER);
+}
+
+/**
+  * Sharded implementation of mkmimo, where a fixed number of worker threads
+  * each run an event loop over a shard of the inputs and outputs, so the
+  * number of threads doesn't grow with the number of streams.
+  */
+int mkmimo_sharded(Inputs *inputs, Outputs *outputs) {
+  parse_environ();
+  if (initialize_ios(inputs, outputs)) {
+    perror("mkmimo");
+    return 1;
+  }
+
+  // there's no use for more workers than the streams on either side
+  num_workers = WORKERS > 0 ? WORKERS : sysconf(_SC_NPROCESSORS_ONLN);
+  int max_workers = inputs->num_inputs > outputs->num_outputs
+                        ? inputs->num_inputs
+                        : outputs->num_outputs;
+  if (num_workers > max_workers) num_workers = max_workers;
+  if (num_workers < 1) num_workers = 1;
+  DEBUG("Sharding %d inputs and %d outputs over %d workers",
+        inputs->num_inputs, outputs->num_outputs, num_workers);
+
+  // every stream keeps a buffer of its own, and the pools start with some
+  // extra empty ones, so both can hold every buffer and pushing never blocks
+  int num_pooled_buffers = POOL_BUFFERS_PER_WORKER * num_workers;
+  int num_buffers =
+      inputs->num_inputs + outputs->num_outputs + num_pooled_buffers;
+  full_buffers = new_ring(num_buffers);
+  empty_buffers = new_ring(num_buffers);
+  Buffer *bufs = new_buffers(num_pooled_buffers);
+  if (bufs == NULL) return 1;
+  for (int i = 0; i < num_pooled_buffers; ++i)
+    ring_push(empty_buffers, &bufs[i]);
+
+  // deal the streams to the workers in turn
+  workers = calloc(num_workers, sizeof(Worker));
+  for (int i = 0; i < num_workers; ++i) {
+    Worker *w = &workers[i];
+    w->index = i;
+    w->inputs.inputs = calloc(inputs->num_inputs / num_workers + 1,
+                              sizeof(Input));
+    w->outputs.outputs = calloc(outputs->num_outputs / num_workers + 1,
+                                sizeof(Output));
+  }
+  for (int i = 0; i < inputs->num_inputs; ++i) {
+    Inputs *shard = &workers[i % num_workers].inputs;
+    shard->inputs[shard->num_inputs++] = inputs->inputs[i];
+  }
+  for (int i = 0; i < outputs->num_outputs; ++i) {
+    Outputs *shard = &workers[i % num_workers].outputs;
+    shard->outputs[shard->num_outputs++] = outputs->outputs[i];
+  }
+  num_producing_workers = 0;
+  num_open_outputs = outputs->num_outputs;
+  for (int i = 0; i < num_workers; ++i) {
+    Worker *w = &workers[i];
+    w->inputs.last_closed = w->inputs.num_inputs;
+    w->outputs.last_closed = w->outputs.num_outputs;
+    w->is_producing = true;
+    ++num_producing_workers;
+    w->loop = new_event_loop(&w->inputs, &w->outputs);
+    if (w->loop == NULL) return 1;
+    w->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (w->wakeup_fd < 0) {
+      perror("eventfd");
+      return 1;
+    }
+    if (watch_wakeup_fd(w->loop, w->wakeup_fd) < 0) return 1;
+  }
+
+  for (int i = 0; i < num_workers; ++i) {
+    DEBUG("Spawning worker %d", i);
+    CHECK_ERRNO(pthread_create, &workers[i].thread, NULL, run_worker,
+                &workers[i]);
+  }
+  for (int i = 0; i < num_workers; ++i) {
+    CHECK_ERRNO(pthread_join, workers[i].thread, NULL);
+    DEBUG("Worker %d finished", i);
+  }
+  // count the records left behind once no output could take them
+  for (int i = 0; i < num_workers; ++i)
+    drop_records_left(&workers[i].inputs, &workers[i].outputs);
+  void *buf;
+  while (ring_try_pop(full_buffers, &buf)) drop_records(buf);
+
+  // reflect the final states of the streams
+  for (int i = 0; i < inputs->num_inputs; ++i)
+    inputs->inputs[i] =
+        workers[i % num_workers].inputs.inputs[i / num_workers];
+  for (int i = 0; i < outputs->num_outputs; ++i)
+    outputs->outputs[i] =
+        workers[i % num_workers].outputs.outputs[i / num_workers];
+
+  return something_went_wrong || num_open_outputs == 0 ? 1 : 0;
+}
+
+#else /* !__linux__ */
+
+int mkmimo_sharded(Inputs *inputs, Outputs *outputs) {
+  fprintf(stderr, "mkmimo: epoll unavailable, falling back to %s\n",
+          "multithreaded");
+  return mkmimo_multithreaded(inputs, outputs);
+}
+
+#endif /* __linux__ */
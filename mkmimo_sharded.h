@@ -0,0 +1,11 @@
+#ifndef MKMIMO_SHARDED_H
+#define MKMIMO_SHARDED_H
+
+#include "mkmimo.h"
+
+int mkmimo_sharded(Inputs *inputs, Outputs *outputs);
+
+#define DEFAULT_WORKERS 0  // as many as the online CPUs
+#define DEFAULT_POOL_BUFFERS_PER_WORKER 2
+
+#endif /* MKMIMO_SHARDED_H */
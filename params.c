@@ -0,0 +1,40 @@
+#include "adapt.h"
+#include "compress.h"
+#include "decompress.h"
+#include "io.h"
+#include "latency.h"
+#include "merge.h"
+#include "partition.h"
+#include "routing.h"
+#include "sequence.h"
+#include "splice.h"
+#include "stats.h"
+
+/* Declared externally in the headers, and set from the environment by main.c
+ * or left at their defaults by the benchmarks linking the engines */
+int BLOCKSIZE = DEFAULT_BLOCKSIZE;
+int ADAPTIVE_BLOCKSIZE = DEFAULT_ADAPTIVE_BLOCKSIZE;
+int HUGEPAGES = DEFAULT_HUGEPAGES;
+int PREFAULT = DEFAULT_PREFAULT;
+size_t MKMIMO_MAX_MEMORY = DEFAULT_MKMIMO_MAX_MEMORY;
+int MEMORY_POLICY = DEFAULT_MEMORY_POLICY;
+int IO_REPORT = DEFAULT_IO_REPORT;
+int LATENCY_REPORT = DEFAULT_LATENCY_REPORT;
+int ZEROCOPY = DEFAULT_ZEROCOPY;
+int ROUTING = DEFAULT_ROUTING;
+int BROADCAST = DEFAULT_BROADCAST;
+int BROADCAST_LAG = DEFAULT_BROADCAST_LAG;
+int BROADCAST_POLICY = DEFAULT_BROADCAST_POLICY;
+KeySpec partition_key = {0, DEFAULT_KEY_SEPARATOR, 0, 0};
+int MERGE = DEFAULT_MERGE;
+KeySpec merge_key = {0, DEFAULT_KEY_SEPARATOR, 0, 0};
+char *SEQUENCE_FILE = NULL;
+char *REORDER_FILE = NULL;
+int REORDER_WINDOW = DEFAULT_REORDER_WINDOW;
+int DECOMPRESS = DEFAULT_DECOMPRESS;
+int DECOMPRESS_WORKERS = DEFAULT_DECOMPRESS_WORKERS;
+int COMPRESS = DEFAULT_COMPRESS;
+int COMPRESS_LEVEL = DEFAULT_COMPRESS_LEVEL;
+int COMPRESS_WORKERS = DEFAULT_COMPRESS_WORKERS;
+char *STATS_FILE = NULL;
+int STATS_INTERVAL = DEFAULT_STATS_INTERVAL;
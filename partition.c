@@ -0,0 +1,48 @@
+#include "partition.h"
+#include "framer.h"
+#include <stdint.h>
+
+/**
+ * Hash a key with 32-bit FNV-1a, so anyone can tell which output gets it.
+ */
+static inline uint32_t hash_key(const char *key, int len) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < len; ++i) {
+    hash ^= (unsigned char)key[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/**
+ * Find which of the partitions the record at the given offsets belongs to by
+ * the hash of its key.
+ */
+int partition_of_record(const char *data, int record_begin, int record_end,
+                        int num_partitions) {
+  int len = find_end_of_record_content(data, record_begin, record_end) -
+            record_begin;
+  const char *key = find_key(&partition_key, data + record_begin, &len);
+  return hash_key(key, len) % num_partitions;
+}
+
+/**
+ * Split the records at the given offset, up to MAX_RECORDS_PARTITIONED_AT_ONCE
+ * of them, and find which of the partitions each belongs to by the hash of
+ * its key.  Finding all their ends in one scan first lets single-byte
+ * delimiters be searched for with SIMD over whole chunks, instead of one call
+ * for every short record.  Bytes that don't make a complete record, e.g., a
+ * last one missing its delimiter or a piece of an oversized one, are taken as
+ * a record.  The offsets past the records are stored in ends, and the number
+ * of records is returned.
+ */
+int partition_records(const char *data, int records_begin, int records_end,
+                      int num_partitions, int *ends, int *partitions) {
+  int num_records = framer->find_ends_of_records(
+      data, records_begin, records_end, ends, MAX_RECORDS_PARTITIONED_AT_ONCE);
+  for (int k = 0; k < num_records; ++k) ++ends[k];
+  if (num_records == 0) ends[num_records++] = records_end;
+  for (int k = 0, begin = records_begin; k < num_records; begin = ends[k++])
+    partitions[k] = partition_of_record(data, begin, ends[k], num_partitions);
+  return num_records;
+}
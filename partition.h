@@ -0,0 +1,22 @@
+#ifndef PARTITION_H
+#define PARTITION_H
+
+#include "key.h"
+
+// which part of every record is hashed to choose its output, where records
+// aren't partitioned unless a field or bytes are given
+extern KeySpec partition_key;
+
+static inline bool is_partitioning(void) {
+  return is_key_given(&partition_key);
+}
+
+// how many records are split and hashed in one go
+#define MAX_RECORDS_PARTITIONED_AT_ONCE 256
+
+int partition_of_record(const char *data, int record_begin, int record_end,
+                        int num_partitions);
+int partition_records(const char *data, int records_begin, int records_end,
+                      int num_partitions, int *ends, int *partitions);
+
+#endif /* PARTITION_H */
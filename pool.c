@@ -0,0 +1,55 @@
+#include "pool.h"
+#include "mkmimo.h"
+#include <pthread.h>
+
+/**
+ * Function executed by the pool threads. Runs the tasks as they come.
+ */
+static void *run_tasks(void *arg) {
+  Pool *pool = arg;
+  for (;;) {
+    Task *task = ring_pop(pool->tasks);
+    task->run(task);
+    __atomic_store_n(&task->is_done, 1, __ATOMIC_SEQ_CST);
+    notify_event(task->has_finished, 1);
+  }
+  return NULL;
+}
+
+/**
+ * Start a pool of the given number of threads, or as many as the online CPUs
+ * if it's 0, which run until the process exits.
+ */
+Pool *new_pool(int num_threads) {
+  Pool *pool = malloc(sizeof(Pool));
+  pool->num_threads =
+      num_threads > 0 ? num_threads : sysconf(_SC_NPROCESSORS_ONLN);
+  if (pool->num_threads < 1) pool->num_threads = 1;
+  pool->tasks = new_ring(4 * pool->num_threads);
+  for (int i = 0; i < pool->num_threads; ++i) {
+    pthread_t thread;
+    CHECK_ERRNO(pthread_create, &thread, NULL, run_tasks, pool);
+    pthread_detach(thread);
+  }
+  return pool;
+}
+
+void submit_task(Pool *pool, Task *task) {
+  task->is_done = 0;
+  ring_push(pool->tasks, task);
+}
+
+/**
+ * Wait until a pool thread has run the task.
+ */
+void wait_for_task(Task *task) {
+  while (!__atomic_load_n(&task->is_done, __ATOMIC_SEQ_CST)) {
+    unsigned seq;
+    prepare_to_wait(task->has_finished, &seq);
+    if (__atomic_load_n(&task->is_done, __ATOMIC_SEQ_CST)) {
+      cancel_wait(task->has_finished);
+      break;
+    }
+    wait_for_event(task->has_finished, seq);
+  }
+}
@@ -0,0 +1,24 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include "ring.h"
+
+// a piece of work for a pool thread, embedded first in a larger job, whose
+// submitter waits on the given event for it to be done
+typedef struct task {
+  void (*run)(struct task *task);
+  Event *has_finished;
+  int is_done;
+} Task;
+
+// threads running the tasks submitted to them in turn
+typedef struct pool {
+  Ring *tasks;
+  int num_threads;
+} Pool;
+
+Pool *new_pool(int num_threads);
+void submit_task(Pool *pool, Task *task);
+void wait_for_task(Task *task);
+
+#endif /* POOL_H */
@@ -0,0 +1,181 @@
+#ifdef __linux__
+#define _GNU_SOURCE  // for syscall(2)
+#endif
+
+#include "ring.h"
+#include "mkmimo.h"
+#include <limits.h>
+#include <sched.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+// number of times to retry before going to sleep, yielding the CPU after
+// the first few in case the thread in the way was preempted
+#define NUM_SPINS 64
+#define NUM_BUSY_SPINS 16
+
+static inline void back_off(int i) {
+  if (i < NUM_BUSY_SPINS) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+  } else {
+    sched_yield();
+  }
+}
+
+static inline void futex_wait(unsigned *addr, unsigned val) {
+#ifdef __linux__
+  syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+#else
+  // poll the counter where futexes aren't available
+  static const struct timespec ts = {0, 1000};
+  while (__atomic_load_n(addr, __ATOMIC_ACQUIRE) == val) nanosleep(&ts, NULL);
+#endif
+}
+
+static inline void futex_wake(unsigned *addr, int num_to_wake) {
+#ifdef __linux__
+  syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, num_to_wake, NULL, NULL, 0);
+#endif
+}
+
+/**
+ * Announce a wait, after which the condition must be checked again before
+ * actually waiting, so no notification can be missed in between.
+ */
+void prepare_to_wait(Event *event, unsigned *seq) {
+  *seq = __atomic_load_n(&event->seq, __ATOMIC_SEQ_CST);
+  __atomic_add_fetch(&event->num_waiters, 1, __ATOMIC_SEQ_CST);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void wait_for_event(Event *event, unsigned seq) {
+  futex_wait(&event->seq, seq);
+  __atomic_sub_fetch(&event->num_waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+void cancel_wait(Event *event) {
+  __atomic_sub_fetch(&event->num_waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Wake up waiters after a change made with a sequentially consistent atomic
+ * operation, so either the waiters see the change when they check again, or
+ * this sees them waiting.  The shared counter isn't touched when nobody is.
+ */
+void notify_event(Event *event, int num_to_wake) {
+  if (__atomic_load_n(&event->num_waiters, __ATOMIC_SEQ_CST) == 0) return;
+  __atomic_add_fetch(&event->seq, 1, __ATOMIC_SEQ_CST);
+  futex_wake(&event->seq, num_to_wake);
+}
+
+/**
+ * Create a ring that can hold at least the given number of elements, and no
+ * fewer than two, as a single cell couldn't tell full from empty.
+ */
+Ring *new_ring(size_t capacity) {
+  size_t size = 2;
+  while (size < capacity) size *= 2;
+  Ring *r;
+  if (posix_memalign((void **)&r, CACHE_LINE_SIZE, sizeof(Ring))) {
+    perror("posix_memalign");
+    return NULL;
+  }
+  memset(r, 0, sizeof(Ring));
+  r->cells = calloc(size, sizeof(RingCell));
+  r->mask = size - 1;
+  for (size_t i = 0; i < size; ++i) r->cells[i].seq = i;
+  return r;
+}
+
+/**
+ * Every cell has a sequence number telling whether it's ready to be pushed
+ * to or popped from at the current position of each end, so producers and
+ * consumers only need to agree on positions with a compare-and-swap.
+ * See:
+ * http://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+ */
+bool ring_try_push(Ring *r, void *elem) {
+  size_t pos = __atomic_load_n(&r->enqueue_pos, __ATOMIC_RELAXED);
+  for (;;) {
+    RingCell *cell = &r->cells[pos & r->mask];
+    size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    long diff = (long)seq - (long)pos;
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&r->enqueue_pos, &pos, pos + 1, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        cell->elem = elem;
+        __atomic_exchange_n(&cell->seq, pos + 1, __ATOMIC_SEQ_CST);
+        notify_event(&r->is_non_empty, 1);
+        return true;
+      }
+    } else if (diff < 0) {
+      return false;  // full
+    } else {
+      pos = __atomic_load_n(&r->enqueue_pos, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+bool ring_try_pop(Ring *r, void **elem) {
+  size_t pos = __atomic_load_n(&r->dequeue_pos, __ATOMIC_RELAXED);
+  for (;;) {
+    RingCell *cell = &r->cells[pos & r->mask];
+    size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    long diff = (long)seq - (long)(pos + 1);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&r->dequeue_pos, &pos, pos + 1, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        *elem = cell->elem;
+        __atomic_exchange_n(&cell->seq, pos + r->mask + 1, __ATOMIC_SEQ_CST);
+        notify_event(&r->is_non_full, 1);
+        return true;
+      }
+    } else if (diff < 0) {
+      return false;  // empty
+    } else {
+      pos = __atomic_load_n(&r->dequeue_pos, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+bool ring_is_empty(Ring *r) {
+  return __atomic_load_n(&r->dequeue_pos, __ATOMIC_ACQUIRE) ==
+         __atomic_load_n(&r->enqueue_pos, __ATOMIC_ACQUIRE);
+}
+
+void ring_push(Ring *r, void *elem) {
+  for (int i = 0; i < NUM_SPINS; back_off(i++))
+    if (ring_try_push(r, elem)) return;
+  for (;;) {
+    unsigned seq;
+    prepare_to_wait(&r->is_non_full, &seq);
+    if (ring_try_push(r, elem)) {
+      cancel_wait(&r->is_non_full);
+      return;
+    }
+    wait_for_event(&r->is_non_full, seq);
+    if (ring_try_push(r, elem)) return;
+  }
+}
+
+void *ring_pop(Ring *r) {
+  void *elem;
+  for (int i = 0; i < NUM_SPINS; back_off(i++))
+    if (ring_try_pop(r, &elem)) return elem;
+  for (;;) {
+    unsigned seq;
+    prepare_to_wait(&r->is_non_empty, &seq);
+    if (ring_try_pop(r, &elem)) {
+      cancel_wait(&r->is_non_empty);
+      return elem;
+    }
+    wait_for_event(&r->is_non_empty, seq);
+    if (ring_try_pop(r, &elem)) return elem;
+  }
+}
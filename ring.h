@@ -0,0 +1,46 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define CACHE_LINE_SIZE 64
+
+// a counter threads can sleep on until it changes, i.e., an eventcount
+typedef struct event {
+  unsigned seq;
+  unsigned num_waiters;
+} Event;
+
+void prepare_to_wait(Event *event, unsigned *seq);
+void wait_for_event(Event *event, unsigned seq);
+void cancel_wait(Event *event);
+void notify_event(Event *event, int num_to_wake);
+
+typedef struct ring_cell {
+  size_t seq;
+  void *elem;
+} RingCell;
+
+// a lock-free bounded multi-producer multi-consumer queue, where threads
+// block only when it's full or empty
+typedef struct ring {
+  RingCell *cells;
+  size_t mask;
+  // the two ends are kept in separate cache lines to avoid false sharing
+  size_t enqueue_pos __attribute__((aligned(CACHE_LINE_SIZE)));
+  size_t dequeue_pos __attribute__((aligned(CACHE_LINE_SIZE)));
+  Event is_non_empty __attribute__((aligned(CACHE_LINE_SIZE)));
+  Event is_non_full __attribute__((aligned(CACHE_LINE_SIZE)));
+} Ring;
+
+Ring *new_ring(size_t capacity);
+bool ring_try_push(Ring *r, void *elem);
+bool ring_try_pop(Ring *r, void **elem);
+bool ring_is_empty(Ring *r);
+
+// blocking versions that wait until there's room or an element
+void ring_push(Ring *r, void *elem);
+void *ring_pop(Ring *r);
+
+#endif /* RING_H */
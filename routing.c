@@ -0,0 +1,149 @@
+#include "routing.h"
+#include <stdint.h>
+
+FailoverStats failover_stats;
+
+// a new throughput sample counts for 1/EWMA_WEIGHT of the moving average
+#define EWMA_WEIGHT 4
+
+// a xorshift generator with a seed per thread, so threads routing at once
+// don't contend on it
+static __thread uint32_t seed;
+static inline uint32_t next_random(void) {
+  if (seed == 0) seed = (uint32_t)(uintptr_t)&seed | 1;
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return seed;
+}
+
+static inline bool can_take(Output *output, bool must_be_idle) {
+  return !output->is_closed && !(must_be_idle && output->is_busy);
+}
+
+static inline long outstanding(Output *output) {
+  return __atomic_load_n(&output->num_bytes_outstanding, __ATOMIC_RELAXED);
+}
+
+// nanoseconds the output would take to write what it's given so far, where
+// outputs that haven't written anything yet look the fastest, so they're tried
+static inline double time_to_drain(Output *output) {
+  long throughput = __atomic_load_n(&output->throughput, __ATOMIC_RELAXED);
+  return throughput > 0 ? 1e9 * (outstanding(output) + 1) / throughput : 0;
+}
+
+/**
+ * Choose an output for a filled buffer following ROUTING among the open ones,
+ * or only the idle ones if must_be_idle, starting the search from the given
+ * position, which is advanced past the output chosen.  Returns its index, or
+ * -1 if none can take it.
+ */
+int choose_output(Outputs *outputs, int *next_output, bool must_be_idle) {
+  int num_outputs = outputs->num_outputs;
+  int chosen = -1;
+  if (ROUTING == ROUTING_P2C_EWMA) {
+    // pick two at random, and fall back to the first available one in turn
+    int i = next_random() % num_outputs;
+    int j = next_random() % num_outputs;
+    Output *a = &outputs->outputs[i];
+    Output *b = &outputs->outputs[j];
+    if (can_take(a, must_be_idle) && can_take(b, must_be_idle))
+      chosen = time_to_drain(b) < time_to_drain(a) ? j : i;
+    else if (can_take(a, must_be_idle))
+      chosen = i;
+    else if (can_take(b, must_be_idle))
+      chosen = j;
+  }
+  if (chosen < 0) {
+    long fewest_bytes = -1;
+    for (int n = 0; n < num_outputs; ++n) {
+      int i = (*next_output + n) % num_outputs;
+      Output *output = &outputs->outputs[i];
+      if (!can_take(output, must_be_idle)) continue;
+      if (ROUTING != ROUTING_LEAST_OUTSTANDING) {
+        chosen = i;
+        break;
+      }
+      long num_bytes = outstanding(output);
+      if (fewest_bytes < 0 || num_bytes < fewest_bytes) {
+        fewest_bytes = num_bytes;
+        chosen = i;
+        if (num_bytes == 0) break;
+      }
+    }
+  }
+  if (chosen >= 0) *next_output = (chosen + 1) % num_outputs;
+  return chosen;
+}
+
+/**
+ * Account for bytes routed to the output, or written by it if negative.
+ */
+void route_bytes(Output *output, long num_bytes) {
+  if (ROUTING == ROUTING_ROUND_ROBIN) return;
+  __atomic_add_fetch(&output->num_bytes_outstanding, num_bytes,
+                     __ATOMIC_RELAXED);
+}
+
+/**
+ * Mark when the output starts writing the given bytes it was routed.
+ */
+void start_draining(Output *output, long num_bytes) {
+  if (ROUTING != ROUTING_P2C_EWMA) return;
+  output->drain_start_ns = now_ns();
+  output->num_bytes_draining = num_bytes;
+}
+
+/**
+ * Fold the rate at which the output wrote the bytes since it started into its
+ * moving average throughput.
+ */
+void finish_draining(Output *output) {
+  if (ROUTING != ROUTING_P2C_EWMA) return;
+  long long elapsed_ns = now_ns() - output->drain_start_ns;
+  if (elapsed_ns <= 0) elapsed_ns = 1;
+  long sample = (long)(1e9 * output->num_bytes_draining / elapsed_ns);
+  long throughput = output->throughput;
+  throughput = throughput > 0
+                   ? throughput + (sample - throughput) / EWMA_WEIGHT
+                   : sample;
+  __atomic_store_n(&output->throughput, throughput, __ATOMIC_RELAXED);
+}
+
+/**
+ * Leave exactly the records a failed output didn't write in its buffer, so
+ * they can be routed to another output, where a record it wrote only in part
+ * is reported and sent again whole.  Returns the number of records left.
+ */
+int fail_over_buffer(Output *output, Buffer *buf) {
+  if (rewind_to_unwritten_record(buf)) {
+    fprintf(stderr, "%s: a record was written in part, sending it again\n",
+            output->name);
+    __atomic_add_fetch(&failover_stats.num_records_resent, 1,
+                       __ATOMIC_RELAXED);
+  }
+  int num_records = count_records(buf);
+  __atomic_add_fetch(&failover_stats.num_records_rerouted, num_records,
+                     __ATOMIC_RELAXED);
+  return num_records;
+}
+
+/**
+ * Count the records left in a buffer no output can take as dropped, and clear
+ * them out.
+ */
+void drop_records(Buffer *buf) {
+  __atomic_add_fetch(&failover_stats.num_records_dropped, count_records(buf),
+                     __ATOMIC_RELAXED);
+  buf->begin += buf->size;
+  buf->size = 0;
+}
+
+/**
+ * Count the records in a buffer broadcast to every output as skipped by the
+ * given one, which won't write them.
+ */
+void skip_records(Output *output, Buffer *buf) {
+  __atomic_add_fetch(&output->num_records_skipped, count_records(buf),
+                     __ATOMIC_RELAXED);
+}
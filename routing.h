@@ -0,0 +1,43 @@
+#ifndef ROUTING_H
+#define ROUTING_H
+
+#include "mkmimo.h"
+
+// how an output is chosen for a filled buffer
+#define ROUTING_ROUND_ROBIN 1        // the next output in turn
+#define ROUTING_LEAST_OUTSTANDING 2  // the one with fewest bytes left to write
+#define ROUTING_P2C_EWMA 3  // the faster to drain of two picked at random
+#define DEFAULT_ROUTING ROUTING_ROUND_ROBIN
+extern int ROUTING;
+
+// whether every output gets every filled buffer, and what to do once one has
+// BROADCAST_LAG buffers left to write
+#define DEFAULT_BROADCAST 0
+extern int BROADCAST;
+#define DEFAULT_BROADCAST_LAG 64
+extern int BROADCAST_LAG;
+#define BROADCAST_POLICY_BLOCK 1  // wait for it to catch up
+#define BROADCAST_POLICY_DROP 2   // skip it if as far behind the fastest one,
+                                  // counting the records it misses
+#define DEFAULT_BROADCAST_POLICY BROADCAST_POLICY_BLOCK
+extern int BROADCAST_POLICY;
+
+static inline bool is_broadcasting(void) { return BROADCAST != 0; }
+
+// records left by outputs that failed, updated atomically
+typedef struct failover_stats {
+  long num_records_rerouted;  // not written, and routed to another output
+  long num_records_resent;    // written in part, and routed again whole
+  long num_records_dropped;   // lost with no output left to take them
+} FailoverStats;
+extern FailoverStats failover_stats;
+
+int choose_output(Outputs *outputs, int *next_output, bool must_be_idle);
+void route_bytes(Output *output, long num_bytes);
+void start_draining(Output *output, long num_bytes);
+void finish_draining(Output *output);
+int fail_over_buffer(Output *output, Buffer *buf);
+void drop_records(Buffer *buf);
+void skip_records(Output *output, Buffer *buf);
+
+#endif /* ROUTING_H */
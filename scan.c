@@ -0,0 +1,331 @@
+#include "scan.h"
+#include "mkmimo.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+static int find_last_byte_scalar(const char *data, int len, char c) {
+  for (int j = len - 1; j >= 0; --j)
+    if (data[j] == c) return j;
+  return -1;
+}
+
+#ifdef HAVE_X86_SIMD
+
+/**
+ * Compare 16, 32, or 64 bytes at a time from the end, and locate the last
+ * match from the highest bit of the comparison mask.
+ */
+__attribute__((target("sse2"))) static int find_last_byte_sse2(
+    const char *data, int len, char c) {
+  __m128i needle = _mm_set1_epi8(c);
+  int i = len;
+  for (; i >= 16; i -= 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)(data + i - 16));
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+    if (mask != 0) return i - 16 + 31 - __builtin_clz(mask);
+  }
+  return find_last_byte_scalar(data, i, c);
+}
+
+__attribute__((target("avx2"))) static int find_last_byte_avx2(
+    const char *data, int len, char c) {
+  __m256i needle = _mm256_set1_epi8(c);
+  int i = len;
+  for (; i >= 32; i -= 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i *)(data + i - 32));
+    unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle));
+    if (mask != 0) return i - 32 + 31 - __builtin_clz(mask);
+  }
+  return find_last_byte_sse2(data, i, c);
+}
+
+#if defined(__x86_64__) && (__GNUC__ >= 5 || defined(__clang__))
+#define HAVE_AVX512
+__attribute__((target("avx512bw"))) static int find_last_byte_avx512(
+    const char *data, int len, char c) {
+  __m512i needle = _mm512_set1_epi8(c);
+  int i = len;
+  for (; i >= 64; i -= 64) {
+    __m512i chunk = _mm512_loadu_si512((const void *)(data + i - 64));
+    unsigned long long mask = _mm512_cmpeq_epi8_mask(chunk, needle);
+    if (mask != 0) return i - 64 + 63 - __builtin_clzll(mask);
+  }
+  return find_last_byte_avx2(data, i, c);
+}
+#endif
+
+#endif /* HAVE_X86_SIMD */
+
+static int find_first_byte_scalar(const char *data, int len, char c) {
+  for (int j = 0; j < len; ++j)
+    if (data[j] == c) return j;
+  return -1;
+}
+
+#ifdef HAVE_X86_SIMD
+
+/**
+ * Compare 16, 32, or 64 bytes at a time from the beginning, and locate the
+ * first match from the lowest bit of the comparison mask.
+ */
+__attribute__((target("sse2"))) static int find_first_byte_sse2(
+    const char *data, int len, char c) {
+  __m128i needle = _mm_set1_epi8(c);
+  int i = 0;
+  for (; i + 16 <= len; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)(data + i));
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+    if (mask != 0) return i + __builtin_ctz(mask);
+  }
+  int j = find_first_byte_scalar(data + i, len - i, c);
+  return j < 0 ? -1 : i + j;
+}
+
+__attribute__((target("avx2"))) static int find_first_byte_avx2(
+    const char *data, int len, char c) {
+  __m256i needle = _mm256_set1_epi8(c);
+  int i = 0;
+  for (; i + 32 <= len; i += 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i *)(data + i));
+    unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle));
+    if (mask != 0) return i + __builtin_ctz(mask);
+  }
+  // the rest is scanned without SSE2, which would pay for switching from AVX
+  // on every call with short records
+  int j = find_first_byte_scalar(data + i, len - i, c);
+  return j < 0 ? -1 : i + j;
+}
+
+#ifdef HAVE_AVX512
+__attribute__((target("avx512bw"))) static int find_first_byte_avx512(
+    const char *data, int len, char c) {
+  __m512i needle = _mm512_set1_epi8(c);
+  int i = 0;
+  for (; i + 64 <= len; i += 64) {
+    __m512i chunk = _mm512_loadu_si512((const void *)(data + i));
+    unsigned long long mask = _mm512_cmpeq_epi8_mask(chunk, needle);
+    if (mask != 0) return i + __builtin_ctzll(mask);
+  }
+  int j = find_first_byte_avx2(data + i, len - i, c);
+  return j < 0 ? -1 : i + j;
+}
+#endif
+
+#endif /* HAVE_X86_SIMD */
+
+static int find_all_bytes_scalar(const char *data, int len, char c,
+                                 int *offsets, int max_offsets) {
+  int num_offsets = 0;
+  for (int j = 0; j < len && num_offsets < max_offsets; ++j)
+    if (data[j] == c) offsets[num_offsets++] = j;
+  return num_offsets;
+}
+
+#ifdef HAVE_X86_SIMD
+
+/**
+ * Compare 16, 32, or 64 bytes at a time, and take every match off the
+ * comparison mask from its lowest bit, so each costs only a few instructions
+ * however close they are.
+ */
+#define TAKE_ALL_MATCHES(offset, mask, clear_lowest_bit)        \
+  while (mask != 0) {                                          \
+    if (num_offsets == max_offsets) return num_offsets;        \
+    offsets[num_offsets++] = (offset) + __builtin_ctzll(mask); \
+    mask = clear_lowest_bit;                                   \
+  }
+
+__attribute__((target("sse2"))) static int find_all_bytes_sse2(
+    const char *data, int len, char c, int *offsets, int max_offsets) {
+  __m128i needle = _mm_set1_epi8(c);
+  int num_offsets = 0;
+  int i = 0;
+  for (; i + 16 <= len; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)(data + i));
+    unsigned long long mask =
+        (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+    TAKE_ALL_MATCHES(i, mask, mask & (mask - 1));
+  }
+  for (; i < len && num_offsets < max_offsets; ++i)
+    if (data[i] == c) offsets[num_offsets++] = i;
+  return num_offsets;
+}
+
+__attribute__((target("avx2"))) static int find_all_bytes_avx2(
+    const char *data, int len, char c, int *offsets, int max_offsets) {
+  __m256i needle = _mm256_set1_epi8(c);
+  int num_offsets = 0;
+  int i = 0;
+  for (; i + 32 <= len; i += 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i *)(data + i));
+    unsigned long long mask =
+        (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle));
+    TAKE_ALL_MATCHES(i, mask, mask & (mask - 1));
+  }
+  for (; i < len && num_offsets < max_offsets; ++i)
+    if (data[i] == c) offsets[num_offsets++] = i;
+  return num_offsets;
+}
+
+#ifdef HAVE_AVX512
+__attribute__((target("avx512bw"))) static int find_all_bytes_avx512(
+    const char *data, int len, char c, int *offsets, int max_offsets) {
+  __m512i needle = _mm512_set1_epi8(c);
+  int num_offsets = 0;
+  int i = 0;
+  for (; i + 64 <= len; i += 64) {
+    __m512i chunk = _mm512_loadu_si512((const void *)(data + i));
+    unsigned long long mask = _mm512_cmpeq_epi8_mask(chunk, needle);
+    TAKE_ALL_MATCHES(i, mask, mask & (mask - 1));
+  }
+  for (; i < len && num_offsets < max_offsets; ++i)
+    if (data[i] == c) offsets[num_offsets++] = i;
+  return num_offsets;
+}
+#endif
+
+#endif /* HAVE_X86_SIMD */
+
+static int find_last_unquoted_byte_scalar(const char *data, int len, char c,
+                                          char quote) {
+  int last = -1;
+  bool is_quoted = false;
+  for (int j = 0; j < len; ++j) {
+    if (data[j] == quote)
+      is_quoted = !is_quoted;
+    else if (data[j] == c && !is_quoted)
+      last = j;
+  }
+  return last;
+}
+
+#ifdef HAVE_X86_SIMD
+
+/**
+ * Compute which of 64 bytes are enclosed by quotes at once: every bit of the
+ * prefix XOR of the quote mask tells whether an odd number of quotes appear
+ * up to that byte, carrying over the state from the previous 64 bytes.
+ */
+__attribute__((target("sse2"))) static int find_last_unquoted_byte_sse2(
+    const char *data, int len, char c, char quote) {
+  __m128i needle = _mm_set1_epi8(c);
+  __m128i quotes = _mm_set1_epi8(quote);
+  unsigned long long is_quoted = 0;  // all ones when inside quotes
+  int last = -1;
+  int i = 0;
+  for (; i + 64 <= len; i += 64) {
+    unsigned long long quote_mask = 0, match_mask = 0;
+    for (int k = 0; k < 4; ++k) {
+      __m128i chunk = _mm_loadu_si128((const __m128i *)(data + i + 16 * k));
+      quote_mask |= (unsigned long long)(unsigned)_mm_movemask_epi8(
+                        _mm_cmpeq_epi8(chunk, quotes))
+                    << (16 * k);
+      match_mask |= (unsigned long long)(unsigned)_mm_movemask_epi8(
+                        _mm_cmpeq_epi8(chunk, needle))
+                    << (16 * k);
+    }
+    unsigned long long quoted_mask = quote_mask;
+    for (int shift = 1; shift < 64; shift *= 2)
+      quoted_mask ^= quoted_mask << shift;
+    quoted_mask ^= is_quoted;
+    unsigned long long unquoted_matches = match_mask & ~quoted_mask;
+    if (unquoted_matches != 0)
+      last = i + 63 - __builtin_clzll(unquoted_matches);
+    is_quoted = (unsigned long long)((long long)quoted_mask >> 63);
+  }
+  // scan the remaining bytes one by one
+  for (; i < len; ++i) {
+    if (data[i] == quote)
+      is_quoted = ~is_quoted;
+    else if (data[i] == c && !is_quoted)
+      last = i;
+  }
+  return last;
+}
+
+#endif /* HAVE_X86_SIMD */
+
+/**
+ * Pick the implementation by CPUID upon the first call.
+ */
+static int find_last_byte_dispatch(const char *data, int len, char c) {
+  find_last_byte = find_last_byte_scalar;
+#ifdef HAVE_X86_SIMD
+  __builtin_cpu_init();
+#ifdef HAVE_AVX512
+  if (__builtin_cpu_supports("avx512bw")) {
+    DEBUG("%s", "scanning records with AVX-512");
+    find_last_byte = find_last_byte_avx512;
+  } else
+#endif
+      if (__builtin_cpu_supports("avx2")) {
+    DEBUG("%s", "scanning records with AVX2");
+    find_last_byte = find_last_byte_avx2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    DEBUG("%s", "scanning records with SSE2");
+    find_last_byte = find_last_byte_sse2;
+  }
+#endif
+  return find_last_byte(data, len, c);
+}
+
+int (*find_last_byte)(const char *data, int len,
+                      char c) = find_last_byte_dispatch;
+
+static int find_first_byte_dispatch(const char *data, int len, char c) {
+  find_first_byte = find_first_byte_scalar;
+#ifdef HAVE_X86_SIMD
+  __builtin_cpu_init();
+#ifdef HAVE_AVX512
+  if (__builtin_cpu_supports("avx512bw"))
+    find_first_byte = find_first_byte_avx512;
+  else
+#endif
+      if (__builtin_cpu_supports("avx2"))
+    find_first_byte = find_first_byte_avx2;
+  else if (__builtin_cpu_supports("sse2"))
+    find_first_byte = find_first_byte_sse2;
+#endif
+  return find_first_byte(data, len, c);
+}
+
+int (*find_first_byte)(const char *data, int len,
+                       char c) = find_first_byte_dispatch;
+
+static int find_all_bytes_dispatch(const char *data, int len, char c,
+                                   int *offsets, int max_offsets) {
+  find_all_bytes = find_all_bytes_scalar;
+#ifdef HAVE_X86_SIMD
+  __builtin_cpu_init();
+#ifdef HAVE_AVX512
+  if (__builtin_cpu_supports("avx512bw"))
+    find_all_bytes = find_all_bytes_avx512;
+  else
+#endif
+      if (__builtin_cpu_supports("avx2"))
+    find_all_bytes = find_all_bytes_avx2;
+  else if (__builtin_cpu_supports("sse2"))
+    find_all_bytes = find_all_bytes_sse2;
+#endif
+  return find_all_bytes(data, len, c, offsets, max_offsets);
+}
+
+int (*find_all_bytes)(const char *data, int len, char c, int *offsets,
+                      int max_offsets) = find_all_bytes_dispatch;
+
+static int find_last_unquoted_byte_dispatch(const char *data, int len, char c,
+                                            char quote) {
+  find_last_unquoted_byte = find_last_unquoted_byte_scalar;
+#ifdef HAVE_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2"))
+    find_last_unquoted_byte = find_last_unquoted_byte_sse2;
+#endif
+  return find_last_unquoted_byte(data, len, c, quote);
+}
+
+int (*find_last_unquoted_byte)(const char *data, int len, char c,
+                               char quote) = find_last_unquoted_byte_dispatch;
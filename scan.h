@@ -0,0 +1,25 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+// Find the offset of the last occurrence of byte c among the first len bytes
+// of data, or -1 if there's none.  The fastest implementation the processor
+// supports is picked on the first call.
+extern int (*find_last_byte)(const char *data, int len, char c);
+
+// Find the offset of the first occurrence of byte c among the first len bytes
+// of data, or -1 if there's none, picked likewise.
+extern int (*find_first_byte)(const char *data, int len, char c);
+
+// Find the offsets of the occurrences of byte c among the first len bytes of
+// data in order, up to max_offsets of them, returning how many were found,
+// picked likewise.
+extern int (*find_all_bytes)(const char *data, int len, char c, int *offsets,
+                             int max_offsets);
+
+// Find the offset of the last occurrence of byte c that isn't enclosed by
+// the quote byte among the first len bytes of data, assuming data begins
+// outside quotes, or -1 if there's none.
+extern int (*find_last_unquoted_byte)(const char *data, int len, char c,
+                                      char quote);
+
+#endif /* SCAN_H */
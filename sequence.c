@@ -0,0 +1,254 @@
+#include "sequence.h"
+#include <fcntl.h>
+
+ReorderStats reorder_stats;
+
+static int sequence_fd = -1;
+static long next_seq;
+
+/**
+ * Open the file to log chunks to, which is usually a named pipe read by the
+ * fan-in side.
+ */
+int open_sequence_file(void) {
+  sequence_fd = open(SEQUENCE_FILE, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND,
+                     0666);
+  if (sequence_fd < 0) perrorf("%s", SEQUENCE_FILE);
+  return sequence_fd;
+}
+
+/**
+ * Number a buffer of records in the order they were read, and count them, as
+ * the fan-in side takes as many from the output it goes to.
+ */
+void number_chunk(Buffer *buf) {
+  buf->seq = __atomic_fetch_add(&next_seq, 1, __ATOMIC_RELAXED);
+  buf->num_records = count_records(buf);
+}
+
+/**
+ * Log the chunk an output is about to write, before its bytes, so the fan-in
+ * side knows where they belong as soon as they can arrive.  A line is written
+ * with a single call, so ones from different outputs never mix.
+ */
+void log_chunk(Buffer *buf, int output) {
+  char line[64];
+  int len = snprintf(line, sizeof(line), "%ld\t%d\t%d\n", buf->seq, output,
+                     buf->num_records);
+  if (write(sequence_fd, line, len) != len) perrorf("%s", SEQUENCE_FILE);
+}
+
+/**
+ * The chunks read from the log ahead of the one to restore next, at the slot
+ * of their number modulo REORDER_WINDOW, and the numbers of the ones not read
+ * yet from every stream in the order they went there, which isn't always the
+ * order of their numbers, e.g., as outputs take buffers from each other.
+ */
+static FILE *reorder_file;
+static Chunk *window;
+static int num_chunks_ahead;
+static long **chunks_of_outputs;
+static int *first_chunks, *num_chunks_of_outputs;
+static int num_outputs;
+// the next chunk to restore, and the streams chunks were moved away from
+static long seq_due;
+static bool *were_chunks_moved_from;
+// memory reserved for the records held aside
+static size_t num_bytes_reserved;
+
+int open_reorder_file(int num_inputs) {
+  reorder_file = fopen(REORDER_FILE, "r");
+  if (reorder_file == NULL) {
+    perrorf("%s", REORDER_FILE);
+    return -1;
+  }
+  window = calloc(REORDER_WINDOW, sizeof(Chunk));
+  for (int i = 0; i < REORDER_WINDOW; ++i) window[i].seq = -1;
+  num_outputs = num_inputs;
+  chunks_of_outputs = malloc(num_outputs * sizeof(long *));
+  for (int i = 0; i < num_outputs; ++i)
+    chunks_of_outputs[i] = malloc(REORDER_WINDOW * sizeof(long));
+  first_chunks = calloc(num_outputs, sizeof(int));
+  num_chunks_of_outputs = calloc(num_outputs, sizeof(int));
+  were_chunks_moved_from = calloc(num_outputs, sizeof(bool));
+  return 0;
+}
+
+static inline void append_chunk_of(int output, long seq) {
+  int i = (first_chunks[output] + num_chunks_of_outputs[output]++) %
+          REORDER_WINDOW;
+  chunks_of_outputs[output][i] = seq;
+}
+
+/**
+ * Take a chunk logged again for another stream, which the fan-out side sends
+ * whole there when the one it went to first fails, off the chunks of the
+ * first stream unless it's being read from there already.
+ */
+static void move_chunk(Chunk *chunk, int output) {
+  int from = chunk->output;
+  for (int i = 0; i < num_chunks_of_outputs[from]; ++i) {
+    int j = (first_chunks[from] + i) % REORDER_WINDOW;
+    if (chunks_of_outputs[from][j] != chunk->seq) continue;
+    for (; i + 1 < num_chunks_of_outputs[from]; ++i) {
+      int k = (first_chunks[from] + i + 1) % REORDER_WINDOW;
+      chunks_of_outputs[from][j] = chunks_of_outputs[from][k];
+      j = k;
+    }
+    --num_chunks_of_outputs[from];
+    break;
+  }
+  were_chunks_moved_from[from] = true;
+  chunk->output = output;
+  chunk->is_passed = false;
+  append_chunk_of(output, chunk->seq);
+  ++reorder_stats.num_chunks_moved;
+}
+
+/**
+ * Read the next chunk from the log.  Returns 0 once the log ends, or -1 if
+ * it's malformed or runs too far ahead of the one to restore next.
+ */
+static int read_chunk(long seq) {
+  Chunk c = {0};
+  int n = fscanf(reorder_file, "%ld %d %d", &c.seq, &c.output, &c.num_records);
+  if (n == EOF) return 0;
+  Chunk *logged = n == 3 && c.seq >= seq ? &window[c.seq % REORDER_WINDOW]
+                                         : NULL;
+  // only a chunk whose records weren't all taken yet can be moved
+  bool is_moved = logged != NULL && logged->seq == c.seq &&
+                  logged->output != c.output &&
+                  logged->num_records == c.num_records &&
+                  (!logged->is_passed ||
+                   logged->num_records_taken < logged->num_records);
+  if (n != 3 || c.seq < seq || c.num_records < 0 || c.output < 0 ||
+      (logged->seq >= 0 && !is_moved)) {
+    fprintf(stderr, "%s: Invalid chunk after %ld\n", REORDER_FILE, seq - 1);
+    return -1;
+  }
+  if (c.output >= num_outputs) {
+    fprintf(stderr, "%s: chunk %ld went to output %d of only %d\n",
+            REORDER_FILE, c.seq, c.output, num_outputs);
+    return -1;
+  }
+  if (c.seq >= seq + REORDER_WINDOW) {
+    fprintf(stderr, "%s: chunk %ld is beyond REORDER_WINDOW=%d from %ld\n",
+            REORDER_FILE, c.seq, REORDER_WINDOW, seq);
+    return -1;
+  }
+  if (is_moved) {
+    move_chunk(logged, c.output);
+    return 1;
+  }
+  *logged = c;
+  append_chunk_of(c.output, c.seq);
+  if (++num_chunks_ahead > reorder_stats.peak_num_chunks_ahead)
+    reorder_stats.peak_num_chunks_ahead = num_chunks_ahead;
+  return 1;
+}
+
+/**
+ * Find the chunk with the given number, reading the log until it shows up.
+ * Returns 0 once the log ends, or -1 if it's malformed.
+ */
+int take_chunk(long seq, Chunk **chunk) {
+  seq_due = seq;
+  while (window[seq % REORDER_WINDOW].seq != seq) {
+    int found = read_chunk(seq);
+    if (found <= 0) return found;
+  }
+  *chunk = &window[seq % REORDER_WINDOW];
+  return 1;
+}
+
+/**
+ * Read the log on until the chunk shows up again for another stream, once the
+ * one it went to ends before all its records.  Returns 1 once it does, 0 if
+ * the log ends first, or -1 if it's malformed.
+ */
+int find_chunk_moved(Chunk *chunk) {
+  int output = chunk->output;
+  while (chunk->output == output) {
+    int found = read_chunk(seq_due);
+    if (found <= 0) return found;
+  }
+  return 1;
+}
+
+/**
+ * Whether any chunk that went to the given stream was moved to another, so
+ * records of it may be left there beyond all the chunks.
+ */
+bool had_chunks_moved_from(int output) {
+  return were_chunks_moved_from[output];
+}
+
+/**
+ * Find the first chunk whose records haven't been read from a stream, which
+ * was logged already if any after it was, or NULL if none is left.
+ */
+Chunk *first_chunk_of(int output) {
+  if (num_chunks_of_outputs[output] == 0) return NULL;
+  long seq = chunks_of_outputs[output][first_chunks[output]];
+  return &window[seq % REORDER_WINDOW];
+}
+
+/**
+ * Mark the first chunk of its stream as read, keeping its records aside until
+ * its turn unless it's due.
+ */
+void pass_chunk(Chunk *chunk, bool is_due) {
+  if (!is_due && !chunk->is_held) {
+    chunk->is_held = true;
+    ++reorder_stats.num_chunks_held;
+  }
+  chunk->is_passed = true;
+  first_chunks[chunk->output] = (first_chunks[chunk->output] + 1) %
+                                REORDER_WINDOW;
+  --num_chunks_of_outputs[chunk->output];
+}
+
+/**
+ * Keep a copy of a record of a chunk read before its turn, once it's held,
+ * counting it towards MKMIMO_MAX_MEMORY.  Returns false without doing so if
+ * that can't be done without waiting for memory to be released, unless
+ * allowed to.
+ */
+bool hold_record(Chunk *chunk, const char *record, int len, bool may_wait) {
+  if (chunk->num_bytes_held + len > chunk->held_capacity) {
+    int capacity = chunk->held_capacity;
+    while (chunk->num_bytes_held + len > capacity)
+      capacity = capacity > 0 ? capacity * 2 : BLOCKSIZE;
+    size_t num_bytes = capacity - chunk->held_capacity;
+    if (!may_wait && !reserve_memory(num_bytes, true)) return false;
+    if (may_wait) reserve_memory_waiting(num_bytes, num_bytes_reserved);
+    num_bytes_reserved += num_bytes;
+    chunk->held_capacity = capacity;
+    chunk->held = realloc(chunk->held, chunk->held_capacity);
+  }
+  memcpy(chunk->held + chunk->num_bytes_held, record, len);
+  chunk->num_bytes_held += len;
+  reorder_stats.num_bytes_held += len;
+  if (reorder_stats.num_bytes_held > reorder_stats.peak_num_bytes_held)
+    reorder_stats.peak_num_bytes_held = reorder_stats.num_bytes_held;
+  return true;
+}
+
+/**
+ * Forget a chunk once its records are restored.
+ */
+void release_chunk(Chunk *chunk) {
+  reorder_stats.num_bytes_held -= chunk->num_bytes_held;
+  if (chunk->held_capacity > 0) {
+    num_bytes_reserved -= chunk->held_capacity;
+    release_memory(chunk->held_capacity);
+  }
+  free(chunk->held);
+  chunk->held = NULL;
+  chunk->num_bytes_held = chunk->held_capacity = 0;
+  chunk->num_records_taken = 0;
+  chunk->is_held = chunk->is_passed = false;
+  chunk->seq = -1;
+  --num_chunks_ahead;
+  ++reorder_stats.num_chunks_restored;
+}
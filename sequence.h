@@ -0,0 +1,54 @@
+#ifndef SEQUENCE_H
+#define SEQUENCE_H
+
+#include "mkmimo.h"
+
+// where the fan-out side logs which output every numbered chunk of records
+// went to, and where the fan-in side reads them back to restore their order
+extern char *SEQUENCE_FILE;
+extern char *REORDER_FILE;
+// how many chunks can be logged ahead of the one to restore next
+#define DEFAULT_REORDER_WINDOW 4096
+extern int REORDER_WINDOW;
+
+static inline bool is_sequencing(void) { return SEQUENCE_FILE != NULL; }
+static inline bool is_reordering(void) { return REORDER_FILE != NULL; }
+
+// a chunk of records as logged, where output is the index of the stream it
+// went to, along with a copy of its records once read ahead of its turn, and
+// how many were taken from a stream it went to before, which failed midway
+typedef struct chunk {
+  long seq;
+  int output;
+  int num_records;
+  int num_records_taken;
+  char *held;
+  int num_bytes_held, held_capacity;
+  bool is_held;
+  bool is_passed;  // taken off the chunks of its stream to be read
+} Chunk;
+
+// how far the fan-in side got ahead of the order restored
+typedef struct reorder_stats {
+  long num_chunks_restored;
+  long num_chunks_held;   // read before their turn
+  long num_chunks_moved;  // logged again for another stream after a failure
+  long num_bytes_held;
+  long peak_num_bytes_held;
+  int peak_num_chunks_ahead;  // logged but not restored yet
+} ReorderStats;
+extern ReorderStats reorder_stats;
+
+int open_sequence_file(void);
+void number_chunk(Buffer *buf);
+void log_chunk(Buffer *buf, int output);
+int open_reorder_file(int num_inputs);
+int take_chunk(long seq, Chunk **chunk);
+Chunk *first_chunk_of(int output);
+int find_chunk_moved(Chunk *chunk);
+bool had_chunks_moved_from(int output);
+void pass_chunk(Chunk *chunk, bool is_due);
+bool hold_record(Chunk *chunk, const char *record, int len, bool may_wait);
+void release_chunk(Chunk *chunk);
+
+#endif /* SEQUENCE_H */
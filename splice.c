@@ -0,0 +1,50 @@
+#ifdef __linux__
+#define _GNU_SOURCE  // for vmsplice(2)
+#endif
+
+#include "splice.h"
+#include "mkmimo.h"
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#ifdef __linux__
+
+/**
+ * Prepare zero-copy output for the given fd, which is possible only for
+ * pipes.
+ */
+SplicedPipe *new_spliced_pipe(int fd) {
+  if (!ZEROCOPY) return NULL;
+  struct stat st;
+  if (fstat(fd, &st) < 0 || !S_ISFIFO(st.st_mode)) return NULL;
+  return calloc(1, sizeof(SplicedPipe));
+}
+
+/**
+ * Move a range of the buffer into the pipe without copying, just like
+ * write(2) would do, or copy it when its memory can't be given away.
+ */
+ssize_t splice_buffer(SplicedPipe *pipe, int fd, Buffer *buf, int offset,
+                      int len) {
+  if (!may_gift_buffer(buf)) return write(fd, buf->data + offset, len);
+  struct iovec iov = {.iov_base = buf->data + offset, .iov_len = len};
+  // the pipe keeps referring to the pages until the reader is done with them,
+  // which may be long after they're read, so they're never written again but
+  // replaced once the buffer is cleared
+  ssize_t num_bytes_spliced = vmsplice(fd, &iov, 1, SPLICE_F_GIFT);
+  if (num_bytes_spliced > 0) {
+    buf->is_gifted = true;
+    pipe->num_bytes_spliced += num_bytes_spliced;
+  }
+  return num_bytes_spliced;
+}
+
+#else /* !__linux__ */
+
+SplicedPipe *new_spliced_pipe(int fd) { return NULL; }
+ssize_t splice_buffer(SplicedPipe *pipe, int fd, Buffer *buf, int offset,
+                      int len) {
+  return write(fd, buf->data + offset, len);
+}
+
+#endif /* __linux__ */
@@ -0,0 +1,19 @@
+#ifndef SPLICE_H
+#define SPLICE_H
+
+#include "buffer.h"
+
+#define DEFAULT_ZEROCOPY 0  // copy bytes to outputs with write(2) by default
+extern int ZEROCOPY;
+
+// an output pipe whose buffers are moved into the kernel with vmsplice(2)
+// rather than copied, whose pages are then replaced before being filled again
+typedef struct spliced_pipe {
+  long long num_bytes_spliced;  // total bytes moved into the pipe so far
+} SplicedPipe;
+
+SplicedPipe *new_spliced_pipe(int fd);
+ssize_t splice_buffer(SplicedPipe *pipe, int fd, Buffer *buf, int offset,
+                      int len);
+
+#endif /* SPLICE_H */
@@ -0,0 +1,224 @@
+#include "stats.h"
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+// updates by the only thread writing the counter, which never contend
+#define ADD(counter, n) \
+  __atomic_store_n(&(counter), (counter) + (n), __ATOMIC_RELAXED)
+#define LOAD(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+void count_call(StreamStats *stats, ssize_t num_bytes, int err) {
+  ADD(stats->num_calls, 1);
+  if (num_bytes > 0) ADD(stats->num_bytes, num_bytes);
+  if (num_bytes < 0 && err == EAGAIN) {
+    ADD(stats->num_eagains, 1);
+    if (stats->blocked_since_ns == 0)
+      __atomic_store_n(&stats->blocked_since_ns, now_ns(), __ATOMIC_RELAXED);
+  } else if (stats->blocked_since_ns != 0) {
+    ADD(stats->num_ns_blocked, now_ns() - stats->blocked_since_ns);
+    __atomic_store_n(&stats->blocked_since_ns, 0, __ATOMIC_RELAXED);
+  }
+}
+
+void count_buffer(StreamStats *stats, Buffer *buf) {
+  if (buf->size == 0) return;
+  ADD(stats->num_buffers, 1);
+  ADD(stats->num_records, count_records(buf));
+  __atomic_store_n(&stats->capacity, buf->capacity, __ATOMIC_RELAXED);
+}
+
+/**
+ * Count a buffer handed from an input to an output by the thread handling
+ * both, scanning its records once.
+ */
+void count_exchange(StreamStats *input, StreamStats *output, Buffer *buf) {
+  if (buf->size == 0) return;
+  int num_records = count_records(buf);
+  ADD(input->num_buffers, 1);
+  ADD(input->num_records, num_records);
+  ADD(output->num_buffers, 1);
+  ADD(output->num_records, num_records);
+  __atomic_store_n(&input->capacity, buf->capacity, __ATOMIC_RELAXED);
+  __atomic_store_n(&output->capacity, buf->capacity, __ATOMIC_RELAXED);
+}
+
+// the streams being exported, and where to
+static Inputs *all_inputs;
+static Outputs *all_outputs;
+static int stats_fd = -1;
+static pthread_t exporter;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t has_finished = PTHREAD_COND_INITIALIZER;
+static bool is_finished = false;
+// the counts exported last, and when, to tell the rates since
+static StreamStats *last_exported;
+static long long last_exported_ns;
+
+static void print_json_string(FILE *out, const char *s) {
+  fputc('"', out);
+  for (; *s != '\0'; ++s) {
+    if (*s == '"' || *s == '\\')
+      fprintf(out, "\\%c", *s);
+    else if ((unsigned char)*s < 0x20)
+      fprintf(out, "\\u%04x", *s);
+    else
+      fputc(*s, out);
+  }
+  fputc('"', out);
+}
+
+static void print_stream(FILE *out, double time, const char *kind,
+                         const char *name, StreamStats *stats,
+                         StreamStats *last, double num_secs, long long now) {
+  StreamStats s = {
+      .num_bytes = LOAD(stats->num_bytes),
+      .num_records = LOAD(stats->num_records),
+      .num_buffers = LOAD(stats->num_buffers),
+      .num_calls = LOAD(stats->num_calls),
+      .num_eagains = LOAD(stats->num_eagains),
+      .num_ns_blocked = LOAD(stats->num_ns_blocked),
+      .blocked_since_ns = LOAD(stats->blocked_since_ns),
+      .capacity = LOAD(stats->capacity),
+  };
+  // including how long it's been blocking so far, to tell a stuck one
+  long long num_ns_blocked = s.num_ns_blocked;
+  if (s.blocked_since_ns != 0 && now > s.blocked_since_ns)
+    num_ns_blocked += now - s.blocked_since_ns;
+  fprintf(out, "{\"time\":%.3f,\"stream\":\"%s\",\"name\":", time, kind);
+  print_json_string(out, name);
+  fprintf(out,
+          ",\"bytes\":%ld,\"records\":%ld,\"buffers\":%ld,\"syscalls\":%ld,"
+          "\"eagains\":%ld,\"blocked_ms\":%.3f,\"capacity\":%d,"
+          "\"bytes_per_sec\":%.0f,\"records_per_sec\":%.0f}\n",
+          s.num_bytes, s.num_records, s.num_buffers, s.num_calls,
+          s.num_eagains, num_ns_blocked / 1e6, s.capacity,
+          num_secs > 0 ? (s.num_bytes - last->num_bytes) / num_secs : 0.0,
+          num_secs > 0 ? (s.num_records - last->num_records) / num_secs : 0.0);
+  *last = s;
+}
+
+/**
+ * Write a line for every stream at once, so a reader never sees a part of
+ * one.  Returns -1 if it can't be written.
+ */
+static int export_stats(void) {
+  char *lines = NULL;
+  size_t len = 0;
+  FILE *out = open_memstream(&lines, &len);
+  if (out == NULL) return -1;
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  double time = ts.tv_sec + ts.tv_nsec / 1e9;
+  long long now = now_ns();
+  double num_secs = (now - last_exported_ns) / 1e9;
+  last_exported_ns = now;
+  StreamStats *last = last_exported;
+  for (int i = 0; i < all_inputs->num_inputs; ++i) {
+    Input *input = &all_inputs->inputs[i];
+    print_stream(out, time, "input", input->name, input->stats, last++,
+                 num_secs, now);
+  }
+  for (int i = 0; i < all_outputs->num_outputs; ++i) {
+    Output *output = &all_outputs->outputs[i];
+    print_stream(out, time, "output", output->name, output->stats, last++,
+                 num_secs, now);
+  }
+  fclose(out);
+  int status = 0;
+  for (size_t offset = 0; offset < len;) {
+    ssize_t num_bytes_written = write(stats_fd, lines + offset, len - offset);
+    if (num_bytes_written < 0 && errno == EINTR) continue;
+    if (num_bytes_written < 0) {
+      perrorf("write %s", STATS_FILE);
+      status = -1;
+      break;
+    }
+    offset += num_bytes_written;
+  }
+  free(lines);
+  return status;
+}
+
+/**
+ * Function executed by the exporter thread. Exports the stats every interval
+ * until the engine is done, and once more then, or until they can't be
+ * written, which doesn't stop the records from flowing.
+ */
+static void *export_stats_periodically(void *arg) {
+  pthread_mutex_lock(&lock);
+  for (;;) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += STATS_INTERVAL / 1000;
+    deadline.tv_nsec += STATS_INTERVAL % 1000 * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      ++deadline.tv_sec;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    while (!is_finished &&
+           pthread_cond_timedwait(&has_finished, &lock, &deadline) == 0)
+      continue;
+    if (export_stats() < 0 || is_finished) break;
+  }
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+static int open_stats_file(void) {
+  struct stat st;
+  if (stat(STATS_FILE, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(STATS_FILE) >= sizeof(addr.sun_path)) {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+    strcpy(addr.sun_path, STATS_FILE);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+  return open(STATS_FILE, O_WRONLY | O_CREAT | O_APPEND,
+              S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+}
+
+/**
+ * Start exporting the stats of the streams to STATS_FILE, appending to it,
+ * or sending them to it if it's a listening Unix socket.
+ */
+int start_exporting_stats(Inputs *inputs, Outputs *outputs) {
+  if (STATS_FILE == NULL) return 0;
+  stats_fd = open_stats_file();
+  if (stats_fd < 0) {
+    perrorf("open %s", STATS_FILE);
+    return -1;
+  }
+  all_inputs = inputs;
+  all_outputs = outputs;
+  last_exported = calloc(inputs->num_inputs + outputs->num_outputs,
+                         sizeof(StreamStats));
+  last_exported_ns = now_ns();
+  CHECK_ERRNO(pthread_create, &exporter, NULL, export_stats_periodically,
+              NULL);
+  return 0;
+}
+
+/**
+ * Export the final stats, and stop.
+ */
+void stop_exporting_stats(void) {
+  if (stats_fd < 0) return;
+  pthread_mutex_lock(&lock);
+  is_finished = true;
+  pthread_cond_signal(&has_finished);
+  pthread_mutex_unlock(&lock);
+  pthread_join(exporter, NULL);
+  close(stats_fd);
+  stats_fd = -1;
+  free(last_exported);
+}
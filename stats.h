@@ -0,0 +1,56 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "mkmimo.h"
+
+// where to export what went through every stream as JSON lines, a file or a
+// listening Unix socket, and how often in milliseconds, or NULL not to count
+extern char *STATS_FILE;
+#define DEFAULT_STATS_INTERVAL 1000
+extern int STATS_INTERVAL;
+
+// what went through a stream, updated only by the thread handling it, and
+// read by the exporter as it goes, so neither ever waits for the other
+typedef struct stream_stats {
+  long num_bytes;
+  long num_records;  // in the buffers handed off from or to the stream
+  long num_buffers;
+  long num_calls;    // to read or write the stream
+  long num_eagains;  // of them, that found it wouldn't block
+  // time spent in calls blocking on the other end of the stream, or waiting
+  // for it to become ready again after EAGAIN, since when it's waiting
+  long long num_ns_blocked;
+  long long blocked_since_ns;
+  int capacity;  // of the last buffer the stream moved records with
+} StreamStats;
+
+// shorthands doing nothing unless the stats are exported, where the time
+// from counting a stream as blocking until its next call is counted is
+// counted as blocked
+#define COUNT_BLOCKING(stream)                                               \
+  do {                                                                       \
+    if (STATS_FILE != NULL)                                                  \
+      __atomic_store_n(&(stream)->stats->blocked_since_ns, now_ns(),         \
+                       __ATOMIC_RELAXED);                                    \
+  } while (0)
+#define COUNT_CALL(stream, num_bytes, err)                                   \
+  do {                                                                       \
+    if (STATS_FILE != NULL) count_call((stream)->stats, (num_bytes), (err)); \
+  } while (0)
+#define COUNT_BUFFER(stream, buf)                                            \
+  do {                                                                       \
+    if (STATS_FILE != NULL) count_buffer((stream)->stats, (buf));            \
+  } while (0)
+#define COUNT_EXCHANGE(input, output, buf)                                   \
+  do {                                                                       \
+    if (STATS_FILE != NULL)                                                  \
+      count_exchange((input)->stats, (output)->stats, (buf));                \
+  } while (0)
+
+void count_call(StreamStats *stats, ssize_t num_bytes, int err);
+void count_buffer(StreamStats *stats, Buffer *buf);
+void count_exchange(StreamStats *input, StreamStats *output, Buffer *buf);
+int start_exporting_stats(Inputs *inputs, Outputs *outputs);
+void stop_exporting_stats(void);
+
+#endif /* STATS_H */
@@ -0,0 +1,35 @@
+#!/usr/bin/env bats
+load test_helpers
+
+@test "tee emulation by broadcasting" {
+    numlines=1000000
+    seq $numlines >input
+    BROADCAST=1 mkmimo input input \> out.1 out.2 out.3
+    for i in 1 2 3; do
+        cmp <(sort -n input input) <(sort -n out.$i)
+    done
+}
+
+@test "broadcasting waits for an output lagging behind" {
+    numlines=1000000
+    mkfifo slow
+    { sleep 1; cat; } <slow >out.2 &
+    seq $numlines | BROADCAST=1 BROADCAST_LAG=1 mkmimo out.1 slow
+    wait
+    cmp <(seq $numlines) out.1
+    cmp <(seq $numlines) out.2
+}
+
+@test "broadcasting skips an output lagging behind" {
+    numlines=1000000
+    mkfifo slow
+    { sleep 1; cat; } <slow >out.2 &
+    seq $numlines |
+    BROADCAST=1 BROADCAST_LAG=32 BROADCAST_POLICY=drop mkmimo out.1 slow 2>err
+    wait
+    cmp <(seq $numlines) out.1
+    # every record either got to the slow output or was counted as skipped
+    numskipped=$(sed -n 's/^slow: skipped \([0-9]*\) records .*/\1/p' err)
+    [[ $numskipped -gt 0 ]]
+    [[ $(($(wc -l <out.2) + numskipped)) -eq $numlines ]]
+}
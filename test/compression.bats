@@ -0,0 +1,33 @@
+#!/usr/bin/env bats
+load test_helpers
+
+@test "deflating outputs named *.gz" {
+    numlines=1000000
+    seq $numlines >input
+    COMPRESS=auto mkmimo input \> out.1.gz out.2.gz out.3
+    gzip -t out.1.gz out.2.gz
+    cmp input <(cat <(zcat out.1.gz out.2.gz) out.3 | sort -n)
+}
+
+@test "inflating deflated outputs as inputs ahead of their turn" {
+    numlines=1000000
+    seq $numlines >input
+    COMPRESS=auto mkmimo input \> out.gz
+    IO_REPORT=1 mkmimo out.gz \> roundtrip 2>report
+    cmp input roundtrip
+    grep -q '^mkmimo: inflated inputs=1 members=[0-9]* ahead=[1-9]' report
+}
+
+@test "writing outputs named *.gz as they are by default" {
+    numlines=1000000
+    seq $numlines >input
+    mkmimo input \> out.gz
+    cmp input out.gz
+}
+
+@test "deflating every output at the fastest level" {
+    numlines=1000000
+    seq $numlines >input
+    COMPRESS=always COMPRESS_LEVEL=1 mkmimo input \> out
+    cmp input <(zcat out)
+}
@@ -0,0 +1,38 @@
+#!/usr/bin/env bats
+load test_helpers
+
+@test "inflating gzip inputs" {
+    numlines=1000000
+    seq $numlines >input
+    gzip -c input >input.gz
+    mkmimo input.gz \> out
+    cmp input out
+}
+
+@test "inflating members of a gzip input ahead of their turn" {
+    numlines=1000000
+    seq $numlines >input
+    split -l 10000 input part.
+    for part in part.*; do gzip -c $part; done >input.gz
+    IO_REPORT=1 mkmimo input.gz input.gz \> out.1 out.2 2>report
+    cmp <(sort -n input input) <(sort -n out.*)
+    grep -q '^mkmimo: inflated inputs=2 members=200 ahead=[1-9]' report
+}
+
+@test "inflating members in order once memory runs out" {
+    numlines=1000000
+    seq $numlines >input
+    split -l 10000 input part.
+    for part in part.*; do gzip -c $part; done >input.gz
+    MKMIMO_MAX_MEMORY=256K IO_REPORT=1 mkmimo input.gz \> out 2>report
+    cmp input out
+    grep -q '^mkmimo: inflated inputs=1 members=100 ahead=0 ' report
+}
+
+@test "failing on a truncated gzip input" {
+    seq 1000000 | gzip >input.gz
+    head -c 100000 input.gz >truncated.gz
+    run mkmimo truncated.gz \> out
+    [[ $status -ne 0 ]]
+    [[ $output == *"truncated.gz: invalid gzip data"* ]]
+}
@@ -7,3 +7,13 @@ load test_helpers
     # run mkmimo and verify its output
     seq $numlines | mkmimo | cmp - <(seq $numlines)
 }
+
+@test "cat emulation with block sizes adapted to a fast pipe" {
+    [[ ${MKMIMO_IMPL:-} != io_uring ]] || skip "io_uring keeps BLOCKSIZE"
+    n=1000000
+    seq $n | ADAPTIVE_BLOCKSIZE=1M IO_REPORT=1 mkmimo >out 2>report
+    cmp <(seq $n) out
+    # the input should have grown its block past the initial size
+    block_size=$(sed -n 's/^mkmimo: input .* block=\([0-9]*\) .*/\1/p' report)
+    [[ $block_size -gt ${BLOCKSIZE:-4096} ]]
+}
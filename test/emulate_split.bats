@@ -15,3 +15,63 @@ load test_helpers
     cmp -b <(seq $numlines) <(sort -n out.*)
 }
 
+
+@test "split emulation with throughput-aware routing" {
+    numouts=10
+    numlines=1000000
+    seq $numouts | split -n r/$numouts - out.
+    for routing in least-outstanding p2c-ewma; do
+        ROUTING=$routing mkmimo out.* <<<"$(seq $numlines)"
+        cmp -b <(seq $numlines) <(sort -n out.*)
+    done
+}
+
+
+@test "split emulation with an output failing" {
+    numlines=1000000
+    touch out.1 out.2
+    seq $numlines | mkmimo /dev/full out.1 out.2 2>err
+    cmp -b <(seq $numlines) <(sort -n out.*)
+    grep -q 'failover rerouted=[1-9]' err
+}
+
+
+@test "split emulation with an output's reader dying" {
+    numlines=1000000
+    mkfifo dying
+    touch alive
+    head -c 100000 <dying >dead &
+    seq $numlines | mkmimo dying alive
+    wait
+    # no record is split or written twice, except the partial one cut by head
+    sed '$d' dead >dead.complete
+    ! grep -qv '^[0-9][0-9]*$' alive
+    [[ -z $(sort dead.complete alive | uniq -d) ]]
+}
+
+
+@test "split emulation partitioned by key" {
+    numouts=4
+    numlines=100000
+    seq $numouts | split -n r/$numouts - out.
+    seq $numlines | awk '{ print $1 % 97 "\t" $1 }' >records
+    PARTITION_FIELD=1 mkmimo out.* <records
+    cmp -b <(sort records) <(sort out.*)
+    # every key ends up in only one output
+    for out in out.*; do cut -f1 $out | sort -u; done | sort | uniq -d >dups
+    [[ ! -s dups ]]
+    [[ $(cut -f1 records | sort -u | wc -l) -eq 97 ]]
+}
+
+@test "split emulation partitioned by a single byte" {
+    numouts=4
+    numlines=100000
+    seq $numouts | split -n r/$numouts - out.
+    seq $numlines | rev >records
+    PARTITION_BYTES=1 mkmimo out.* <records
+    cmp -b <(sort records) <(sort out.*)
+    # every first byte ends up in only one output
+    for out in out.*; do cut -b1 $out | sort -u; done | sort | uniq -d >dups
+    [[ ! -s dups ]]
+    [[ $(cut -b1 records | sort -u | wc -l) -eq 10 ]]
+}
@@ -0,0 +1,59 @@
+#!/usr/bin/env bats
+load test_helpers
+
+@test "keeping order across parallel workers" {
+    numlines=1000000
+    mkfifo chunks w.1 w.2 w.3 r.1 r.2 r.3
+    for i in 1 2 3; do
+        awk '{ print $1 * 2 }' <w.$i >r.$i &
+    done
+    seq $numlines >input
+    BLOCKSIZE=512 SEQUENCE_FILE=chunks mkmimo input \> w.* &
+    REORDER_FILE=chunks MEMORY_REPORT=1 mkmimo r.* \> out 2>report
+    wait
+    cmp <(awk '{ print $1 * 2 }' input) out
+    grep -q '^mkmimo: reorder chunks=[1-9][0-9]* held=' report
+}
+
+@test "keeping order with a worker lagging behind" {
+    numlines=100000
+    mkfifo chunks w.1 w.2 r.1 r.2
+    sed 's/$/!/' <w.1 >r.1 &
+    { sleep 1; sed 's/$/!/'; } <w.2 >r.2 &
+    seq $numlines | SEQUENCE_FILE=chunks mkmimo w.* &
+    REORDER_FILE=chunks READ_AHEAD=1 mkmimo r.* \> out
+    wait
+    cmp <(seq $numlines | sed 's/$/!/') out
+}
+
+@test "keeping order with records held aside within a memory budget" {
+    numlines=100000
+    mkfifo chunks w.1 w.2 r.1 r.2
+    sed 's/$/!/' <w.1 >r.1 &
+    { sleep 1; sed 's/$/!/'; } <w.2 >r.2 &
+    seq $numlines | SEQUENCE_FILE=chunks mkmimo w.* &
+    MKMIMO_MAX_MEMORY=1K MEMORY_REPORT=1 REORDER_FILE=chunks READ_AHEAD=1 \
+        timeout 60 mkmimo r.* \> out 2>report
+    wait
+    cmp <(seq $numlines | sed 's/$/!/') out
+    # the records held aside asked for memory beyond the budget
+    grep -q '^mkmimo: memory .* denied=[1-9]' report
+}
+
+@test "keeping order when a worker fails" {
+    seq 100000 >input
+    mkfifo chunks w.1 r.1
+    sed 's/$/!/' <w.1 >r.1 &
+    BLOCKSIZE=512 SEQUENCE_FILE=chunks mkmimo input \> w.1 /dev/full 2>/dev/null &
+    REORDER_FILE=chunks MEMORY_REPORT=1 mkmimo r.1 /dev/null \> out 2>report
+    wait
+    cmp <(sed 's/$/!/' input) out
+    grep -q '^mkmimo: reorder .* moved=[1-9]' report
+}
+
+@test "keeping order fails when a worker drops records" {
+    seq 100000 >input
+    SEQUENCE_FILE=chunks mkmimo input \> out.1 out.2
+    sed -i '$d' out.2
+    ! REORDER_FILE=chunks mkmimo out.1 out.2 \> out
+}
@@ -11,3 +11,12 @@ load test_helpers
     } | dd of=wide_input
     cmp wide_input <(timeout $timeout mkmimo <wide_input 2>/dev/null)
 }
+
+@test "records continued across buffers read at once" {
+    numrecords=1000 record_width=300 deviation=250
+    {
+        random_records $record_width~$deviation $numrecords '\n'
+        printf '\n'
+    } >wide_input
+    cmp wide_input <(BLOCKSIZE=1024 SCATTER_BUFFERS=8 mkmimo <wide_input)
+}
@@ -0,0 +1,28 @@
+#!/usr/bin/env bats
+load test_helpers
+
+@test "reporting how long records stay per output" {
+    numlines=1000000
+    seq $numlines >input
+    LATENCY_REPORT=1 mkmimo input \> out.1 out.2 2>report
+    cmp input <(sort -n out.*)
+    for out in out.1 out.2; do
+        grep -q "^$out: latency p50/p99/p999 queued=[0-9.]*[nmu]*s/.* writing=[0-9.]*[nmu]*s/.* dwell=[0-9.]*[nmu]*s/" report
+    done
+}
+
+@test "reporting latency on a signal while records flow" {
+    mkfifo input
+    LATENCY_REPORT=1 mkmimo input \> out 2>report &
+    pid=$!
+    exec 3>input
+    seq 1000 >&3
+    sleep 1
+    kill -USR2 $pid
+    sleep 0.5
+    seq 1001 2000 >&3
+    exec 3>&-
+    wait $pid
+    cmp <(seq 2000) out
+    [[ $(grep -c '^out: latency p50/p99/p999 ' report) -eq 2 ]]
+}
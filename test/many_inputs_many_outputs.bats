@@ -10,13 +10,15 @@ load test_helpers
     for i in $(seq $numins)
     do inputs+=" <(seq $((($i-1) * $numlines + 1)) $(($i * $numlines)))"
     done
+    # through named pipes, so the readers can be waited for
+    rm -f out.* pipe.*
     for i in $(seq $numouts)
-    do outputs+=" >(cat >out.$i)"
+    do mkfifo pipe.$i; cat <pipe.$i >out.$i & outputs+=" pipe.$i"
     done
-    rm -f out.*
 
     # run mkmimo
     eval "mkmimo $inputs \\> $outputs"
+    wait
 
     # verify output is identical
     cmp <(eval "sort $inputs") <(sort out.*)
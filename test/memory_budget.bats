@@ -0,0 +1,40 @@
+#!/usr/bin/env bats
+load test_helpers
+
+# a record too large for the budget in between normal ones
+generate_oversized_record() {
+    {
+        seq 1000
+        head -c 2000000 /dev/zero | tr '\0' x
+        echo
+        seq 1001 2000
+    } >input
+}
+
+@test "records within the memory budget" {
+    generate_oversized_record
+    MKMIMO_MAX_MEMORY=16M mkmimo out.1 out.2 <input
+    cmp <(sort input) <(cat out.* | sort)
+}
+
+@test "emitting an oversized record in pieces" {
+    generate_oversized_record
+    MKMIMO_MAX_MEMORY=1M MEMORY_POLICY=emit mkmimo out.1 out.2 <input
+    [[ $(cat out.* | wc -c) -eq $(wc -c <input) ]]
+    cmp <(seq 2000) <(grep -hv x out.* | sort -n)
+}
+
+@test "failing an input with a record that never fits under backpressure" {
+    generate_oversized_record
+    MKMIMO_MAX_MEMORY=1M run timeout 60 mkmimo out.1 out.2 <input
+    [[ $status -eq 1 ]]
+    [[ $output == *"record exceeds MKMIMO_MAX_MEMORY"* ]]
+    cmp <(seq 1000) <(cat out.* | sort -n)
+}
+
+@test "failing an input with an oversized record" {
+    generate_oversized_record
+    MKMIMO_MAX_MEMORY=1M MEMORY_POLICY=fail run mkmimo out.1 out.2 <input
+    [[ $status -ne 0 ]]
+    cmp <(seq 1000) <(cat out.* | sort -n)
+}
@@ -22,3 +22,27 @@ load test_helpers
     # compare all the lines
     cmp <(seq 1 $(($numins * $numlines))) <(sort -n out)
 }
+
+@test "parallel cat with small buffers gathered into fewer writes" {
+    [[ ${MKMIMO_IMPL:-multithreaded} == multithreaded ]] ||
+        skip "only the multi-threaded implementation gathers buffers"
+    numins=10
+    numlines=100000
+    rm -f input.* o
+    for j in $(seq $numins); do
+        seq $((($j-1) * $numlines + 1)) $(($j * $numlines)) >input.$j
+    done
+    mkfifo o
+    # a sink pausing at first lets filled buffers queue up for the output
+    writes_per_MiB() {
+        { sleep 1; cat; } <o >out &
+        BLOCKSIZE=512 GATHER_BUFFERS=$1 IO_REPORT=1 mkmimo input.* \> o 2>report
+        wait
+        cmp <(seq 1 $(($numins * $numlines))) <(sort -n out) || return
+        sed -n 's/^mkmimo: io reads=.* writes=[0-9]* (\([0-9]*\)\..*\/MiB)$/\1/p' report
+    }
+    one=$(writes_per_MiB 1)
+    many=$(writes_per_MiB 64)
+    echo "writes per MiB: $one with GATHER_BUFFERS=1, $many with 64"
+    [[ $many -gt 0 && $(($many * 4)) -lt $one ]]
+}
@@ -0,0 +1,76 @@
+#!/usr/bin/env bats
+load test_helpers
+
+# splits given input over a few outputs with small buffers
+split_records() {
+    rm -f out.*
+    BLOCKSIZE=64 mkmimo out.1 out.2 out.3 <"$1"
+}
+
+@test "NUL-delimited records" {
+    seq 100000 | tr '\n' '\0' >input
+    RECORD_FORMAT=nul split_records input
+    for o in out.*; do
+        [[ ! -s $o ]] || [[ $(tail -c 1 $o | od -An -c | tr -d ' ') = '\0' ]]
+    done
+    cmp <(seq 100000) <(cat out.* | tr '\0' '\n' | sort -n)
+}
+
+@test "records with a multi-byte delimiter" {
+    seq 100000 | sed 's/$/<EOR>/' | tr -d '\n' >input
+    RECORD_FORMAT=delimited RECORD_DELIMITER='<EOR>' split_records input
+    for o in out.*; do
+        [[ ! -s $o ]] || [[ $(tail -c 5 $o) = '<EOR>' ]]
+    done
+    cmp <(seq 100000) <(cat out.* | sed 's/<EOR>/\n/g' | grep . | sort -n)
+}
+
+@test "fixed-size records" {
+    seq -w 100000 | tr -d '\n' >input  # 6 digits each
+    RECORD_FORMAT=fixed RECORD_SIZE=6 split_records input
+    for o in out.*; do
+        [[ $(($(wc -c <$o) % 6)) -eq 0 ]]
+    done
+    cmp <(seq -w 100000) <(cat out.* | fold -w 6 | sort -n)
+}
+
+@test "u32 length-prefixed records" {
+    LC_ALL=C awk 'BEGIN { for (i = 1; i <= 10000; ++i)
+        printf "%c%c%c%c %d", 0, 0, 0, length(i) + 1, i }' >input
+    RECORD_FORMAT=u32 split_records input
+    # every output should hold only complete records
+    for o in out.*; do
+        od -An -v -tu1 $o | tr -s ' \n' '\n\n' | grep . | awk '
+            n == 0 { if (++h == 4) { n = $1; h = 0 }; next }
+            { --n }
+            END { exit !(n == 0 && h == 0) }
+        '
+    done
+    cmp <(seq 10000) <(cat out.* | tr -c '0-9' '\n' | grep . | sort -n)
+}
+
+@test "varint length-prefixed records" {
+    LC_ALL=C awk 'BEGIN { for (i = 1; i <= 10000; ++i)
+        printf "%c %d", length(i) + 1, i }' >input
+    RECORD_FORMAT=varint split_records input
+    for o in out.*; do
+        od -An -v -tu1 $o | tr -s ' \n' '\n\n' | grep . | awk '
+            n == 0 { n = $1; next }
+            { --n }
+            END { exit !(n == 0) }
+        '
+    done
+    cmp <(seq 10000) <(cat out.* | tr -c '0-9' '\n' | grep . | sort -n)
+}
+
+@test "CSV records with quoted newlines" {
+    seq 100000 | awk '{ printf "%d,\"quoted\nnewline\",x\n", $1 }' >input
+    RECORD_FORMAT=csv split_records input
+    # every record spans exactly two lines in each output
+    for o in out.*; do
+        awk 'NR % 2 == 1 && !/^[0-9]+,"quoted$/ { exit 1 }
+             NR % 2 == 0 && !/^newline",x$/     { exit 1 }
+             END { exit NR % 2 }' $o
+    done
+    cmp <(seq 100000) <(cat out.* | grep -o '^[0-9]*' | sort -n)
+}
@@ -30,3 +30,14 @@ load test_helpers
     echo $numout output lines consumed slowly
     [[ $numout -eq $numin ]]
 }
+
+@test "zero-copy to a named pipe whose reader splices it further" {
+    seq 1000000 >i
+    rm -f o
+    mkfifo o
+    # the pages moved through stay referenced until the sink reads them
+    splice_through <o | { sleep 1; cat; } >ls &
+    ZEROCOPY=1 timeout 60 mkmimo i \> o
+    wait
+    cmp i ls
+}
@@ -0,0 +1,33 @@
+#!/usr/bin/env bats
+load test_helpers
+
+@test "sort -m emulation (10 sorted inputs, 1 output)" {
+    numins=10
+    numlines=100000
+    for j in $(seq $numins); do
+        seq $j $numins $(($numins * $numlines)) | LC_ALL=C sort >input.$j
+    done
+    MERGE=1 mkmimo input.* \> out
+    cmp <(LC_ALL=C sort -m input.*) out
+}
+
+@test "sort -m emulation by a key field with an input lagging behind" {
+    numlines=100000
+    seq $numlines | awk '{ print $1 % 1000 "\t" $1 }' | LC_ALL=C sort -s -t$'\t' -k1,1 >a
+    seq $numlines | awk '{ print $1 % 777 "\tb" $1 }' | LC_ALL=C sort -s -t$'\t' -k1,1 >b
+    MERGE=1 MERGE_FIELD=1 READ_AHEAD=1 BLOCKSIZE=512 \
+        mkmimo a <(sleep 1; cat b) \> out
+    cmp <(LC_ALL=C sort -s -m -t$'\t' -k1,1 a b) out
+}
+
+@test "sort -m emulation partitioned by key" {
+    numouts=4
+    numlines=100000
+    for j in 1 2 3; do
+        seq $numlines | awk -v j=$j '{ print $1 % 97 j }' | LC_ALL=C sort >input.$j
+    done
+    seq $numouts | split -n r/$numouts - out.
+    MERGE=1 PARTITION_BYTES=1-2 mkmimo input.* \> out.*
+    for out in out.*; do LC_ALL=C sort -c $out; done
+    cmp <(sort input.*) <(sort out.*)
+}
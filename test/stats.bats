@@ -0,0 +1,21 @@
+#!/usr/bin/env bats
+load test_helpers
+
+@test "exporting what went through every stream as JSON lines" {
+    numlines=1000000
+    seq $numlines >input
+    STATS_FILE=stats.jsonl mkmimo input \> out.1 out.2
+    cmp input <(sort -n out.*)
+    # the last line of every stream holds its totals
+    tail -n 3 stats.jsonl >totals
+    grep -q "^{\"time\":[0-9.]*,\"stream\":\"input\",\"name\":\"input\",\"bytes\":$(wc -c <input),\"records\":$numlines," totals
+    [[ $(grep -c '"stream":"output",' totals) -eq 2 ]]
+    [[ $(( $(grep -o '"records":[0-9]*' totals | tail -n 2 | cut -d: -f2 | paste -sd+) )) -eq $numlines ]]
+}
+
+@test "exporting stats periodically while records flow" {
+    { seq 1000; sleep 1; seq 1000; } | STATS_FILE=stats.jsonl STATS_INTERVAL=100 mkmimo out
+    # a line for the input and the output every interval
+    [[ $(grep -c '"stream":"output"' stats.jsonl) -ge 5 ]]
+    tail -n 1 stats.jsonl | grep -q '"records":2000,'
+}